@@ -0,0 +1,220 @@
+#include "blockcache.h"
+
+//
+// Definitions
+//
+
+static u32 CacheHash(const BlockCache *p_bc, u32 block)
+{
+	return (block * 2654435761u) >> (32 - p_bc->HashBits);
+}
+
+static void CacheUnlink(CacheEntry *p_ent)
+{
+	p_ent->Prev->Next = p_ent->Next;
+	p_ent->Next->Prev = p_ent->Prev;
+}
+
+// Newest end when it is used, oldest end when it holds nothing
+static void CacheLink(BlockCache *p_bc, CacheEntry *p_ent, boolean isNewest)
+{
+	CacheEntry *p_prev = isNewest ? &p_bc->Lru : p_bc->Lru.Prev;
+
+	p_ent->Prev = p_prev;
+	p_ent->Next = p_prev->Next;
+	p_prev->Next->Prev = p_ent;
+	p_prev->Next = p_ent;
+}
+
+static void CacheUnhash(BlockCache *p_bc, CacheEntry *p_ent)
+{
+	CacheEntry **pp_ent = &p_bc->Buckets[CacheHash(p_bc, p_ent->Block)];
+
+	while (*pp_ent != p_ent)
+	{
+		pp_ent = &(*pp_ent)->HashNext;
+	}
+	*pp_ent = p_ent->HashNext;
+	p_ent->Block = CACHE_NO_BLOCK;
+	p_bc->Used -= 1;
+}
+
+static void CacheRelease(BlockCache *p_bc)
+{
+	for (u32 i = 0; i < p_bc->Count; i++)
+	{
+		HeapFree(p_bc->Arena, p_bc->Entries[i].Data);
+	}
+	HeapFree(p_bc->Arena, p_bc->Entries);
+	HeapFree(p_bc->Arena, p_bc->Buckets);
+	p_bc->Entries = NULL;
+	p_bc->Buckets = NULL;
+	p_bc->Count = 0;
+	p_bc->Used = 0;
+	p_bc->Lru.Next = &p_bc->Lru;
+	p_bc->Lru.Prev = &p_bc->Lru;
+}
+
+// An empty cache over a device of the given size, CacheSetBudget() gives it memory
+void CacheInit(BlockCache *p_bc, Heap *p_heap, CacheRead read, void *p_ctx, u32 blocks)
+{
+	ZeroMemory(p_bc, sizeof(BlockCache));
+	p_bc->Arena = p_heap;
+	p_bc->Read = read;
+	p_bc->Ctx = p_ctx;
+	p_bc->Blocks = blocks;
+	p_bc->Lru.Next = &p_bc->Lru;
+	p_bc->Lru.Prev = &p_bc->Lru;
+}
+
+// Drops every block and takes as many CACHE_BLOCK_SZ pages from the heap
+// as the budget allows, short of the share it keeps free; Budget is what
+// it got, maybe less than asked. Fails only while a block is pinned, and
+// then leaves the cache as it was.
+errno_t CacheSetBudget(BlockCache *p_bc, size_t bytes)
+{
+	Heap *p_heap = p_bc->Arena;
+	size_t want = bytes / CACHE_BLOCK_SZ;
+	size_t keep = p_heap->Pages >> CACHE_HEAP_KEEP_SHIFT;
+	size_t room;
+	u32 bits = 1;
+	u32 i;
+
+	if (p_bc->Pinned != 0)
+	{
+		return FAIL;
+	}
+	CacheRelease(p_bc);
+	p_bc->Budget = 0;
+	room = (p_heap->FreePages > keep) ? (p_heap->FreePages - keep) / (CACHE_BLOCK_SZ / HEAP_PAGE_SZ) : 0;
+	want = (room < want) ? room : want;
+	if (want == 0)
+	{
+		return SUCCESS;
+	}
+	while ((1u << bits) < want)
+	{
+		bits++;
+	}
+	p_bc->HashBits = bits;
+	p_bc->Entries = (CacheEntry *)HeapAlloc(p_heap, want * sizeof(CacheEntry));
+	p_bc->Buckets = (CacheEntry **)HeapAlloc(p_heap, sizeof(CacheEntry *) << bits);
+	if (p_bc->Entries == NULL || p_bc->Buckets == NULL)
+	{
+		CacheRelease(p_bc);
+		return SUCCESS;
+	}
+	ZeroMemory(p_bc->Buckets, sizeof(CacheEntry *) << bits);
+	for (i = 0; i < want; i++)
+	{
+		// The tables took pages too, the last blocks may not fit any more
+		if (p_heap->FreePages < keep + CACHE_BLOCK_SZ / HEAP_PAGE_SZ)
+		{
+			break;
+		}
+		p_bc->Entries[i].Data = (u8 *)HeapAlloc(p_heap, CACHE_BLOCK_SZ);
+		if (p_bc->Entries[i].Data == NULL)
+		{
+			break;
+		}
+		p_bc->Entries[i].Block = CACHE_NO_BLOCK;
+		p_bc->Entries[i].Pins = 0;
+		p_bc->Entries[i].HashNext = NULL;
+		CacheLink(p_bc, &p_bc->Entries[i], FALSE);
+	}
+	p_bc->Count = i;
+	p_bc->Budget = (size_t)i * CACHE_BLOCK_SZ;
+	return SUCCESS;
+}
+
+// A pass over more blocks than the cache holds would evict every block
+// before the next pass came back to it. Only the Count blocks from first
+// on go through the cache, so they are still there for the next pass; the
+// caller reads the blocks from the one returned on around it.
+u32 CacheScanEnd(const BlockCache *p_bc, u32 first)
+{
+	return (p_bc->Count < CACHE_NO_BLOCK - first) ? first + p_bc->Count : CACHE_NO_BLOCK;
+}
+
+// The block pinned in memory, read from the device on a miss. The oldest
+// unpinned entry makes room. NULL past the end of the device, on a read
+// error, or with every entry pinned.
+CacheEntry *CacheGet(BlockCache *p_bc, u32 block)
+{
+	CacheEntry *p_ent;
+
+	if (p_bc->Count == 0 || block >= p_bc->Blocks)
+	{
+		return NULL;
+	}
+	for (p_ent = p_bc->Buckets[CacheHash(p_bc, block)]; p_ent != NULL; p_ent = p_ent->HashNext)
+	{
+		if (p_ent->Block == block)
+		{
+			break;
+		}
+	}
+
+	if (p_ent != NULL)
+	{
+		p_bc->Stats.Hits += 1;
+	}
+	else
+	{
+		p_bc->Stats.Misses += 1;
+		for (p_ent = p_bc->Lru.Prev; p_ent != &p_bc->Lru && p_ent->Pins != 0; p_ent = p_ent->Prev)
+		{
+			continue;
+		}
+		if (p_ent == &p_bc->Lru)
+		{
+			p_bc->Stats.Stalls += 1;
+			return NULL;
+		}
+		if (p_ent->Block != CACHE_NO_BLOCK)
+		{
+			p_bc->Stats.Evictions += 1;
+			CacheUnhash(p_bc, p_ent);
+		}
+		if (p_bc->Read(p_bc->Ctx, block, p_ent->Data) != SUCCESS)
+		{
+			p_bc->Stats.Errors += 1;
+			CacheUnlink(p_ent);
+			CacheLink(p_bc, p_ent, FALSE);
+			return NULL;
+		}
+		p_ent->Block = block;
+		p_ent->HashNext = p_bc->Buckets[CacheHash(p_bc, block)];
+		p_bc->Buckets[CacheHash(p_bc, block)] = p_ent;
+		p_bc->Used += 1;
+	}
+
+	p_bc->Pinned += (p_ent->Pins == 0);
+	p_ent->Pins += 1;
+	CacheUnlink(p_ent);
+	CacheLink(p_bc, p_ent, TRUE);
+	return p_ent;
+}
+
+void CachePut(BlockCache *p_bc, CacheEntry *p_ent)
+{
+	p_ent->Pins -= 1;
+	p_bc->Pinned -= (p_ent->Pins == 0);
+}
+
+// Forgets the unpinned blocks, the next reads go to the device
+void CacheFlush(BlockCache *p_bc)
+{
+	CacheEntry *p_ent;
+
+	for (u32 i = 0; i < p_bc->Count; i++)
+	{
+		p_ent = &p_bc->Entries[i];
+		if (p_ent->Block != CACHE_NO_BLOCK && p_ent->Pins == 0)
+		{
+			CacheUnhash(p_bc, p_ent);
+			CacheUnlink(p_ent);
+			CacheLink(p_bc, p_ent, FALSE);
+		}
+	}
+}
@@ -0,0 +1,68 @@
+#ifndef BLOCKCACHE_H
+#define BLOCKCACHE_H
+
+//
+// Cache of fixed-size device blocks in heap pages. Entries are found
+// through a hash table keyed by block number and evicted in LRU order; a
+// pinned entry stays until it is put back. Built into the kernel and into
+// the host fuzzer.
+//
+
+#include "heap.h"
+
+#define CACHE_BLOCK_SZ HEAP_PAGE_SZ		// One heap page per block
+#define CACHE_NO_BLOCK ((u32)0xFFFFFFFF)
+#define CACHE_HEAP_KEEP_SHIFT 2			// A quarter of the heap stays free for everything else
+#define CACHE_BUDGET_DEFAULT ((size_t)0x00200000)	// Block data, half the default kernel heap
+
+// Fills p_buf with CACHE_BLOCK_SZ bytes of the block
+typedef errno_t (*CacheRead)(void *p_ctx, u32 block, u8 *p_buf);
+
+typedef struct _CacheEntry
+{
+	u32 Block;						// CACHE_NO_BLOCK while it holds nothing
+	u32 Pins;						// Users between CacheGet() and CachePut()
+	u8 *Data;
+	struct _CacheEntry *HashNext;
+	struct _CacheEntry *Next;		// LRU ring, from newer to older
+	struct _CacheEntry *Prev;
+} CacheEntry;
+
+typedef struct _CacheStats
+{
+	u32 Hits;
+	u32 Misses;
+	u32 Evictions;
+	u32 Stalls;						// Misses with every entry pinned
+	u32 Errors;
+} CacheStats;
+
+typedef struct _BlockCache
+{
+	Heap *Arena;
+	CacheRead Read;
+	void *Ctx;
+	u32 Blocks;						// Device size, blocks from it on are refused
+	size_t Budget;					// Bytes of blocks held, not the bytes asked for
+	CacheEntry *Entries;
+	u32 Count;
+	u32 Used;						// Entries holding a block
+	u32 Pinned;						// Entries with Pins != 0
+	CacheEntry **Buckets;
+	u32 HashBits;
+	CacheEntry Lru;					// Next is the newest entry, Prev the next victim
+	CacheStats Stats;
+} BlockCache;
+
+//
+// Prototypes
+//
+
+void CacheInit(BlockCache *p_bc, Heap *p_heap, CacheRead read, void *p_ctx, u32 blocks);
+errno_t CacheSetBudget(BlockCache *p_bc, size_t bytes);
+CacheEntry *CacheGet(BlockCache *p_bc, u32 block);
+void CachePut(BlockCache *p_bc, CacheEntry *p_ent);
+void CacheFlush(BlockCache *p_bc);
+u32 CacheScanEnd(const BlockCache *p_bc, u32 first);
+
+#endif // BLOCKCACHE_H
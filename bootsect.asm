@@ -1,67 +1,88 @@
 .att_syntax
 
+# Stage 1 is the boot sector: it asks for the search mode and loads stage 2
+# from the sectors right behind it. Stage 2 loads the kernel image from
+# the drive after the boot drive (floppy 2 after floppy 1, the second hard
+# disk after the first) chunk by chunk, whole tracks over CHS or, on a hard
+# disk with the INT 13h extensions, up to 64 sectors by LBA, and copies every chunk to the load address from
+# the image header through a 32-bit flat data segment (unreal mode). A
+# packed image (host/lzpack) is copied to 1 MB instead and unpacked to the
+# load address once in protected mode. A RAM disk image (host/mkdisk) may
+# follow the kernel image on the same disk; it is copied to 16 MB as is.
+
+.set bounce_seg, 0x7000 # Disk reads land here, 64 KB aligned for floppy DMA
+.set bounce_phys, 0x70000
+.set bounce_sectors, 64
+.set kernel_magic, 0x4b534f53 # "SOSK" at offset 8 of the image
+.set kernel_lz_magic, 0x5a534f53 # "SOSZ", the same header packed by host/lzpack
+.set lz_header_size, 24
+.set lz_stage, 0x100000 # Packed image, later the kernel heap
+.set ramdisk_magic, 0x52534f53 # "SOSR" at offset 0 of the RAM disk header sector
+.set ramdisk_base, 0x1000000 # 16 MB, above the kernel heap
+.set chs_default_spt, 18
+.set chs_default_heads, 2
+.set disk_tries, 3
+
+# Boot info for the kernel, see BootInfo in kernel.cpp
+.set boot_info, 0xbf00
+.set boot_sectors, boot_info + 0 # .long, sectors loaded, RAM disk included
+.set boot_ticks, boot_info + 4 # .long, BIOS ticks the load took
+.set boot_reads, boot_info + 8 # .word, int 0x13 reads
+.set boot_retries, boot_info + 10 # .word, failed tries
+.set boot_method, boot_info + 12 # .byte, 1 CHS tracks, 2 LBA
+.set boot_packed, boot_info + 13 # .byte, 1 when the image was unpacked
+.set boot_image, boot_info + 16 # .long, unpacked image size
+.set boot_disk_base, boot_info + 20 # .long, RAM disk address
+.set boot_disk_size, boot_info + 24 # .long, RAM disk bytes, 0 without one
+.set boot_mode, 0xbf1c # .long, kernel MATCHER_* id
+
 .code16
 .global _start
 
 _start:
+	# Flat segments, stack right below the boot sector
+	cli
+	xorw %ax, %ax
+	movw %ax, %ds
+	movw %ax, %es
+	movw %ax, %ss
+	movl $0x7c00, %esp
+	sti
+	ljmp $0, $stage1
+stage1:
+	movb %dl, boot_drive
+	movw $boot_info, %di
+	movw $14, %cx
+	cld
+	rep stosw
+
 	# Text mode
 	movb $0x00, %ah
 	movb $0x03, %al
 	int $0x10
 
-	# Get mode ("bm" or "std")
+	# Get search mode, see {boot_modes}
+	movw $str_prompt, %bx
+	call puts
 	call set_stringos_mode
 
 	# Write result of set_stringos_mode() to {mode}
 	movw $mode, %bx
 	movb %al, 0(%bx)
-	
-# Allocates memory on drive
-load_drive:
-	# 1st Head
+
+	# Stage 2 follows the boot sector on the boot drive
 	movb $0x02, %ah # Function "read"
-	movb $0x7f, %al # Number of sectors to read (0x01 .. 0x80)
-	movb $0x01, %cl # First available sector (remember that bootloader on floopy1)
+	movb $stage2_sectors, %al
+	movb $0x02, %cl # Sector right after the boot sector
 	movb $0x00, %dh # Head number
 	movb $0x00, %ch # Cylinder
-	movb $0x01, %dl # Disk number, floppy2
-	movw $0x1000, %bx
-	movw %bx, %es
-	xorw %bx, %bx
-	int $0x13
-
-set_protected_mode:
-	cli
-	lgdt gdt_info
-	inb $0x92, %al
-	orb $2, %al
-	outb %al, $0x92
-	movl %cr0, %eax
-	orb $1, %al
-	movl %eax, %cr0
-	ljmp $0x8, $protected_mode
-
-.code32
-protected_mode:
-
-start_kernel:
-	# Selectors loading
-	movw $0x10, %ax
-	movw %ax, %es
-	movw %ax, %ds
-	movw %ax, %ss
-
-	# Mode for kernel
-	movl $mode, %ebx
-	movl 0(%ebx), %eax
-	movl $0xbf1c, %ebx
-	movl %eax, 0(%ebx)
-
-	# Start kernel
-	call 0x10000
+	movb boot_drive, %dl
+	movw $stage2, %bx
+	call disk_call
+	jc boot_fail
+	jmp stage2
 
 # # # # # # FUNCTIONS # # # # # #
-.code16
 # Reads a byte to %al
 get_char:
 	movb $0x00, %ah # Key read function
@@ -70,83 +91,71 @@ get_char:
 	int $0x10
 	ret
 
-# Returns stringos mode in %al ("bm" (0) or "std" (1))
+# Returns stringos mode in %al, the index of the {boot_modes} entry typed last
 set_stringos_mode:
 	pusha
-	movw $last_chars_buf, %bx
-	movw %bx, %di
-	addw $0x02, %di
+	cld # Clear D (direction flag) for lodsb
 
 set_stringos_mode_loop:
 	call get_char
-	call update_last_chars
-	movb %al, 2(%bx) # Move new byte to 3rd position
 
-	# Check for matching to "std" or "bm"
-	call is_std
-	cmpb $0x00, %al
-	je set_stringos_mode_std
+	# Keep the last 4 chars: drop the oldest, append the new one
+	movl last_chars_buf, %edx
+	shrl $8, %edx
+	movl %edx, last_chars_buf
+	movb %al, last_chars_buf + 3
 
-	call is_bm
-	cmpb $0x00, %al
-	je set_stringos_mode_bm
+	xorw %cx, %cx
 
-	jmp set_stringos_mode_loop
+set_stringos_mode_entry:
+	movw %cx, %si
+	shlw $2, %si
+	addw $boot_modes, %si
+	movw $last_chars_buf, %di
+	movb $0x04, %dl
 
-set_stringos_mode_std:
-	popa
-	movb $0x00, %al
-	ret
+set_stringos_mode_byte:
+	lodsb
+	testb %al, %al # Padding matches anything
+	jz set_stringos_mode_next
+	cmpb 0(%di), %al
+	jne set_stringos_mode_miss
+set_stringos_mode_next:
+	incw %di
+	decb %dl
+	jnz set_stringos_mode_byte
 
-set_stringos_mode_bm:
+	movb %cl, mode
 	popa
-	movb $0x01, %al
+	movb mode, %al
 	ret
 
-# Updates history of pressed keys, {last_chars_buf}
-# Moves items like this: [ 's', 't', 'r', 0 ] => [ 't', 'r', 'r', 0 ]
-update_last_chars:
-	pusha
-	movb 2(%bx), %al
-	movb 1(%bx), %ah
-	movb %al, 1(%bx)
-	movb %ah, 0(%bx)
-	popa
-	ret
+set_stringos_mode_miss:
+	incw %cx
+	cmpw $boot_modes_count, %cx
+	jb set_stringos_mode_entry
+	jmp set_stringos_mode_loop
 
-# Sets %al as 0, if {last_chars_buf} stores "std"
-is_std:
+# int 0x13 with the registers as given, tried {disk_tries} times with a
+# drive reset in between. CF is set when every try failed.
+disk_call:
+	pushw %di
+	movw $disk_tries, %di
+disk_call_try:
 	pusha
-	cld # Clear D (direction flag)
-	movw $0x04, %cx
-	movw $str_std, %si
-	movw $last_chars_buf, %di
-	repe cmpsb
-	jcxz is_std_true
-	popa
-	movb $0xFF, %al
-	ret
-is_std_true:
+	int $0x13
 	popa
-	movb $0x00, %al
-	ret
-
-# Sets %al as 0, if {last_chars_buf} stores "bm"
-is_bm:
+	jnc disk_call_done
+	incw boot_retries
 	pusha
-	cld # Clear D (direction flag)
-	movw $0x03, %cx
-	movw $str_bm, %si
-	movw $last_chars_buf, %di
-	incw %di # We need to check only 2 bytes
-	repe cmpsb
-	jcxz is_bm_true
-	popa
-	movb $0xFF, %al
-	ret
-is_bm_true:
+	movb $0x00, %ah # Reset
+	int $0x13
 	popa
-	movb $0x00, %al
+	decw %di
+	jnz disk_call_try
+	stc
+disk_call_done:
+	popw %di
 	ret
 
 # Prints string with '\n\r'
@@ -168,19 +177,41 @@ end_puts:
 	popa
 	ret
 
+boot_fail:
+	movw $str_disk_error, %bx
+halt_with:
+	call puts
+halt_loop:
+	hlt
+	jmp halt_loop
+
 # # # # # # D A T A # # # # # #
-str_std:
-	.asciz "std"
+str_prompt:
+	.asciz "Mode: std bm hp qs tw gs auto"
+
+str_disk_error:
+	.asciz "Disk read error"
 
-str_bm:
-	.asciz "bm"
+# Boot keys right-aligned in 4 bytes, index = kernel MATCHER_* id
+boot_modes:
+	.byte 0x00, 's', 't', 'd' # std, naive
+	.byte 0x00, 0x00, 'b', 'm' # bm, bad-character Boyer-Moore
+	.byte 0x00, 0x00, 'h', 'p' # horspool
+	.byte 0x00, 0x00, 'q', 's' # sunday (quick search)
+	.byte 0x00, 0x00, 't', 'w' # twoway
+	.byte 0x00, 0x00, 'g', 's' # bmgs, Boyer-Moore with good suffix
+	.byte 'a', 'u', 't', 'o' # auto
+.set boot_modes_count, (. - boot_modes) / 4
 
 last_chars_buf:
-	.byte 0x00, 0x00, 0x00, 0x00 # Keeps 3 last chars entered
+	.byte 0x00, 0x00, 0x00, 0x00 # Keeps 4 last chars entered
 
 mode:
 	.byte 0x00, 0x00, 0x00, 0x00
 
+boot_drive:
+	.byte 0x00
+
 gdt:
 	.byte 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00
 	.byte 0xff, 0xff, 0x00, 0x00, 0x00, 0x9A, 0xCF, 0x00
@@ -194,3 +225,358 @@ gdt_info:
 unreachable:
 	.zero (510 - (. - _start))
 	.byte 0x55, 0xAA
+
+# # # # # # S T A G E  2 # # # # # #
+stage2:
+	# A20 first, the load address may be above 1 MB
+	inb $0x92, %al
+	orb $2, %al
+	outb %al, $0x92
+	call unreal
+
+	movb $0x00, %ah # BIOS ticks since midnight
+	int $0x1a
+	shll $16, %ecx
+	movw %dx, %cx
+	movl %ecx, start_ticks
+
+	# The kernel image is on the drive right after the boot drive
+	movb boot_drive, %dl
+	incb %dl
+	movb %dl, kernel_drive
+
+	# Whole tracks over CHS unless a hard disk takes packet (LBA) reads
+	movb $0x01, boot_method
+	testb $0x80, %dl
+	jz stage2_geometry
+	movb $0x41, %ah
+	movw $0x55AA, %bx
+	int $0x13
+	jc stage2_geometry
+	cmpw $0xAA55, %bx
+	jne stage2_geometry
+	testb $0x01, %cl
+	jz stage2_geometry
+	movb $0x02, boot_method
+	jmp stage2_header
+
+stage2_geometry:
+	movb $0x08, %ah # Drive parameters
+	movb kernel_drive, %dl
+	xorw %di, %di
+	int $0x13
+	pushw $0
+	popw %es # Pointed at the floppy parameter table
+	jc stage2_header
+	andb $0x3f, %cl
+	jz stage2_header
+	movb %cl, chs_spt
+	incb %dh
+	movb %dh, chs_heads
+
+stage2_header:
+	# The first chunk holds the header, the rest of the image follows it
+	movw $bounce_sectors, %cx
+	call read_chunk
+	jc boot_fail
+	pushw $bounce_seg
+	popw %fs
+	movl %fs:12, %eax # Load address, also the entry point
+	movl %eax, load_dest
+	movl %eax, load_entry
+	movl %fs:16, %eax # Bytes on disk
+	movl %eax, boot_image
+	cmpl $kernel_magic, %fs:8
+	je stage2_sectors_left
+	cmpl $kernel_lz_magic, %fs:8
+	jne stage2_bad_image
+	movb $0x01, boot_packed
+	movl $lz_stage, load_dest
+	movl %fs:20, %edx
+	movl %edx, boot_image
+stage2_sectors_left:
+	addl $511, %eax
+	shrl $9, %eax
+	movl %eax, load_left
+	movl %eax, boot_sectors
+	call load_rest
+	jc boot_fail
+
+	# The first chunk may have read past the image, the RAM disk header
+	# sector is the one right behind it. No header, no RAM disk.
+	movl boot_sectors, %eax
+	movl %eax, load_lba
+	movw $1, %cx
+	call read_chunk
+	jc stage2_done
+	cmpl $ramdisk_magic, %fs:0
+	jne stage2_done
+	movl $ramdisk_base, load_dest
+	movl $ramdisk_base, boot_disk_base
+	movl %fs:4, %eax # Bytes
+	movl %eax, boot_disk_size
+	addl $511, %eax
+	shrl $9, %eax
+	movl %eax, load_left
+	incl %eax
+	addl %eax, boot_sectors
+	xorw %cx, %cx # The header sector itself is not copied
+	call load_rest
+	jc boot_fail
+
+stage2_done:
+	movb $0x00, %ah
+	int $0x1a
+	shll $16, %ecx
+	movw %dx, %cx
+	subl start_ticks, %ecx
+	jns stage2_ticks
+	addl $0x1800B0, %ecx # Midnight passed
+stage2_ticks:
+	movl %ecx, boot_ticks
+	jmp set_protected_mode
+
+stage2_bad_image:
+	movw $str_bad_image, %bx
+	jmp halt_with
+
+# Copies the %cx sectors in the bounce buffer to {load_dest}, then reads
+# and copies the rest of {load_left} sectors. CF on a read error.
+load_rest:
+	movzwl %cx, %ecx
+	cmpl load_left, %ecx
+	jbe load_rest_copy
+	movl load_left, %ecx
+load_rest_copy:
+	subl %ecx, load_left
+	call copy_chunk
+	cmpl $0, load_left
+	je load_rest_done # CF is clear
+	movw $bounce_sectors, %cx
+	cmpl $bounce_sectors, load_left
+	jae load_rest_read
+	movw load_left, %cx
+load_rest_read:
+	call read_chunk
+	jnc load_rest
+load_rest_done:
+	ret
+
+# Reads up to %cx sectors from {load_lba} of the kernel drive into the
+# bounce buffer and advances {load_lba}. Returns the count read in %cx,
+# over CHS that is at most the rest of the current track. CF on error.
+read_chunk:
+	pushw %es
+	pushw $bounce_seg
+	popw %es
+	cmpb $0x02, boot_method
+	jne read_chunk_chs
+
+	movw %cx, dap_count
+	movl load_lba, %eax
+	movl %eax, dap_lba
+	movb $0x42, %ah
+	movb kernel_drive, %dl
+	movw $dap, %si
+	call disk_call
+	jmp read_chunk_done
+
+read_chunk_chs:
+	pushw %cx
+	movw load_lba, %ax
+	xorw %dx, %dx
+	movzbw chs_spt, %bx
+	divw %bx # %ax track, %dx sector in the track
+	movw %bx, %cx
+	subw %dx, %cx # Sectors left on the track
+	movw %dx, %si
+	xorw %dx, %dx
+	movzbw chs_heads, %bx
+	divw %bx # %ax cylinder, %dx head
+	popw %bx
+	cmpw %bx, %cx
+	jbe read_chunk_count
+	movw %bx, %cx
+read_chunk_count:
+	pushw %cx
+	movb %dl, %dh
+	movb %al, %ch # Cylinder bits 0-7
+	shlb $6, %ah
+	movw %si, %bx
+	incw %bx
+	movb %bl, %cl
+	orb %ah, %cl # Sector, cylinder bits 8-9 on top
+	popw %ax
+	pushw %ax
+	movb $0x02, %ah
+	movb kernel_drive, %dl
+	xorw %bx, %bx
+	call disk_call
+	popw %cx
+
+read_chunk_done:
+	popw %es
+	jc read_chunk_fail
+	incw boot_reads
+	movzwl %cx, %eax
+	addl %eax, load_lba
+	clc
+read_chunk_fail:
+	ret
+
+# Copies %ecx sectors from the bounce buffer to {load_dest} and advances it
+copy_chunk:
+	pushw %ds
+	pushw %es
+	call unreal
+	xorw %ax, %ax
+	movw %ax, %ds
+	movw %ax, %es
+	movl $bounce_phys, %esi
+	movl load_dest, %edi
+	shll $7, %ecx # Dwords
+	cld
+	addr32 rep movsl
+	movl %edi, load_dest
+	popw %es
+	popw %ds
+	ret
+
+# Unreal mode: loads %ds and %es once in protected mode so that their 4 GB
+# limit stays after the switch back. Redone before each copy because the
+# BIOS may reload the segments in between.
+unreal:
+	cli
+	pushw %ds
+	pushw %es
+	lgdt gdt_info
+	movl %cr0, %eax
+	orb $1, %al
+	movl %eax, %cr0
+	jmp unreal_pm
+unreal_pm:
+	movw $0x10, %bx
+	movw %bx, %ds
+	movw %bx, %es
+	andb $0xFE, %al
+	movl %eax, %cr0
+	popw %es
+	popw %ds
+	sti
+	ret
+
+set_protected_mode:
+	cli
+	lgdt gdt_info
+	movl %cr0, %eax
+	orb $1, %al
+	movl %eax, %cr0
+	ljmp $0x8, $protected_mode
+
+.code32
+protected_mode:
+
+start_kernel:
+	# Selectors loading
+	movw $0x10, %ax
+	movw %ax, %es
+	movw %ax, %ds
+	movw %ax, %ss
+
+	# Mode for kernel
+	movl $mode, %ebx
+	movl 0(%ebx), %eax
+	movl $boot_mode, %ebx
+	movl %eax, 0(%ebx)
+
+	cmpb $0x00, boot_packed
+	je start_kernel_call
+	movl $lz_stage + lz_header_size, %esi
+	movl load_entry, %edi
+	movl %edi, %edx
+	addl boot_image, %edx
+	cld
+	call lz_unpack
+
+start_kernel_call:
+	# Start kernel
+	call *load_entry
+
+# LZ4 block decoder, see host/lzpack.cpp. %esi packed stream, %edi output,
+# %edx output end.
+lz_unpack:
+	movzbl 0(%esi), %ebx # Token
+	incl %esi
+	movl %ebx, %eax
+	shrl $4, %eax
+	call lz_length
+	movl %eax, %ecx
+	rep movsb # Literals
+	cmpl %edx, %edi
+	jae lz_unpack_done
+	movzwl 0(%esi), %ebp # Distance back
+	addl $2, %esi
+	movl %ebx, %eax
+	andl $0x0f, %eax
+	call lz_length
+	leal 4(%eax), %ecx
+	pushl %esi
+	movl %edi, %esi
+	subl %ebp, %esi
+	rep movsb # Match, bytewise so that it may overlap the output
+	popl %esi
+	jmp lz_unpack
+lz_unpack_done:
+	ret
+
+# Adds the extension bytes of a 4-bit length in %eax
+lz_length:
+	cmpl $15, %eax
+	jne lz_length_done
+lz_length_more:
+	movzbl 0(%esi), %ecx
+	incl %esi
+	addl %ecx, %eax
+	cmpl $255, %ecx
+	je lz_length_more
+lz_length_done:
+	ret
+
+.code16
+# # # # # # D A T A # # # # # #
+str_bad_image:
+	.asciz "No kernel image on the next drive"
+
+kernel_drive:
+	.byte 0x01 # Boot drive + 1
+
+chs_spt:
+	.byte chs_default_spt
+
+chs_heads:
+	.byte chs_default_heads
+
+# Disk address packet for int 0x13 function 0x42
+.balign 4
+dap:
+	.byte 0x10, 0x00
+dap_count:
+	.word 0x0000
+	.word 0x0000, bounce_seg # Buffer offset, segment
+dap_lba:
+	.long 0x00000000, 0x00000000
+
+start_ticks:
+	.long 0x00000000
+load_lba:
+	.long 0x00000000 # Next sector of the kernel drive
+load_dest:
+	.long 0x00000000
+load_left:
+	.long 0x00000000 # Sectors still to copy
+load_entry:
+	.long 0x00000000
+
+.balign 512
+stage2_end:
+.set stage2_sectors, (stage2_end - stage2) / 512
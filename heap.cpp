@@ -0,0 +1,255 @@
+#include "heap.h"
+
+//
+// Definitions
+//
+
+static u32 HeapPageIndex(const Heap *p_heap, const void *p_ptr)
+{
+	return (u32)(((const u8 *)p_ptr - p_heap->Base) >> HEAP_PAGE_SHIFT);
+}
+
+static u8 *HeapPage(const Heap *p_heap, u32 page)
+{
+	return p_heap->Base + ((size_t)page << HEAP_PAGE_SHIFT);
+}
+
+// Smallest order whose block holds the given number of pages
+static u32 HeapOrder(size_t pages)
+{
+	return (pages <= 1) ? 0 : 32 - __builtin_clz((u32)(pages - 1));
+}
+
+static void HeapListPush(Heap *p_heap, u32 page, u32 order)
+{
+	HeapLink *p_head = &p_heap->Orders[order];
+	HeapLink *p_link = (HeapLink *)HeapPage(p_heap, page);
+
+	p_link->Next = p_head->Next;
+	p_link->Prev = p_head;
+	p_head->Next->Prev = p_link;
+	p_head->Next = p_link;
+	p_heap->Map[page] = HEAP_MAP_FREE | order;
+	p_heap->OrderFree[order] += 1;
+	p_heap->FreePages += 1u << order;
+}
+
+static void HeapListRemove(Heap *p_heap, u32 page, u32 order)
+{
+	HeapLink *p_link = (HeapLink *)HeapPage(p_heap, page);
+
+	p_link->Prev->Next = p_link->Next;
+	p_link->Next->Prev = p_link->Prev;
+	p_heap->Map[page] = HEAP_MAP_TAIL;
+	p_heap->OrderFree[order] -= 1;
+	p_heap->FreePages -= 1u << order;
+}
+
+// The page map takes the first pages of the region, the rest is cut into
+// the largest naturally aligned blocks that fit
+errno_t HeapInit(Heap *p_heap, void *p_base, size_t size)
+{
+	u8 *p_start = (u8 *)(((size_t)p_base + HEAP_PAGE_SZ - 1) & ~(HEAP_PAGE_SZ - 1));
+	size_t pages;
+	size_t map_pages;
+	u32 page;
+	u32 order;
+
+	if ((u8 *)p_base + size <= p_start)
+	{
+		return FAIL;
+	}
+	pages = (size - (size_t)(p_start - (u8 *)p_base)) >> HEAP_PAGE_SHIFT;
+	map_pages = (pages + HEAP_PAGE_SZ - 1) >> HEAP_PAGE_SHIFT;
+	if (pages <= map_pages)
+	{
+		return FAIL;
+	}
+
+	ZeroMemory(p_heap, sizeof(Heap));
+	p_heap->Map = p_start;
+	p_heap->Base = p_start + (map_pages << HEAP_PAGE_SHIFT);
+	p_heap->Pages = (u32)(pages - map_pages);
+	g_prims.MemSet(p_heap->Map, HEAP_MAP_TAIL, p_heap->Pages);
+	for (order = 0; order < HEAP_ORDER_COUNT; order++)
+	{
+		p_heap->Orders[order].Next = &p_heap->Orders[order];
+		p_heap->Orders[order].Prev = &p_heap->Orders[order];
+	}
+	for (page = 0; page < p_heap->Pages; page += 1u << order)
+	{
+		order = (page != 0) ? __builtin_ctz(page) : HEAP_ORDER_COUNT - 1;
+		order = (order < HEAP_ORDER_COUNT) ? order : HEAP_ORDER_COUNT - 1;
+		while (page + (1u << order) > p_heap->Pages)
+		{
+			order--;
+		}
+		HeapListPush(p_heap, page, order);
+	}
+	return SUCCESS;
+}
+
+// Split the smallest free block that fits down to the wanted order
+static u8 *HeapPagesAlloc(Heap *p_heap, u32 order)
+{
+	u32 from;
+	u32 page;
+
+	for (from = order; from < HEAP_ORDER_COUNT && p_heap->OrderFree[from] == 0; from++)
+	{
+		continue;
+	}
+	if (from == HEAP_ORDER_COUNT)
+	{
+		return NULL;
+	}
+	page = HeapPageIndex(p_heap, p_heap->Orders[from].Next);
+	HeapListRemove(p_heap, page, from);
+	while (from > order)
+	{
+		from--;
+		HeapListPush(p_heap, page + (1u << from), from);
+	}
+	p_heap->Map[page] = HEAP_MAP_USED | order;
+	return HeapPage(p_heap, page);
+}
+
+// Merge with the buddy while it is a free block of the same order
+static void HeapPagesFree(Heap *p_heap, u32 page, u32 order)
+{
+	u32 buddy;
+
+	p_heap->Map[page] = HEAP_MAP_TAIL;
+	for (; order + 1 < HEAP_ORDER_COUNT; order++)
+	{
+		buddy = page ^ (1u << order);
+		if (buddy >= p_heap->Pages || p_heap->Map[buddy] != (HEAP_MAP_FREE | order))
+		{
+			break;
+		}
+		HeapListRemove(p_heap, buddy, order);
+		page = (page < buddy) ? page : buddy;
+	}
+	HeapListPush(p_heap, page, order);
+}
+
+// Objects are carved from the newest slab page only as they are needed
+static void *HeapSlabAlloc(Heap *p_heap, u32 cls)
+{
+	HeapClass *p_cls = &p_heap->Classes[cls];
+	size_t size = (size_t)1 << (cls + HEAP_CLASS_MIN_SHIFT);
+	void *p_obj;
+
+	if (p_cls->Free != NULL)
+	{
+		p_obj = p_cls->Free;
+		p_cls->Free = p_cls->Free->Next;
+	}
+	else
+	{
+		if (p_cls->Bump == p_cls->BumpEnd)
+		{
+			p_cls->Bump = HeapPagesAlloc(p_heap, 0);
+			if (p_cls->Bump == NULL)
+			{
+				p_cls->BumpEnd = NULL;
+				p_cls->Fails += 1;
+				return NULL;
+			}
+			p_heap->Map[HeapPageIndex(p_heap, p_cls->Bump)] = HEAP_MAP_SLAB | cls;
+			p_cls->BumpEnd = p_cls->Bump + HEAP_PAGE_SZ;
+			p_cls->Pages += 1;
+		}
+		p_obj = p_cls->Bump;
+		p_cls->Bump += size;
+	}
+	p_cls->Allocs += 1;
+	p_cls->InUse += 1;
+	p_cls->Peak = (p_cls->InUse > p_cls->Peak) ? p_cls->InUse : p_cls->Peak;
+	return p_obj;
+}
+
+void *HeapAlloc(Heap *p_heap, size_t size)
+{
+	u32 cls;
+	u32 order;
+	u8 *p_block = NULL;
+
+	if (size == 0)
+	{
+		return NULL;
+	}
+	if (size <= HEAP_CLASS_MAX)
+	{
+		cls = (size <= ((size_t)1 << HEAP_CLASS_MIN_SHIFT)) ? 0 : 32 - __builtin_clz((u32)(size - 1)) - HEAP_CLASS_MIN_SHIFT;
+		return HeapSlabAlloc(p_heap, cls);
+	}
+	order = HEAP_ORDER_COUNT;
+	if (size <= (HEAP_PAGE_SZ << (HEAP_ORDER_COUNT - 1)))
+	{
+		order = HeapOrder((size + HEAP_PAGE_SZ - 1) >> HEAP_PAGE_SHIFT);
+		p_block = HeapPagesAlloc(p_heap, order);
+	}
+	if (p_block == NULL)
+	{
+		p_heap->LargeFails += 1;
+		return NULL;
+	}
+	p_heap->LargeAllocs += 1;
+	p_heap->LargeInUse += 1u << order;
+	return p_block;
+}
+
+// Slab pages stay with their class once carved; large blocks go back to the buddies
+void HeapFree(Heap *p_heap, void *p_ptr)
+{
+	HeapClass *p_cls;
+	HeapLink *p_link;
+	u32 page;
+	u8 kind;
+
+	if (p_ptr == NULL)
+	{
+		return;
+	}
+	page = HeapPageIndex(p_heap, p_ptr);
+	kind = p_heap->Map[page];
+	if (kind & HEAP_MAP_SLAB)
+	{
+		p_cls = &p_heap->Classes[kind & HEAP_MAP_ARG];
+		p_link = (HeapLink *)p_ptr;
+		p_link->Next = p_cls->Free;
+		p_cls->Free = p_link;
+		p_cls->InUse -= 1;
+	}
+	else if (kind & HEAP_MAP_USED)
+	{
+		p_heap->LargeInUse -= 1u << (kind & HEAP_MAP_ARG);
+		HeapPagesFree(p_heap, page, kind & HEAP_MAP_ARG);
+	}
+}
+
+// Usable bytes behind a pointer returned by HeapAlloc()
+size_t HeapBlockSize(const Heap *p_heap, const void *p_ptr)
+{
+	u8 kind = p_heap->Map[HeapPageIndex(p_heap, p_ptr)];
+
+	if (kind & HEAP_MAP_SLAB)
+	{
+		return (size_t)1 << ((kind & HEAP_MAP_ARG) + HEAP_CLASS_MIN_SHIFT);
+	}
+	return (kind & HEAP_MAP_USED) ? HEAP_PAGE_SZ << (kind & HEAP_MAP_ARG) : 0;
+}
+
+// Pages in the biggest free block, what the next large allocation can get
+u32 HeapLargestFree(const Heap *p_heap)
+{
+	for (u32 order = HEAP_ORDER_COUNT; order > 0; order--)
+	{
+		if (p_heap->OrderFree[order - 1] != 0)
+		{
+			return 1u << (order - 1);
+		}
+	}
+	return 0;
+}
@@ -0,0 +1,72 @@
+#ifndef HEAP_H
+#define HEAP_H
+
+//
+// General purpose heap over one flat region. Small objects come from
+// power-of-two slab classes, everything bigger from a buddy allocator
+// over whole pages. Built into the kernel and into the host fuzzer.
+//
+
+#include "strcore.h"
+
+#define HEAP_PAGE_SHIFT 12
+#define HEAP_PAGE_SZ ((size_t)1 << HEAP_PAGE_SHIFT)
+#define HEAP_CLASS_MIN_SHIFT 4		// 16-byte objects, room for the free link
+#define HEAP_CLASS_COUNT 8			// 16 .. 2048 bytes
+#define HEAP_CLASS_MAX ((size_t)1 << (HEAP_CLASS_MIN_SHIFT + HEAP_CLASS_COUNT - 1))
+#define HEAP_ORDER_COUNT 16			// Buddy blocks of 1 .. 32768 pages
+
+#ifndef KHEAP_SIZE
+#define KHEAP_SIZE ((size_t)0x00400000)	// Kernel heap, override with -DKHEAP_SIZE for a bigger machine
+#endif
+
+// Page map byte: what the page at the same index holds
+#define HEAP_MAP_TAIL 0x00			// Inside a block, not its first page
+#define HEAP_MAP_SLAB 0x20			// Slab page, low bits are the class
+#define HEAP_MAP_USED 0x40			// Allocated block head, low bits are the order
+#define HEAP_MAP_FREE 0x80			// Free block head, low bits are the order
+#define HEAP_MAP_ARG 0x1F
+
+typedef struct _HeapLink
+{
+	struct _HeapLink *Next;
+	struct _HeapLink *Prev;			// Buddy lists only, slab lists are singly linked
+} HeapLink;
+
+typedef struct _HeapClass
+{
+	HeapLink *Free;
+	u8 *Bump;						// Uncarved part of the newest slab page
+	u8 *BumpEnd;
+	u32 Pages;
+	u32 InUse;
+	u32 Peak;
+	u32 Allocs;
+	u32 Fails;
+} HeapClass;
+
+typedef struct _Heap
+{
+	u8 *Map;						// One byte per page, see HEAP_MAP_*
+	u8 *Base;						// First page, HEAP_PAGE_SZ aligned
+	u32 Pages;
+	u32 FreePages;
+	HeapClass Classes[HEAP_CLASS_COUNT];
+	HeapLink Orders[HEAP_ORDER_COUNT];	// Circular free lists of buddy blocks
+	u32 OrderFree[HEAP_ORDER_COUNT];
+	u32 LargeInUse;					// Pages in allocated buddy blocks
+	u32 LargeAllocs;
+	u32 LargeFails;
+} Heap;
+
+//
+// Prototypes
+//
+
+errno_t HeapInit(Heap *p_heap, void *p_base, size_t size);
+void *HeapAlloc(Heap *p_heap, size_t size);
+void HeapFree(Heap *p_heap, void *p_ptr);
+size_t HeapBlockSize(const Heap *p_heap, const void *p_ptr);
+u32 HeapLargestFree(const Heap *p_heap);
+
+#endif // HEAP_H
@@ -0,0 +1,276 @@
+//
+// Packs kernel.bin for the stage-2 loader. The image is compressed in the
+// LZ4 block format and decoded by lz_unpack in bootsect.asm, so the floppy
+// holds fewer sectors to read.
+//
+// Packed image:
+//   0   zero padding, keeps the header where the raw image has it
+//   8   "SOSZ"
+//   12  load address, taken from the header of the raw image
+//   16  bytes on disk, this header included
+//   20  unpacked size
+//   24  LZ4 block
+//
+// Every sequence is a token (literal count in the high nibble, match
+// length - 4 in the low one, 15 meaning more length bytes follow), the
+// literals, then a 16-bit little-endian distance back into the output.
+// The last sequence has literals only and ends exactly at the unpacked size.
+//
+// Usage: lzpack <kernel.bin> <kernel.lz>
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define LZ_HEADER_SZ 24
+#define LZ_MIN_MATCH 4
+#define LZ_WINDOW 0xFFFF
+#define LZ_HASH_BITS 16
+#define LZ_CHAIN_DEPTH 512
+#define LZ_MAGIC_RAW "SOSK"
+#define LZ_MAGIC_PACKED "SOSZ"
+
+typedef unsigned char u8;
+typedef unsigned int u32;
+
+typedef struct _LzOut
+{
+	u8 *Buf;
+	size_t Len;
+} LzOut;
+
+static u32 LzHash(const u8 *p)
+{
+	u32 v = p[0] | (p[1] << 8) | (p[2] << 16) | ((u32)p[3] << 24);
+	return (v * 2654435761u) >> (32 - LZ_HASH_BITS);
+}
+
+static void LzLength(LzOut *p_out, size_t len)
+{
+	for (; len >= 255; len -= 255)
+	{
+		p_out->Buf[p_out->Len++] = 255;
+	}
+	p_out->Buf[p_out->Len++] = (u8)len;
+}
+
+static void LzSequence(LzOut *p_out, const u8 *p_lit, size_t litLen, size_t dist, size_t matchLen)
+{
+	size_t extra = (matchLen != 0) ? matchLen - LZ_MIN_MATCH : 0;
+
+	p_out->Buf[p_out->Len++] = (u8)(((litLen < 15) ? litLen : 15) << 4 | ((extra < 15) ? extra : 15));
+	if (litLen >= 15)
+	{
+		LzLength(p_out, litLen - 15);
+	}
+	memcpy(p_out->Buf + p_out->Len, p_lit, litLen);
+	p_out->Len += litLen;
+	if (matchLen == 0)
+	{
+		return;
+	}
+	p_out->Buf[p_out->Len++] = (u8)dist;
+	p_out->Buf[p_out->Len++] = (u8)(dist >> 8);
+	if (extra >= 15)
+	{
+		LzLength(p_out, extra - 15);
+	}
+}
+
+// Longest earlier match of p_in + pos along its hash chain
+static size_t LzFind(const u8 *p_in, size_t size, size_t pos, const int *p_head, const int *p_prev, size_t *p_dist)
+{
+	size_t best = 0;
+	size_t len;
+	int cand;
+
+	if (pos + LZ_MIN_MATCH > size)
+	{
+		return 0;
+	}
+	cand = p_head[LzHash(p_in + pos)];
+	for (int depth = 0; cand >= 0 && pos - (size_t)cand <= LZ_WINDOW && depth < LZ_CHAIN_DEPTH; depth++)
+	{
+		for (len = 0; pos + len < size && p_in[cand + len] == p_in[pos + len]; len++)
+		{
+			continue;
+		}
+		if (len > best)
+		{
+			best = len;
+			*p_dist = pos - (size_t)cand;
+		}
+		cand = p_prev[cand];
+	}
+	return (best >= LZ_MIN_MATCH) ? best : 0;
+}
+
+static void LzInsert(const u8 *p_in, size_t size, size_t pos, int *p_head, int *p_prev)
+{
+	u32 h;
+
+	if (pos + LZ_MIN_MATCH <= size)
+	{
+		h = LzHash(p_in + pos);
+		p_prev[pos] = p_head[h];
+		p_head[h] = (int)pos;
+	}
+}
+
+// Greedy parse with one step of lazy matching
+static void LzCompress(const u8 *p_in, size_t size, LzOut *p_out)
+{
+	int *p_head = (int *)malloc(sizeof(int) << LZ_HASH_BITS);
+	int *p_prev = (int *)malloc(sizeof(int) * (size + 1));
+	size_t anchor = 0;
+	size_t pos = 0;
+	size_t dist = 0;
+	size_t next_dist = 0;
+	size_t len;
+
+	memset(p_head, 0xFF, sizeof(int) << LZ_HASH_BITS);
+	while (pos < size)
+	{
+		len = LzFind(p_in, size, pos, p_head, p_prev, &dist);
+		if (len != 0)
+		{
+			LzInsert(p_in, size, pos, p_head, p_prev);
+			if (LzFind(p_in, size, pos + 1, p_head, p_prev, &next_dist) > len)
+			{
+				pos++;
+				continue;
+			}
+			LzSequence(p_out, p_in + anchor, pos - anchor, dist, len);
+			for (size_t i = 1; i < len; i++)
+			{
+				LzInsert(p_in, size, pos + i, p_head, p_prev);
+			}
+			pos += len;
+			anchor = pos;
+			continue;
+		}
+		LzInsert(p_in, size, pos, p_head, p_prev);
+		pos++;
+	}
+	LzSequence(p_out, p_in + anchor, size - anchor, 0, 0);
+	free(p_head);
+	free(p_prev);
+}
+
+// Reference decoder, every packed image is checked with it before it is written
+static size_t LzDecompress(const u8 *p_in, u8 *p_out, size_t size)
+{
+	size_t out = 0;
+	size_t len;
+	size_t dist;
+	u8 token;
+	u8 b;
+
+	while (out < size)
+	{
+		token = *p_in++;
+		len = token >> 4;
+		if (len == 15)
+		{
+			do
+			{
+				b = *p_in++;
+				len += b;
+			} while (b == 255);
+		}
+		memcpy(p_out + out, p_in, len);
+		p_in += len;
+		out += len;
+		if (out >= size)
+		{
+			break;
+		}
+		dist = p_in[0] | (p_in[1] << 8);
+		p_in += 2;
+		len = token & 15;
+		if (len == 15)
+		{
+			do
+			{
+				b = *p_in++;
+				len += b;
+			} while (b == 255);
+		}
+		for (len += LZ_MIN_MATCH; len; len--, out++)
+		{
+			p_out[out] = p_out[out - dist];
+		}
+	}
+	return out;
+}
+
+static u32 LzGet32(const u8 *p)
+{
+	return p[0] | (p[1] << 8) | (p[2] << 16) | ((u32)p[3] << 24);
+}
+
+static void LzPut32(u8 *p, u32 v)
+{
+	p[0] = (u8)v;
+	p[1] = (u8)(v >> 8);
+	p[2] = (u8)(v >> 16);
+	p[3] = (u8)(v >> 24);
+}
+
+int main(int argc, char **argv)
+{
+	FILE *p_file;
+	u8 *p_raw;
+	u8 *p_check;
+	LzOut out;
+	long size;
+
+	if (argc != 3)
+	{
+		fprintf(stderr, "Usage: lzpack <kernel.bin> <kernel.lz>\n");
+		return 2;
+	}
+	p_file = fopen(argv[1], "rb");
+	if (p_file == NULL)
+	{
+		perror(argv[1]);
+		return 1;
+	}
+	fseek(p_file, 0, SEEK_END);
+	size = ftell(p_file);
+	fseek(p_file, 0, SEEK_SET);
+	p_raw = (u8 *)malloc(size + 1);
+	if (size < LZ_HEADER_SZ || fread(p_raw, 1, size, p_file) != (size_t)size || memcmp(p_raw + 8, LZ_MAGIC_RAW, 4) != 0)
+	{
+		fprintf(stderr, "lzpack: %s is not a kernel image\n", argv[1]);
+		return 1;
+	}
+	fclose(p_file);
+
+	// Worst case: every byte a literal, one length byte per 255 of them
+	out.Buf = (u8 *)calloc(LZ_HEADER_SZ + size + size / 255 + 16, 1);
+	out.Len = LZ_HEADER_SZ;
+	LzCompress(p_raw, size, &out);
+	memcpy(out.Buf + 8, LZ_MAGIC_PACKED, 4);
+	LzPut32(out.Buf + 12, LzGet32(p_raw + 12));
+	LzPut32(out.Buf + 16, (u32)out.Len);
+	LzPut32(out.Buf + 20, (u32)size);
+
+	p_check = (u8 *)malloc(size);
+	if (LzDecompress(out.Buf + LZ_HEADER_SZ, p_check, size) != (size_t)size || memcmp(p_check, p_raw, size) != 0)
+	{
+		fprintf(stderr, "lzpack: round trip mismatch\n");
+		return 1;
+	}
+
+	p_file = fopen(argv[2], "wb");
+	if (p_file == NULL || fwrite(out.Buf, 1, out.Len, p_file) != out.Len)
+	{
+		perror(argv[2]);
+		return 1;
+	}
+	fclose(p_file);
+	printf("lzpack: %ld -> %zu bytes, %zu sectors\n", size, out.Len, (out.Len + 511) / 512);
+	return 0;
+}
@@ -0,0 +1,168 @@
+//
+// Builds the second floppy: the (packed) kernel image, then a RAM disk the
+// stage-2 loader copies to 16 MB. The RAM disk is the given files one after
+// another, or a generated text corpus.
+//
+// Disk image:
+//   0          kernel image, padded to a sector
+//   next       RAM disk header sector: "SOSR", then the byte count
+//   next + 1   RAM disk bytes, padded to a sector
+//
+// The image is padded to a 1.44 MB or 2.88 MB floppy so the geometry the
+// BIOS reports matches its size.
+//
+// With -d the image is a data disk for the ATA driver instead: the header
+// sector at LBA 0, the bytes from LBA 1, no kernel and no floppy padding.
+//
+// Usage: mkdisk <kernel.lz> <disk.img> [-w <bytes> | <file>...]
+//        mkdisk -d <disk.img> [-w <bytes> | <file>...]
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../strcore.h"
+
+#define DISK_SECTOR_SZ 512
+#define DISK_MAGIC "SOSR"
+#define DISK_SEED ((u32)0x5EED1234)
+
+static const size_t g_floppy_sizes[] = { 1474560, 2949120 };
+
+typedef struct _DiskBuf
+{
+	char *Buf;
+	size_t Len;
+	size_t Cap;
+} DiskBuf;
+
+static void DiskReserve(DiskBuf *p_disk, size_t len)
+{
+	if (p_disk->Len + len + 1 > p_disk->Cap)
+	{
+		p_disk->Cap = (p_disk->Len + len + 1) * 2;
+		p_disk->Buf = (char *)realloc(p_disk->Buf, p_disk->Cap);
+	}
+}
+
+static int DiskAppendFile(DiskBuf *p_disk, const char *p_path)
+{
+	FILE *p_file = fopen(p_path, "rb");
+	long size;
+
+	if (p_file == NULL)
+	{
+		perror(p_path);
+		return 1;
+	}
+	fseek(p_file, 0, SEEK_END);
+	size = ftell(p_file);
+	fseek(p_file, 0, SEEK_SET);
+	DiskReserve(p_disk, (size_t)size);
+	if (fread(p_disk->Buf + p_disk->Len, 1, size, p_file) != (size_t)size)
+	{
+		perror(p_path);
+		return 1;
+	}
+	p_disk->Len += size;
+	fclose(p_file);
+	return 0;
+}
+
+static void DiskPad(DiskBuf *p_disk, size_t to)
+{
+	DiskReserve(p_disk, to - p_disk->Len);
+	memset(p_disk->Buf + p_disk->Len, 0, to - p_disk->Len);
+	p_disk->Len = to;
+}
+
+static size_t DiskRound(size_t len)
+{
+	return (len + DISK_SECTOR_SZ - 1) / DISK_SECTOR_SZ * DISK_SECTOR_SZ;
+}
+
+int main(int argc, char **argv)
+{
+	DiskBuf disk = { NULL, 0, 0 };
+	DiskBuf ram = { NULL, 0, 0 };
+	size_t header;
+	size_t floppy = 0;
+	u32 seed = DISK_SEED;
+	boolean isData;
+	FILE *p_file;
+
+	if (argc < 3)
+	{
+		fprintf(stderr, "Usage: mkdisk <kernel.lz> <disk.img> [-w <bytes> | <file>...]\n"
+			"       mkdisk -d <disk.img> [-w <bytes> | <file>...]\n");
+		return 2;
+	}
+	isData = (strcmp(argv[1], "-d") == 0);
+	if (!isData && DiskAppendFile(&disk, argv[1]) != 0)
+	{
+		return 1;
+	}
+	if (argc == 5 && strcmp(argv[3], "-w") == 0)
+	{
+		ram.Len = strtoul(argv[4], NULL, 0);
+		DiskReserve(&ram, 0);
+		CorpusFill(ram.Buf, ram.Len, CORPUS_KIND_WORDS, &seed);
+	}
+	else
+	{
+		for (int i = 3; i < argc; i++)
+		{
+			if (DiskAppendFile(&ram, argv[i]) != 0)
+			{
+				return 1;
+			}
+		}
+	}
+
+	header = DiskRound(disk.Len);
+	DiskPad(&disk, header + DISK_SECTOR_SZ);
+	memcpy(disk.Buf + header, DISK_MAGIC, 4);
+	for (int i = 0; i < 4; i++)
+	{
+		disk.Buf[header + 4 + i] = (char)(ram.Len >> (8 * i));
+	}
+	DiskReserve(&disk, ram.Len);
+	memcpy(disk.Buf + disk.Len, ram.Buf, ram.Len);
+	disk.Len += ram.Len;
+	DiskPad(&disk, DiskRound(disk.Len));
+
+	if (isData)
+	{
+		p_file = fopen(argv[2], "wb");
+		if (p_file == NULL || fwrite(disk.Buf, 1, disk.Len, p_file) != disk.Len)
+		{
+			perror(argv[2]);
+			return 1;
+		}
+		fclose(p_file);
+		printf("mkdisk: data disk %zu bytes, %zu sectors\n", ram.Len, disk.Len / DISK_SECTOR_SZ);
+		return 0;
+	}
+	for (size_t i = 0; i < sizeof(g_floppy_sizes) / sizeof(g_floppy_sizes[0]) && floppy == 0; i++)
+	{
+		floppy = (disk.Len <= g_floppy_sizes[i]) ? g_floppy_sizes[i] : 0;
+	}
+	if (floppy == 0)
+	{
+		fprintf(stderr, "mkdisk: %zu bytes do not fit a 2.88 MB floppy\n", disk.Len);
+		return 1;
+	}
+	DiskPad(&disk, floppy);
+
+	p_file = fopen(argv[2], "wb");
+	if (p_file == NULL || fwrite(disk.Buf, 1, disk.Len, p_file) != disk.Len)
+	{
+		perror(argv[2]);
+		return 1;
+	}
+	fclose(p_file);
+	printf("mkdisk: kernel %zu sectors, RAM disk %zu bytes, %zu sectors, %zu KB floppy\n",
+		header / DISK_SECTOR_SZ, ram.Len, DiskRound(ram.Len) / DISK_SECTOR_SZ + 1, floppy / 1024);
+	return 0;
+}
@@ -0,0 +1,365 @@
+//
+// Host benchmark for strcore. Runs the same corpora as the in-kernel
+// `bench` program, timed with the monotonic clock instead of rdtsc.
+//
+// Usage: strbench [size] [rounds]
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "../strcore.h"
+#include "../heap.h"
+
+#define BENCH_CORPUS_MAX ((size_t)0x1000000)
+#define BENCH_CORPUS_DEF ((size_t)0x100000)
+#define BENCH_PATTERN_MAX ((size_t)32)
+#define BENCH_SEED ((u32)0x5EED1234)
+
+static const char *BenchLibc(const char *p_str, const char *p_sub)
+{
+	return strstr(p_str, p_sub);
+}
+
+// libc first as the reference, then every kernel engine
+static const Matcher *BenchMatcher(size_t m)
+{
+	static const Matcher libc = { "libc", BenchLibc };
+	return (m == 0) ? &libc : &g_matchers[m - 1];
+}
+
+// Kernel engines scan with a pattern compiled once, like `search` does. Both
+// sides are told the bytes left, so no pass pays for a strlen of the rest.
+static const char *BenchFind(size_t m, const MatchPattern *p_pat, const char *p_str, size_t len)
+{
+	if (m == 0)
+	{
+		return (const char *)memmem(p_str, len, p_pat->Sub, p_pat->Len);
+	}
+	return PatternFindN(p_pat, p_str, len);
+}
+
+static u64 BenchNow()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (u64)ts.tv_sec * 1000000000ull + (u64)ts.tv_nsec;
+}
+
+// Scan cost of one Aho-Corasick pass as the keyword count grows. Random
+// text keeps the hit count low, so the time is the automaton walk itself.
+static void BenchAhoCorasick(char *p_corpus, size_t size, size_t rounds)
+{
+	static const size_t p_counts[] = { 1, 10, 100, 400 };
+	static AhoCorasick ac;
+	char p_word[BENCH_PATTERN_MAX + 1];
+	u32 seed = BENCH_SEED;
+
+	CorpusFill(p_corpus, size, CORPUS_KIND_ASCII, &seed);
+	printf("\n%-9s %5s %5s %8s %10s\n", "ac", "words", "nodes", "hits", "ns/byte");
+	for (size_t c = 0; c < sizeof(p_counts) / sizeof(p_counts[0]); c++)
+	{
+		u64 best = (u64)-1;
+		size_t hits = 0;
+
+		AhoCorasickInit(&ac, "bench");
+		for (size_t w = 0; w < p_counts[c]; w++)
+		{
+			CorpusPattern(p_word, 4 + CorpusRandom(&seed) % 5, p_corpus, size, CORPUS_KIND_ASCII, &seed);
+			AhoCorasickAdd(&ac, p_word);
+		}
+		AhoCorasickCompile(&ac);
+		for (size_t r = 0; r < rounds; r++)
+		{
+			u64 start = BenchNow();
+			hits = AhoCorasickScan(&ac, p_corpus, NULL, NULL);
+			start = BenchNow() - start;
+			best = (start < best) ? start : best;
+		}
+		printf("%-9s %5u %5u %8zu %10.3f\n", "ascii", ac.WordCount, ac.NodeCount, hits, (double)best / size);
+	}
+}
+
+// Bitap cost per error level, one register word up to 32 bytes, several past that
+static void BenchBitap(char *p_corpus, size_t size, size_t rounds)
+{
+	static const size_t p_lens[] = { 8, 32, 64 };
+	static BitapPattern bp;
+	char p_sub[BENCH_PATTERN_MAX * 2 + 1];
+	u32 seed = BENCH_SEED;
+
+	CorpusFill(p_corpus, size, CORPUS_KIND_WORDS, &seed);
+	printf("\n%-9s %4s %4s %8s %10s\n", "bitap", "len", "k", "matches", "ns/byte");
+	for (size_t l = 0; l < sizeof(p_lens) / sizeof(p_lens[0]); l++)
+	{
+		CorpusPattern(p_sub, p_lens[l], p_corpus, size, CORPUS_KIND_WORDS, &seed);
+		BitapCompile(&bp, p_sub);
+		for (u32 k = 0; k <= 3; k++)
+		{
+			u64 best = (u64)-1;
+			size_t matches = 0;
+
+			for (size_t r = 0; r < rounds; r++)
+			{
+				u64 start = BenchNow();
+				matches = BitapScan(&bp, p_corpus, k, NULL, NULL);
+				start = BenchNow() - start;
+				best = (start < best) ? start : best;
+			}
+			printf("%-9s %4zu %4u %8zu %10.3f\n", "words", p_lens[l], k, matches, (double)best / size);
+		}
+	}
+}
+
+// Formatting cost per number over values of every magnitude
+static void BenchFormat(size_t rounds)
+{
+	static const char *pp_names[] = { "itoa10", "dec", "hex" };
+	char p_buf[FMT_NUM_SZ];
+	char *p_end = p_buf + sizeof(p_buf) - 1;
+	size_t count = 1 << 20;
+
+	*p_end = '\0';
+	printf("\n%-9s %10s\n", "format", "ns/number");
+	for (size_t f = 0; f < sizeof(pp_names) / sizeof(pp_names[0]); f++)
+	{
+		u64 best = (u64)-1;
+		volatile size_t sink = 0;
+
+		for (size_t r = 0; r < rounds; r++)
+		{
+			u32 seed = BENCH_SEED;
+			u64 start = BenchNow();
+			for (size_t i = 0; i < count; i++)
+			{
+				u32 num = CorpusRandom(&seed) >> (i & 31);
+				if (f == 0)
+				{
+					sink += itoa(num, p_buf, 10)[0];
+				}
+				else
+				{
+					sink += (f == 1) ? FmtDecA(p_end, num)[0] : FmtHexA(p_end, num)[0];
+				}
+			}
+			start = BenchNow() - start;
+			best = (start < best) ? start : best;
+		}
+		printf("%-9s %10.3f\n", pp_names[f], (double)best / count);
+	}
+}
+
+// Lookup cost as the registry grows, hits and misses alternating
+static void BenchNames(size_t rounds)
+{
+	static const u32 p_counts[] = { 16, 256, 4096 };
+	static char pp_names[4096 * 2][NAMETAB_NAME_MAX];
+	NameTable tab;
+	size_t count = 1 << 18;
+
+	for (u32 n = 0; n < 4096 * 2; n++)
+	{
+		snprintf(pp_names[n], NAMETAB_NAME_MAX, "share.%u", n);
+	}
+	printf("\n%-9s %6s %10s\n", "names", "count", "ns/lookup");
+	for (size_t c = 0; c < sizeof(p_counts) / sizeof(p_counts[0]); c++)
+	{
+		u32 slots = p_counts[c] * 2;
+		NameEntry *p_slots = (NameEntry *)malloc(slots * sizeof(NameEntry));
+		volatile size_t found = 0;
+		u64 best = (u64)-1;
+
+		NameTableInit(&tab, p_slots, slots);
+		for (u32 n = 0; n < p_counts[c]; n++)
+		{
+			NameTableInsert(&tab, pp_names[n * 2]);
+		}
+		for (size_t r = 0; r < rounds; r++)
+		{
+			u64 start = BenchNow();
+			for (size_t i = 0; i < count; i++)
+			{
+				found += (NameTableFind(&tab, pp_names[(i * 2 + (i & 1)) % (p_counts[c] * 2)]) != NULL);
+			}
+			start = BenchNow() - start;
+			best = (start < best) ? start : best;
+		}
+		printf("%-9s %6u %10.3f\n", "find", p_counts[c], (double)best / count);
+		free(p_slots);
+	}
+}
+
+// Alloc/free pairs against libc, a window of live blocks keeps the free lists busy
+static void BenchHeap(size_t rounds)
+{
+	static const size_t p_sizes[] = { 16, 100, 2048, 5000, 65536 };
+	static void *pp_live[256];
+	static Heap heap;
+	size_t arena_sz = (size_t)64 << 20;
+	u8 *p_arena = (u8 *)malloc(arena_sz);
+	size_t count = 1 << 18;
+
+	if (p_arena == NULL)
+	{
+		return;
+	}
+	printf("\n%-9s %6s %10s\n", "alloc", "size", "ns/pair");
+	for (size_t s = 0; s < sizeof(p_sizes) / sizeof(p_sizes[0]); s++)
+	{
+		for (size_t lib = 0; lib < 2; lib++)
+		{
+			u64 best = (u64)-1;
+
+			for (size_t r = 0; r < rounds; r++)
+			{
+				HeapInit(&heap, p_arena, arena_sz);
+				memset(pp_live, 0, sizeof(pp_live));
+				u64 start = BenchNow();
+				for (size_t i = 0; i < count; i++)
+				{
+					void **pp = &pp_live[(i * 97) & 255];
+					if (lib)
+					{
+						free(*pp);
+						*pp = malloc(p_sizes[s]);
+					}
+					else
+					{
+						HeapFree(&heap, *pp);
+						*pp = HeapAlloc(&heap, p_sizes[s]);
+					}
+				}
+				start = BenchNow() - start;
+				best = (start < best) ? start : best;
+				for (size_t i = 0; lib && i < 256; i++)
+				{
+					free(pp_live[i]);
+				}
+			}
+			printf("%-9s %6zu %10.3f\n", lib ? "libc" : "heap", p_sizes[s], (double)best / count);
+		}
+	}
+	free(p_arena);
+}
+
+// One pass of a primitive over the whole buffer, byte '\x01' never occurs
+static size_t BenchPrim(size_t op, char *p_buf, char *p_copy, size_t size)
+{
+	switch (op)
+	{
+	case 0:
+		return StrLenA(p_buf);
+	case 1:
+		return (size_t)StrChrA((const char *)p_buf, '\x01');
+	case 2:
+		return (size_t)g_prims.MemChr(p_buf, 1, size);
+	case 3:
+		return (size_t)g_prims.MemCmp(p_buf, p_copy, size);
+	case 4:
+		g_prims.MemCopy(p_copy, p_buf, size);
+		return 0;
+	default:
+		g_prims.MemSet(p_copy, 'a', size);
+		return 0;
+	}
+}
+
+static void BenchPrims(char *p_corpus, size_t size, size_t rounds)
+{
+	static const char *p_ops[] = { "strlen", "strchr", "memchr", "memcmp", "memcpy", "memset" };
+	char *p_copy = (char *)malloc(size + 1);
+	u32 levels = StrPrimsDetect() + 1;
+	volatile size_t sink = 0;
+
+	if (p_copy == NULL)
+	{
+		return;
+	}
+	printf("\n%-6s %-6s %10s\n", "prims", "op", "ns/byte");
+	for (u32 level = 0; level < levels; level++)
+	{
+		StrPrimsSelect(level);
+		for (size_t op = 0; op < sizeof(p_ops) / sizeof(p_ops[0]); op++)
+		{
+			u64 best = (u64)-1;
+
+			memcpy(p_copy, p_corpus, size + 1);
+			for (size_t r = 0; r < rounds; r++)
+			{
+				u64 start = BenchNow();
+				sink += BenchPrim(op, p_corpus, p_copy, size);
+				start = BenchNow() - start;
+				best = (start < best) ? start : best;
+			}
+			printf("%-6s %-6s %10.3f\n", g_prims.Name, p_ops[op], (double)best / size);
+		}
+	}
+	StrPrimsSelect(levels - 1);
+	free(p_copy);
+}
+
+int main(int argc, char **argv)
+{
+	static const size_t p_lens[] = { 2, 4, 8, 16, 32 };
+	size_t size = (argc > 1) ? strtoul(argv[1], NULL, 0) : BENCH_CORPUS_DEF;
+	size_t rounds = (argc > 2) ? strtoul(argv[2], NULL, 0) : 5;
+	char p_sub[BENCH_PATTERN_MAX + 1];
+	char *p_corpus;
+	u32 seed = BENCH_SEED;
+
+	if (size < BENCH_PATTERN_MAX * 2 || size > BENCH_CORPUS_MAX || rounds == 0)
+	{
+		fprintf(stderr, "Usage %s [size %zu..%zu] [rounds]\n", argv[0], BENCH_PATTERN_MAX * 2, BENCH_CORPUS_MAX);
+		return 1;
+	}
+	p_corpus = (char *)malloc(size + 1);
+	if (p_corpus == NULL)
+	{
+		return 1;
+	}
+	StrPrimsSelect(StrPrimsDetect());
+
+	printf("%-9s %4s %-8s %8s %10s\n", "corpus", "len", "algo", "matches", "ns/byte");
+	for (size_t kind = 0; kind < CORPUS_KIND_COUNT; kind++)
+	{
+		CorpusFill(p_corpus, size, kind, &seed);
+		for (size_t l = 0; l < sizeof(p_lens) / sizeof(p_lens[0]); l++)
+		{
+			CorpusPattern(p_sub, p_lens[l], p_corpus, size, kind, &seed);
+			for (size_t m = 0; m <= MATCHER_COUNT; m++)
+			{
+				static MatchPattern pat;
+				u64 best = (u64)-1;
+				size_t matches = 0;
+
+				PatternCompile(&pat, p_sub, (m == 0) ? MATCHER_STD : (u32)(m - 1));
+
+				for (size_t r = 0; r < rounds; r++)
+				{
+					u64 start = BenchNow();
+					const char *p;
+
+					matches = 0;
+					for (p = BenchFind(m, &pat, p_corpus, size); p != NULL; p = BenchFind(m, &pat, p + 1, p_corpus + size - p - 1))
+					{
+						matches++;
+					}
+					start = BenchNow() - start;
+					best = (start < best) ? start : best;
+				}
+				printf("%-9s %4zu %-8s %8zu %10.3f\n", g_corpus_kinds[kind], p_lens[l],
+					BenchMatcher(m)->Name, matches, (double)best / size);
+			}
+		}
+	}
+	BenchAhoCorasick(p_corpus, size, rounds);
+	BenchBitap(p_corpus, size, rounds);
+	BenchFormat(rounds);
+	BenchHeap(rounds);
+	BenchNames(rounds);
+	BenchPrims(p_corpus, size, rounds);
+	free(p_corpus);
+	return 0;
+}
@@ -0,0 +1,1026 @@
+//
+// Differential fuzzer for strcore. Every search routine is checked against
+// libc on random texts, including bytes outside the printable range, and
+// every primitives level the CPU supports takes turns underneath.
+//
+// Usage: strfuzz [iterations] [seed]
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../strcore.h"
+#include "../heap.h"
+#include "../blockcache.h"
+
+#define FUZZ_TEXT_MAX 512
+#define FUZZ_SUB_MAX 24
+#define FUZZ_SET_MAX 40
+#define FUZZ_BITAP_MAX 256
+#define FUZZ_HEAP_SZ ((size_t)0x100000)
+#define FUZZ_HEAP_LIVE 64
+#define FUZZ_NAMES 64
+#define FUZZ_CACHE_MAX 12			// Entries
+#define FUZZ_CACHE_BLOCKS 30		// Device size, gets go a little past it
+#ifndef FUZZ_DISK_SZ
+#define FUZZ_DISK_SZ 0x100000		// make passes the DISK_SZ kernel.hdd is written with
+#endif
+#define FUZZ_DISK_BLOCKS ((u32)((512 + FUZZ_DISK_SZ - 1) / CACHE_BLOCK_SZ + 1))	// Header sector, then the text
+
+static u32 g_seed = 0xF00DF00D;
+static unsigned long g_iter;
+
+static void FuzzDump(const char *p_what, const char *p_data)
+{
+	fprintf(stderr, "  %s (%zu) \"", p_what, strlen(p_data));
+	for (; *p_data; p_data++)
+	{
+		u8 c = (u8)*p_data;
+		if (c >= 32 && c < 127 && c != '"' && c != '\\')
+		{
+			fputc(c, stderr);
+		}
+		else
+		{
+			fprintf(stderr, "\\x%02x", c);
+		}
+	}
+	fprintf(stderr, "\"\n");
+}
+
+static void FuzzFail(const char *p_func, const char *p_str, const char *p_sub, long got, long want)
+{
+	fprintf(stderr, "strfuzz: %s mismatch at iteration %lu (%s): got %ld, want %ld\n",
+		p_func, g_iter, g_prims.Name, got, want);
+	FuzzDump("text", p_str);
+	FuzzDump("pattern", p_sub);
+	exit(1);
+}
+
+// Random byte from a small alphabet, so that partial matches are frequent
+static char FuzzByte(u32 span)
+{
+	static const char p_pool[] = "ab\x01\x7f\x80\xff~ \x1f";
+	u32 r = CorpusRandom(&g_seed);
+
+	if (span == 0)
+	{
+		return (char)(r % 255 + 1);
+	}
+	return p_pool[r % span];
+}
+
+static void FuzzSearch()
+{
+	static char p_text[FUZZ_TEXT_MAX + 17];
+	static char p_sub[FUZZ_SUB_MAX + 1];
+	char *p_str = p_text + CorpusRandom(&g_seed) % 16;
+	u32 span = CorpusRandom(&g_seed) % 10;		// 0: any byte 1..255
+	size_t str_len = CorpusRandom(&g_seed) % (FUZZ_TEXT_MAX + 1);
+	size_t sub_len = CorpusRandom(&g_seed) % (FUZZ_SUB_MAX + 1);
+	size_t i;
+
+	for (i = 0; i < str_len; i++)
+	{
+		p_str[i] = FuzzByte(span);
+	}
+	p_str[str_len] = '\0';
+
+	if (str_len > sub_len && CorpusRandom(&g_seed) & 1)
+	{
+		// Cut the pattern out of the text and maybe damage one byte
+		memcpy(p_sub, p_str + CorpusRandom(&g_seed) % (str_len - sub_len), sub_len);
+		if (sub_len && CorpusRandom(&g_seed) & 1)
+		{
+			p_sub[CorpusRandom(&g_seed) % sub_len] = FuzzByte(span);
+		}
+	}
+	else
+	{
+		for (i = 0; i < sub_len; i++)
+		{
+			p_sub[i] = FuzzByte(span);
+		}
+	}
+	p_sub[sub_len] = '\0';
+
+	const char *p_want = strstr(p_str, p_sub);
+	long want = p_want ? (long)(p_want - p_str) : -1;
+	const char *p_got;
+	long got;
+
+	for (u32 mode = 0; mode < MATCHER_COUNT; mode++)
+	{
+		p_got = g_matchers[mode].Find(p_str, p_sub);
+		got = p_got ? (long)(p_got - p_str) : -1;
+		if (got != want)
+		{
+			FuzzFail(g_matchers[mode].Name, p_str, p_sub, got, want);
+		}
+	}
+
+	MatcherSelect(MATCHER_AUTO);
+	p_got = StrStrA(p_str, p_sub);
+	got = p_got ? (long)(p_got - p_str) : -1;
+	if (got != want)
+	{
+		FuzzFail(MatcherName(MatcherAuto(p_sub)), p_str, p_sub, got, want);
+	}
+
+	// A bounded search must not see a match that runs past the length
+	size_t cut = CorpusRandom(&g_seed) % (str_len + 1);
+	MatchPattern pat;
+	PatternCompile(&pat, p_sub, CorpusRandom(&g_seed) % MATCHER_COUNT);
+	p_want = (const char *)memmem(p_str, cut, p_sub, sub_len);
+	p_got = PatternFindN(&pat, p_str, cut);
+	if (p_got != p_want)
+	{
+		FuzzFail("PatternFindN", p_str, p_sub, p_got ? (long)(p_got - p_str) : -1, p_want ? (long)(p_want - p_str) : -1);
+	}
+
+	if (StrLenA(p_str) != str_len)
+	{
+		FuzzFail("StrLenA", p_str, "", (long)StrLenA(p_str), (long)str_len);
+	}
+
+	char c = FuzzByte(span);
+	p_got = StrChrA((const char *)p_str, c);
+	p_want = strchr(p_str, c);
+	if (p_got != p_want)
+	{
+		char p_c[2] = { c, '\0' };
+		FuzzFail("StrChrA", p_str, p_c, p_got ? (long)(p_got - p_str) : -1, p_want ? (long)(p_want - p_str) : -1);
+	}
+
+	if ((StrCmpA(p_str, p_sub) == 0) != (strcmp(p_str, p_sub) == 0))
+	{
+		FuzzFail("StrCmpA", p_str, p_sub, StrCmpA(p_str, p_sub), strcmp(p_str, p_sub));
+	}
+}
+
+static long FuzzSign(long v)
+{
+	return (v > 0) - (v < 0);
+}
+
+static void FuzzPrims()
+{
+	static u8 p_a[FUZZ_TEXT_MAX + 16];
+	static u8 p_b[FUZZ_TEXT_MAX + 16];
+	static u8 p_want[FUZZ_TEXT_MAX + 16];
+	u32 span = CorpusRandom(&g_seed) % 10;
+	size_t off_a = CorpusRandom(&g_seed) % 16;
+	size_t off_b = CorpusRandom(&g_seed) % 16;
+	size_t n = CorpusRandom(&g_seed) % (FUZZ_TEXT_MAX + 1);
+	u8 c = (u8)FuzzByte(span);
+	size_t i;
+
+	for (i = 0; i < sizeof(p_a); i++)
+	{
+		p_a[i] = (u8)FuzzByte(span);
+		p_b[i] = p_a[i];
+	}
+	if (n && CorpusRandom(&g_seed) & 1)
+	{
+		p_b[off_a + CorpusRandom(&g_seed) % n] ^= (u8)(CorpusRandom(&g_seed) | 1);
+	}
+
+	const void *p_got = g_prims.MemChr(p_a + off_a, c, n);
+	const void *p_hit = memchr(p_a + off_a, c, n);
+	if (p_got != p_hit)
+	{
+		FuzzFail("MemChr", "", "", p_got ? (long)((const u8 *)p_got - p_a) : -1,
+			p_hit ? (long)((const u8 *)p_hit - p_a) : -1);
+	}
+
+	long got = FuzzSign(g_prims.MemCmp(p_a + off_a, p_b + off_a, n));
+	long want = FuzzSign(memcmp(p_a + off_a, p_b + off_a, n));
+	if (got != want)
+	{
+		FuzzFail("MemCmp", "", "", got, want);
+	}
+
+	memcpy(p_want, p_a, sizeof(p_want));
+	memset(p_want + off_a, c, n);
+	g_prims.MemSet(p_a + off_a, c, n);
+	if (memcmp(p_a, p_want, sizeof(p_want)) != 0)
+	{
+		FuzzFail("MemSet", "", "", (long)n, (long)off_a);
+	}
+
+	memcpy(p_want, p_a, sizeof(p_want));
+	memcpy(p_want + off_a, p_b + off_b, n);
+	g_prims.MemCopy(p_a + off_a, p_b + off_b, n);
+	if (memcmp(p_a, p_want, sizeof(p_want)) != 0)
+	{
+		FuzzFail("MemCopy", "", "", (long)n, (long)off_a);
+	}
+}
+
+static u8 g_hit_seen[FUZZ_TEXT_MAX][FUZZ_SET_MAX];
+static const char *g_hit_text;
+static const AhoCorasick *g_hit_ac;
+
+static void FuzzHit(void *p_ctx, size_t pos, u16 word)
+{
+	size_t len = g_hit_ac->WordLen[word];
+
+	if (pos + len > strlen(g_hit_text) || memcmp(g_hit_text + pos, g_hit_ac->Text + g_hit_ac->WordOff[word], len) != 0)
+	{
+		FuzzFail("AhoCorasick bogus hit", g_hit_text, "", (long)pos, (long)word);
+	}
+	if (g_hit_seen[pos][word]++)
+	{
+		FuzzFail("AhoCorasick repeated hit", g_hit_text, "", (long)pos, (long)word);
+	}
+}
+
+static void FuzzAhoCorasick()
+{
+	static AhoCorasick ac;
+	static char p_str[FUZZ_TEXT_MAX + 1];
+	char p_word[8];
+	u32 span = CorpusRandom(&g_seed) % 4 + 1;
+	size_t words = CorpusRandom(&g_seed) % FUZZ_SET_MAX + 1;
+	size_t str_len = CorpusRandom(&g_seed) % (FUZZ_TEXT_MAX + 1);
+	size_t want = 0;
+	size_t i, w, v, len;
+
+	AhoCorasickInit(&ac, "fuzz");
+	for (w = 0; w < words; w++)
+	{
+		len = CorpusRandom(&g_seed) % (sizeof(p_word) - 2) + 1;
+		for (i = 0; i < len; i++)
+		{
+			p_word[i] = FuzzByte(span);
+		}
+		p_word[len] = '\0';
+		AhoCorasickAdd(&ac, p_word);
+	}
+	for (i = 0; i < str_len; i++)
+	{
+		p_str[i] = FuzzByte(span);
+	}
+	p_str[str_len] = '\0';
+
+	// Naive reference; a repeated word only reports under its first id
+	for (w = 0; w < words; w++)
+	{
+		const char *p_w = ac.Text + ac.WordOff[w];
+		len = ac.WordLen[w];
+		for (v = 0; v < w && (ac.WordLen[v] != len || memcmp(ac.Text + ac.WordOff[v], p_w, len) != 0); v++)
+		{
+			continue;
+		}
+		for (i = 0; v == w && i + len <= str_len; i++)
+		{
+			want += (memcmp(p_str + i, p_w, len) == 0);
+		}
+	}
+
+	memset(g_hit_seen, 0, sizeof(g_hit_seen));
+	g_hit_text = p_str;
+	g_hit_ac = &ac;
+	if (AhoCorasickCompile(&ac) != SUCCESS)
+	{
+		FuzzFail("AhoCorasickCompile", p_str, "", 0, 0);
+	}
+	size_t got = AhoCorasickScan(&ac, p_str, FuzzHit, NULL);
+	if (got != want)
+	{
+		FuzzFail("AhoCorasick", p_str, "", (long)got, (long)want);
+	}
+}
+
+static u8 g_stream_got[FUZZ_TEXT_MAX];
+
+static void FuzzStreamHit(void *p_ctx, size_t pos)
+{
+	g_stream_got[pos] += 1;
+}
+
+// Every engine streamed in tiny chunks must report exactly the positions a
+// plain memcmp at each offset finds, the ones across a chunk edge included.
+// The stream reads a heap copy with nothing after it, so a read past the
+// device end trips the address sanitizer.
+static void FuzzStream()
+{
+	static char p_text[FUZZ_TEXT_MAX + 1];
+	static char p_sub[FUZZ_SUB_MAX + 1];
+	static MatchPattern pat;
+	u32 span = CorpusRandom(&g_seed) % 4 + 1;
+	size_t str_len = CorpusRandom(&g_seed) % (FUZZ_TEXT_MAX + 1);
+	size_t sub_len = CorpusRandom(&g_seed) % FUZZ_SUB_MAX + 1;
+	MatchStream ms;
+	char *p_dev;
+	size_t want;
+	size_t i;
+
+	for (i = 0; i < str_len; i++)
+	{
+		p_text[i] = FuzzByte(span);
+	}
+	p_text[str_len] = '\0';
+	for (i = 0; i < sub_len; i++)
+	{
+		p_sub[i] = FuzzByte(span);
+	}
+	p_sub[sub_len] = '\0';
+	p_dev = (char *)malloc(str_len + (str_len == 0));
+	memcpy(p_dev, p_text, str_len);
+
+	for (u32 mode = 0; mode < MATCHER_COUNT; mode++)
+	{
+		PatternCompile(&pat, p_sub, mode);
+		MatchStreamInit(&ms, &pat, p_dev, str_len, FuzzStreamHit, NULL);
+		ms.ChunkSz = CorpusRandom(&g_seed) % 40 + 1;
+		memset(g_stream_got, 0, sizeof(g_stream_got));
+		while (MatchStreamNext(&ms))
+		{
+			continue;
+		}
+		want = 0;
+		for (i = 0; i + sub_len <= str_len; i++)
+		{
+			u8 is_match = memcmp(p_text + i, p_sub, sub_len) == 0;
+			want += is_match;
+			if (g_stream_got[i] != is_match)
+			{
+				FuzzFail("MatchStream position", p_text, p_sub, (long)i, (long)ms.ChunkSz);
+			}
+		}
+		if (ms.Hits != want || ms.Chunks != (str_len + ms.ChunkSz - 1) / ms.ChunkSz)
+		{
+			FuzzFail(g_matchers[mode].Name, p_text, p_sub, (long)ms.Hits, (long)want);
+		}
+	}
+	free(p_dev);
+}
+
+static size_t g_bitap_got[FUZZ_TEXT_MAX];
+
+static void FuzzBitapHit(void *p_ctx, size_t end, u32 edits)
+{
+	g_bitap_got[end] = edits + 1;
+}
+
+// Bitap against the Sellers edit distance table, one column per text byte
+static void FuzzBitap()
+{
+	static BitapPattern bp;
+	static char p_str[FUZZ_TEXT_MAX + 1];
+	char p_sub[FUZZ_BITAP_MAX];
+	size_t p_col[FUZZ_BITAP_MAX];
+	u32 span = CorpusRandom(&g_seed) % 4 + 1;
+	size_t sub_len = (CorpusRandom(&g_seed) & 7) ? CorpusRandom(&g_seed) % 80 + 1 : CorpusRandom(&g_seed) % (FUZZ_BITAP_MAX - 1) + 1;
+	size_t str_len = CorpusRandom(&g_seed) % (FUZZ_TEXT_MAX + 1);
+	u32 k = CorpusRandom(&g_seed) % (BITAP_K_MAX + 1);
+	size_t i, j, diag, next;
+
+	for (i = 0; i < sub_len; i++)
+	{
+		p_sub[i] = FuzzByte(span);
+	}
+	p_sub[sub_len] = '\0';
+	for (i = 0; i < str_len; i++)
+	{
+		p_str[i] = FuzzByte(span);
+	}
+	p_str[str_len] = '\0';
+	// Plant a copy of the pattern with a few random edits
+	if (str_len > sub_len && (CorpusRandom(&g_seed) & 1))
+	{
+		size_t at = CorpusRandom(&g_seed) % (str_len - sub_len);
+		memcpy(p_str + at, p_sub, sub_len);
+		for (i = CorpusRandom(&g_seed) % (k + 2); i > 0; i--)
+		{
+			p_str[at + CorpusRandom(&g_seed) % sub_len] = FuzzByte(span);
+		}
+	}
+
+	if (BitapCompile(&bp, p_sub) != SUCCESS)
+	{
+		FuzzFail("BitapCompile", p_str, p_sub, 0, 0);
+	}
+	memset(g_bitap_got, 0, sizeof(g_bitap_got));
+	size_t got = BitapScan(&bp, p_str, k, FuzzBitapHit, NULL);
+	size_t want = 0;
+
+	for (i = 0; i <= sub_len; i++)
+	{
+		p_col[i] = i;
+	}
+	for (j = 0; j < str_len; j++)
+	{
+		diag = 0;
+		for (i = 1; i <= sub_len; i++)
+		{
+			next = diag + (p_sub[i - 1] != p_str[j]);
+			next = (p_col[i] + 1 < next) ? p_col[i] + 1 : next;
+			next = (p_col[i - 1] + 1 < next) ? p_col[i - 1] + 1 : next;
+			diag = p_col[i];
+			p_col[i] = next;
+		}
+		if (k >= sub_len)
+		{
+			continue;
+		}
+		if (p_col[sub_len] <= k)
+		{
+			want++;
+		}
+		if ((p_col[sub_len] <= k ? p_col[sub_len] + 1 : 0) != g_bitap_got[j])
+		{
+			FuzzFail("Bitap edits", p_str, p_sub, (long)g_bitap_got[j] - 1, (p_col[sub_len] <= k) ? (long)p_col[sub_len] : -1L);
+		}
+	}
+	if (got != want)
+	{
+		FuzzFail("Bitap", p_str, p_sub, (long)got, (long)want);
+	}
+}
+
+static void FuzzHeapFail(const char *p_what, size_t size, size_t got)
+{
+	fprintf(stderr, "strfuzz: heap %s at iteration %lu: size %zu, got %zu\n", p_what, g_iter, size, got);
+	exit(1);
+}
+
+// Random alloc/free runs; every live block is filled with its own tag, so
+// overlapping blocks or a corrupted free list show up as a changed byte
+static void FuzzHeap()
+{
+	static u8 p_arena[FUZZ_HEAP_SZ];
+	static Heap heap;
+	u8 *pp_live[FUZZ_HEAP_LIVE] = { 0 };
+	size_t p_size[FUZZ_HEAP_LIVE];
+	size_t size, slot, i, order, free_pages;
+	size_t offset = CorpusRandom(&g_seed) % HEAP_PAGE_SZ;
+	u32 slab_pages = 0;
+
+	if (HeapInit(&heap, p_arena + offset, FUZZ_HEAP_SZ - offset) != SUCCESS)
+	{
+		FuzzHeapFail("init", FUZZ_HEAP_SZ - offset, 0);
+	}
+	for (size_t op = 0; op < FUZZ_HEAP_LIVE * 4; op++)
+	{
+		slot = CorpusRandom(&g_seed) % FUZZ_HEAP_LIVE;
+		if (pp_live[slot] != NULL)
+		{
+			// Large blocks overlap by whole pages at least, sampling them is enough
+			for (i = 0; i < p_size[slot]; i += (p_size[slot] > HEAP_CLASS_MAX) ? 61 : 1)
+			{
+				if (pp_live[slot][i] != (u8)slot)
+				{
+					FuzzHeapFail("block overwritten", p_size[slot], i);
+				}
+			}
+			HeapFree(&heap, pp_live[slot]);
+			pp_live[slot] = NULL;
+			continue;
+		}
+		size = CorpusRandom(&g_seed) % ((CorpusRandom(&g_seed) & 3) ? HEAP_CLASS_MAX : HEAP_PAGE_SZ * 20) + 1;
+		pp_live[slot] = (u8 *)HeapAlloc(&heap, size);
+		if (pp_live[slot] == NULL)
+		{
+			// A small object needs a page for a new slab, a large one a power-of-two block
+			for (i = 1; size > HEAP_CLASS_MAX && (i << HEAP_PAGE_SHIFT) < size; i <<= 1)
+			{
+				continue;
+			}
+			if (HeapLargestFree(&heap) >= i)
+			{
+				FuzzHeapFail("alloc failed with room left", size, HeapLargestFree(&heap));
+			}
+			continue;
+		}
+		if (HeapBlockSize(&heap, pp_live[slot]) < size || ((size_t)pp_live[slot] & (HeapBlockSize(&heap, pp_live[slot]) - 1) & (HEAP_PAGE_SZ - 1)) != 0)
+		{
+			FuzzHeapFail("block size or alignment", size, HeapBlockSize(&heap, pp_live[slot]));
+		}
+		if (pp_live[slot] < heap.Base || pp_live[slot] + size > heap.Base + ((size_t)heap.Pages << HEAP_PAGE_SHIFT))
+		{
+			FuzzHeapFail("block outside the heap", size, (size_t)(pp_live[slot] - heap.Base));
+		}
+		memset(pp_live[slot], (int)slot, size);
+		p_size[slot] = size;
+	}
+	for (slot = 0; slot < FUZZ_HEAP_LIVE; slot++)
+	{
+		HeapFree(&heap, pp_live[slot]);
+	}
+
+	// Everything freed: only retained slab pages are missing from the buddies
+	for (i = 0; i < HEAP_CLASS_COUNT; i++)
+	{
+		slab_pages += heap.Classes[i].Pages;
+		if (heap.Classes[i].InUse != 0)
+		{
+			FuzzHeapFail("slab objects left in use", i, heap.Classes[i].InUse);
+		}
+	}
+	for (order = 0, free_pages = 0, size = slab_pages; order < HEAP_ORDER_COUNT; order++)
+	{
+		free_pages += (size_t)heap.OrderFree[order] << order;
+		size += heap.OrderFree[order];
+	}
+	if (heap.LargeInUse != 0 || free_pages != heap.FreePages || heap.FreePages + slab_pages != heap.Pages)
+	{
+		FuzzHeapFail("page accounting", heap.FreePages, free_pages);
+	}
+	// Only free block heads and slab pages may be marked in the page map
+	for (i = 0; i < heap.Pages; i++)
+	{
+		size -= (heap.Map[i] != HEAP_MAP_TAIL);
+	}
+	if (size != 0)
+	{
+		FuzzHeapFail("stale page map entries", heap.Pages, size);
+	}
+}
+
+static u32 g_cache_reads;
+
+// Every block reads as its own number mixed with the offset; a few fail
+static errno_t FuzzCacheRead(void *p_ctx, u32 block, u8 *p_buf)
+{
+	g_cache_reads += 1;
+	if (block % 11 == *(u32 *)p_ctx)
+	{
+		return FAIL;
+	}
+	for (size_t i = 0; i < CACHE_BLOCK_SZ; i++)
+	{
+		p_buf[i] = (u8)(block * 31 + i);
+	}
+	return SUCCESS;
+}
+
+static void FuzzCacheFail(const char *p_what, u32 block, long got, long want)
+{
+	fprintf(stderr, "strfuzz: cache %s at iteration %lu: block %u, got %ld, want %ld\n", p_what, g_iter, block, got, want);
+	exit(1);
+}
+
+// BlockCache against a plain LRU list: p_lru holds the cached blocks from
+// newest to oldest, a miss takes the oldest unpinned one. Every get must
+// hit or miss exactly when the list does, and read the device only on a miss.
+static void FuzzCache()
+{
+	static u8 p_arena[FUZZ_HEAP_SZ];
+	static Heap heap;
+	static BlockCache bc;
+	CacheEntry *pp_pinned[FUZZ_CACHE_MAX * 2];
+	u32 p_lru[FUZZ_CACHE_MAX];
+	u32 p_pins[FUZZ_CACHE_BLOCKS] = { 0 };
+	u32 count = CorpusRandom(&g_seed) % FUZZ_CACHE_MAX + 1;
+	u32 bad = CorpusRandom(&g_seed) % 40;		// Blocks with block % 11 == bad fail to read
+	u32 cached = 0;
+	u32 pinned = 0;
+	u32 block, at, reads, hits;
+	CacheEntry *p_ent;
+
+	HeapInit(&heap, p_arena, FUZZ_HEAP_SZ);
+	CacheInit(&bc, &heap, FuzzCacheRead, &bad, FUZZ_CACHE_BLOCKS);
+	if (CacheSetBudget(&bc, count * CACHE_BLOCK_SZ + CorpusRandom(&g_seed) % CACHE_BLOCK_SZ) != SUCCESS
+		|| bc.Count != count || bc.Budget != count * CACHE_BLOCK_SZ)
+	{
+		FuzzCacheFail("budget", 0, bc.Count, count);
+	}
+	for (u32 op = 0; op < 200; op++)
+	{
+		u32 what = CorpusRandom(&g_seed) % 16;
+		if (what < 4 && pinned != 0)
+		{
+			at = CorpusRandom(&g_seed) % pinned;
+			p_pins[pp_pinned[at]->Block] -= 1;
+			CachePut(&bc, pp_pinned[at]);
+			pp_pinned[at] = pp_pinned[--pinned];
+			continue;
+		}
+		if (what == 4)
+		{
+			CacheFlush(&bc);
+			for (u32 i = at = 0; i < cached; i++)
+			{
+				p_lru[at] = p_lru[i];
+				at += (p_pins[p_lru[i]] != 0);
+			}
+			cached = at;
+			continue;
+		}
+
+		block = CorpusRandom(&g_seed) % (FUZZ_CACHE_BLOCKS + 2);
+		reads = g_cache_reads;
+		hits = bc.Stats.Hits;
+		p_ent = CacheGet(&bc, block);
+		for (at = 0; at < cached && p_lru[at] != block; at++)
+		{
+			continue;
+		}
+		if (block >= FUZZ_CACHE_BLOCKS)
+		{
+			if (p_ent != NULL || g_cache_reads != reads)
+			{
+				FuzzCacheFail("block past the device", block, p_ent != NULL, 0);
+			}
+			continue;
+		}
+		if (at == cached)
+		{
+			// Miss: the model frees its victim the same way, then reads
+			if (cached == count)
+			{
+				for (at = cached; at > 0 && p_pins[p_lru[at - 1]] != 0; at--)
+				{
+					continue;
+				}
+				if (at == 0)
+				{
+					if (p_ent != NULL || g_cache_reads != reads)
+					{
+						FuzzCacheFail("get with every entry pinned", block, p_ent != NULL, 0);
+					}
+					continue;
+				}
+				memmove(p_lru + at - 1, p_lru + at, (cached - at) * sizeof(u32));
+				cached -= 1;
+			}
+			if (bc.Stats.Hits != hits || g_cache_reads != reads + 1)
+			{
+				FuzzCacheFail("miss", block, (long)(g_cache_reads - reads), 1);
+			}
+			if (block % 11 == bad)
+			{
+				if (p_ent != NULL)
+				{
+					FuzzCacheFail("failed read returned", block, 1, 0);
+				}
+				continue;
+			}
+			at = cached++;
+		}
+		else if (bc.Stats.Hits != hits + 1 || g_cache_reads != reads)
+		{
+			FuzzCacheFail("hit", block, (long)(g_cache_reads - reads), 0);
+		}
+		if (p_ent == NULL || p_ent->Block != block)
+		{
+			FuzzCacheFail("entry", block, (p_ent != NULL) ? (long)p_ent->Block : -1, block);
+		}
+		for (size_t i = 0; i < CACHE_BLOCK_SZ; i += 7)
+		{
+			if (p_ent->Data[i] != (u8)(block * 31 + i))
+			{
+				FuzzCacheFail("data", block, (long)i, -1);
+			}
+		}
+		memmove(p_lru + 1, p_lru, at * sizeof(u32));
+		p_lru[0] = block;
+		if (pinned < FUZZ_CACHE_MAX * 2 && (CorpusRandom(&g_seed) & 1))
+		{
+			pp_pinned[pinned++] = p_ent;
+			p_pins[block] += 1;
+		}
+		else
+		{
+			CachePut(&bc, p_ent);
+		}
+		if (bc.Used != cached)
+		{
+			FuzzCacheFail("entries in use", block, bc.Used, cached);
+		}
+	}
+	// Pinned blocks refuse a new budget and leave the cache as it was
+	if (pinned != 0 && (CacheSetBudget(&bc, 0) != FAIL || bc.Count != count || bc.Used != cached))
+	{
+		FuzzCacheFail("budget with pins", 0, bc.Count, count);
+	}
+	while (pinned != 0)
+	{
+		CachePut(&bc, pp_pinned[--pinned]);
+	}
+	if (bc.Pinned != 0)
+	{
+		FuzzCacheFail("pins left", 0, bc.Pinned, 0);
+	}
+	// A budget past the heap is cut short of the share the cache leaves free
+	if (CacheSetBudget(&bc, FUZZ_HEAP_SZ * 2) != SUCCESS || bc.Budget != bc.Count * CACHE_BLOCK_SZ
+		|| bc.Count == 0 || heap.FreePages < (heap.Pages >> CACHE_HEAP_KEEP_SHIFT))
+	{
+		FuzzCacheFail("budget cut", 0, bc.Count, heap.FreePages);
+	}
+	if (CacheSetBudget(&bc, 0) != SUCCESS || bc.Budget != 0)
+	{
+		FuzzCacheFail("zero budget", 0, (long)bc.Budget, 0);
+	}
+	// A zero budget gives every page and table back
+	for (u32 i = 0; i < HEAP_CLASS_COUNT; i++)
+	{
+		heap.LargeInUse += heap.Classes[i].InUse;
+	}
+	if (heap.LargeInUse != 0)
+	{
+		FuzzCacheFail("heap left in use", 0, heap.LargeInUse, 0);
+	}
+}
+
+// Two sequential passes over a device the way `disk scan` makes them: the
+// blocks before CacheScanEnd() through the cache, the rest read around it.
+// The second pass must read exactly the blocks the cache does not keep.
+// Returns the device reads of the second pass.
+static u32 FuzzCacheScan(size_t heapSz, size_t budget, u32 blocks)
+{
+	static Heap heap;
+	static BlockCache bc;
+	u8 *p_arena = (u8 *)malloc(heapSz);
+	u32 none = 11;		// No block % 11 is 11, every read works
+	u32 p_reads[2];
+	u32 reads;
+	u32 direct;
+	u32 end;
+
+	HeapInit(&heap, p_arena, heapSz);
+	CacheInit(&bc, &heap, FuzzCacheRead, &none, blocks);
+	if (CacheSetBudget(&bc, budget) != SUCCESS)
+	{
+		FuzzCacheFail("scan budget", 0, (long)bc.Budget, (long)budget);
+	}
+	end = CacheScanEnd(&bc, 0);
+	for (u32 pass = 0; pass < 2; pass++)
+	{
+		reads = g_cache_reads;
+		direct = 0;
+		for (u32 block = 0; block < blocks; block++)
+		{
+			if (block >= end)
+			{
+				direct += 1;
+				continue;
+			}
+			CacheEntry *p_ent = CacheGet(&bc, block);
+			if (p_ent == NULL)
+			{
+				FuzzCacheFail("scan get", block, 0, 1);
+			}
+			CachePut(&bc, p_ent);
+		}
+		p_reads[pass] = g_cache_reads - reads + direct;
+	}
+	free(p_arena);
+	if (p_reads[0] != blocks || p_reads[1] != blocks - ((bc.Count < blocks) ? bc.Count : blocks))
+	{
+		FuzzCacheFail("second scan", blocks, p_reads[1], blocks - ((bc.Count < blocks) ? bc.Count : blocks));
+	}
+	return p_reads[1];
+}
+
+// NameTable against a presence array; tiny hash spaces collide a lot,
+// so every removal is followed by a lookup of all live names
+static void FuzzNameTable()
+{
+	static NameTable tab;
+	static boolean p_live[FUZZ_NAMES];
+	NameEntry *p_slots = (NameEntry *)malloc(4 * sizeof(NameEntry));
+	NameEntry *p_ent;
+	char p_name[NAMETAB_NAME_MAX];
+	u32 live = 0;
+	u32 iter;
+	size_t n, i;
+
+	memset(p_live, 0, sizeof(p_live));
+	NameTableInit(&tab, p_slots, 4);
+	for (size_t op = 0; op < 200; op++)
+	{
+		n = CorpusRandom(&g_seed) % FUZZ_NAMES;
+		snprintf(p_name, sizeof(p_name), "%zx.%zu", n * 7, n);
+		if (CorpusRandom(&g_seed) % 3 == 0)
+		{
+			if (NameTableRemove(&tab, p_name) != p_live[n])
+			{
+				FuzzFail("NameTableRemove", p_name, "", (long)!p_live[n], (long)p_live[n]);
+			}
+			live -= p_live[n];
+			p_live[n] = FALSE;
+			for (i = 0; i < FUZZ_NAMES; i++)
+			{
+				snprintf(p_name, sizeof(p_name), "%zx.%zu", i * 7, i);
+				if ((NameTableFind(&tab, p_name) != NULL) != p_live[i])
+				{
+					FuzzFail("NameTableFind after remove", p_name, "", !p_live[i], p_live[i]);
+				}
+			}
+			continue;
+		}
+		if (NameTableIsFull(&tab))
+		{
+			free(NameTableRehash(&tab, (NameEntry *)malloc((tab.Mask + 1) * 2 * sizeof(NameEntry)), (tab.Mask + 1) * 2));
+		}
+		p_ent = NameTableInsert(&tab, p_name);
+		if ((p_ent != NULL) == p_live[n])
+		{
+			FuzzFail("NameTableInsert", p_name, "", p_ent != NULL, !p_live[n]);
+		}
+		if (p_ent != NULL)
+		{
+			p_ent->Size = n;
+			p_live[n] = TRUE;
+			live++;
+		}
+		p_ent = NameTableFind(&tab, p_name);
+		if (p_ent == NULL || p_ent->Size != n)
+		{
+			FuzzFail("NameTableFind", p_name, "", p_ent != NULL, 1);
+		}
+	}
+	for (iter = 0, i = 0; (p_ent = NameTableNext(&tab, &iter)) != NULL; i++)
+	{
+		if (p_ent->Size >= FUZZ_NAMES || !p_live[p_ent->Size])
+		{
+			FuzzFail("NameTableNext", p_ent->Name, "", (long)p_ent->Size, 1);
+		}
+	}
+	if (i != live || tab.Count != live)
+	{
+		FuzzFail("NameTable count", "", "", (long)i, (long)live);
+	}
+	if (NameTableInsert(&tab, "0123456789abcdef0123456789abcdef") != NULL)
+	{
+		FuzzFail("NameTableInsert long name", "", "", 1, 0);
+	}
+	free(tab.Slots);
+}
+
+static void FuzzItoa()
+{
+	static const size_t p_bases[] = { 2, 8, 10, 16 };
+	char p_got[72];
+	char p_want[72];
+	u32 num = CorpusRandom(&g_seed) >> (CorpusRandom(&g_seed) % 32);
+	size_t base = p_bases[CorpusRandom(&g_seed) & 3];
+	size_t i = sizeof(p_want) - 1;
+	u32 n = num;
+
+	p_want[i] = '\0';
+	do
+	{
+		p_want[--i] = "0123456789abcdef"[n % base];
+		n /= base;
+	} while (n);
+
+	itoa(num, p_got, base);
+	if (strcmp(p_got, p_want + i) != 0)
+	{
+		FuzzFail("itoa", p_got, p_want + i, (long)num, (long)base);
+	}
+	snprintf(p_want, sizeof(p_want), "%u", num);
+	if (IntToStrA(num, p_got, sizeof(p_got)) != SUCCESS || strcmp(p_got, p_want) != 0)
+	{
+		FuzzFail("IntToStrA", p_got, p_want, (long)num, 10);
+	}
+	if (IntToStrA(num, p_got, strlen(p_want)) != FAIL)
+	{
+		FuzzFail("IntToStrA truncation", p_got, p_want, (long)num, 10);
+	}
+
+	// StrToUIntA takes every size_t back and refuses the first value past it
+	size_t val = 0;
+	if (StrToUIntA(p_want, &val) != SUCCESS || val != num)
+	{
+		FuzzFail("StrToUIntA", p_want, "", (long)val, (long)num);
+	}
+	snprintf(p_want, sizeof(p_want), "%zu", (size_t)-1 - (num % 10));
+	if (StrToUIntA(p_want, &val) != SUCCESS || val != (size_t)-1 - (num % 10))
+	{
+		FuzzFail("StrToUIntA at the top", p_want, "", (long)val, (long)num);
+	}
+	p_want[strlen(p_want) - 1] += (char)(num % 10 + 1);	// Past the top, maybe by a non-digit
+	if (StrToUIntA(p_want, &val) != FAIL)
+	{
+		FuzzFail("StrToUIntA overflow", p_want, "", (long)val, (long)num);
+	}
+}
+
+// Reference split: one character at a time with an explicit state
+static size_t FuzzSplit(const char *p_line, size_t *p_starts, size_t *p_lens)
+{
+	size_t count = 0;
+	size_t i = 0;
+	char quote;
+
+	while (p_line[i] != '\0')
+	{
+		if (p_line[i] == ' ' || p_line[i] == '\t')
+		{
+			i++;
+			continue;
+		}
+		quote = (p_line[i] == '"' || p_line[i] == '\'') ? p_line[i++] : 0;
+		p_starts[count] = i;
+		while (p_line[i] != '\0' && (quote ? p_line[i] != quote : p_line[i] != ' ' && p_line[i] != '\t'))
+		{
+			i++;
+		}
+		p_lens[count] = i - p_starts[count];
+		count++;
+		i += (p_line[i] != '\0');
+	}
+	return count;
+}
+
+static void FuzzTokenizer()
+{
+	static const char p_alpha[] = "ab  \t\"'x";
+	char p_line[FUZZ_SUB_MAX * 2 + 1];
+	char p_copy[sizeof(p_line)];
+	char *pp_args[FUZZ_SUB_MAX];
+	size_t p_lens[FUZZ_SUB_MAX];
+	size_t p_starts[sizeof(p_line)];
+	size_t p_want[sizeof(p_line)];
+	size_t len = CorpusRandom(&g_seed) % sizeof(p_line);
+	size_t max = CorpusRandom(&g_seed) % FUZZ_SUB_MAX;
+	size_t count;
+	size_t want;
+
+	for (size_t i = 0; i < len; i++)
+	{
+		p_line[i] = p_alpha[CorpusRandom(&g_seed) % (sizeof(p_alpha) - 1)];
+	}
+	p_line[len] = '\0';
+	memcpy(p_copy, p_line, len + 1);
+
+	want = FuzzSplit(p_copy, p_starts, p_want);
+	count = StrSplitArgsA(p_line, pp_args, p_lens, max);
+	if (count != want)
+	{
+		FuzzFail("StrSplitArgsA count", p_copy, "", (long)count, (long)want);
+	}
+	for (size_t i = 0; i < count && i < max; i++)
+	{
+		if (pp_args[i] != p_line + p_starts[i] || p_lens[i] != p_want[i] || pp_args[i][p_lens[i]] != '\0' ||
+			memcmp(pp_args[i], p_copy + p_starts[i], p_lens[i]) != 0)
+		{
+			FuzzFail("StrSplitArgsA slice", p_copy, pp_args[i], (long)i, (long)p_want[i]);
+		}
+	}
+}
+
+static void FuzzDivide()
+{
+	u32 a = CorpusRandom(&g_seed) >> (CorpusRandom(&g_seed) % 32);
+	u32 b = CorpusRandom(&g_seed) >> (CorpusRandom(&g_seed) % 33 & 31);
+	u64 n = ((u64)CorpusRandom(&g_seed) << 32 | CorpusRandom(&g_seed)) >> (CorpusRandom(&g_seed) % 64);
+	u32 rem;
+
+	if (udiv(a, b) != (b ? a / b : 0xFFFFFFFF) || mod(a, b) != (b ? a % b : a))
+	{
+		FuzzFail("udiv/mod", "", "", (long)a, (long)b);
+	}
+	if (b != 0 && !(a == 0x80000000 && b == 0xFFFFFFFF) && idiv((i32)a, (i32)b) != (i32)a / (i32)b)
+	{
+		FuzzFail("idiv", "", "", (long)(i32)a, (long)(i32)b);
+	}
+	if (b != 0 && (UDivMod64(n, b, &rem) != n / b || rem != n % b))
+	{
+		FuzzFail("UDivMod64", "", "", (long)(n >> 32), (long)b);
+	}
+}
+
+int main(int argc, char **argv)
+{
+	unsigned long count = (argc > 1) ? strtoul(argv[1], NULL, 0) : 200000;
+	u32 levels = StrPrimsDetect() + 1;
+
+	if (argc > 2)
+	{
+		g_seed = (u32)strtoul(argv[2], NULL, 0) | 1;
+	}
+	// The default disk fits the default cache: a second `disk scan` reads nothing
+	if (FuzzCacheScan(KHEAP_SIZE, CACHE_BUDGET_DEFAULT, FUZZ_DISK_BLOCKS) != 0)
+	{
+		FuzzCacheFail("default disk past the default cache", FUZZ_DISK_BLOCKS, 1, 0);
+	}
+	for (g_iter = 0; g_iter < count; g_iter++)
+	{
+		StrPrimsSelect(g_iter % levels);
+		FuzzSearch();
+		FuzzStream();
+		FuzzPrims();
+		FuzzAhoCorasick();
+		FuzzBitap();
+		if ((g_iter & 63) == 0)
+		{
+			FuzzHeap();
+			FuzzNameTable();
+			FuzzCache();
+			FuzzCacheScan(FUZZ_HEAP_SZ, (CorpusRandom(&g_seed) % FUZZ_CACHE_MAX) * CACHE_BLOCK_SZ,
+				CorpusRandom(&g_seed) % (FUZZ_CACHE_MAX * 3) + 1);
+		}
+		FuzzItoa();
+		FuzzDivide();
+		FuzzTokenizer();
+	}
+	printf("strfuzz: %lu iterations over %u primitive levels, no mismatches\n", count, levels);
+	return 0;
+}
@@ -1,24 +1,52 @@
-__asm("jmp KernelStart");
-
-typedef unsigned char boolean;
-typedef unsigned char u8;
-typedef unsigned short u16;
-typedef unsigned int u32;
-typedef signed char i8;
-typedef signed short i16;
-typedef signed int i32;
-typedef unsigned long size_t;
-typedef signed int errno_t;
-
-#define OSMODE ((boolean *)0xbf1c)
-#define OSMODE_STD			0
-#define OSMODE_BM			1
+// Image header for the stage-2 loader in bootsect.asm: magic, load address
+// and size of the image. The loader calls the first byte, kernel.ld keeps
+// .text.boot at the start of the image. Only the bytes up to _edata are on
+// disk, so .bss is cleared here before any C++ code runs.
+__asm(
+	".section .text.boot, \"ax\"\n"
+	".globl kernel_image\n"
+	"kernel_image:\n"
+	"jmp kernel_entry\n"
+	".balign 8\n"
+	".ascii \"SOSK\"\n"
+	".long kernel_image\n"
+	".long _edata - kernel_image\n"
+	"kernel_entry:\n"
+	"movl $_bss_start, %edi\n"
+	"movl $_bss_end, %ecx\n"
+	"subl %edi, %ecx\n"
+	"shrl $2, %ecx\n"
+	"xorl %eax, %eax\n"
+	"cld\n"
+	"rep stosl\n"
+	"jmp KernelStart\n"
+	".previous\n"
+);
+
+#include "strcore.h"
+#include "heap.h"
+#include "blockcache.h"
+
+typedef __builtin_va_list va_list;
+
+#define va_start(V, L) __builtin_va_start(V, L)
+#define va_arg(V, T) __builtin_va_arg(V, T)
+#define va_end(V) __builtin_va_end(V)
+
+#define OSMODE ((const u32 *)0xbf1c)	// Boot search mode, a MATCHER_* id
+#define BOOT_INFO ((const BootInfo *)0xbf00)	// Filled by the stage-2 loader
+#define BOOT_METHOD_CHS 1
+#define BOOT_METHOD_LBA 2
+#define BOOT_TICKS_10S ((u32)182)	// BIOS timer ticks in ten seconds
 
 #define VIDEO_BUF_PTR ((u8 *)0x000b8000)
-#define VIDEO_BUF_PTR_END ((u8 *)0x000c7fff)
+#define VIDEO_BUF_PTR_END ((u8 *)0x000bffff)
 #define VIDEO_BUF_LINEMAX ((size_t)80)
 #define VIDEO_BUF_MAX ((size_t)260)
+#define VIDEO_WINDOW_LINES ((size_t)(VIDEO_BUF_PTR_END - VIDEO_BUF_PTR + 1) / (VIDEO_BUF_LINEMAX * 2))
 #define VIDEO_COL_DEF 0x07
+#define VIDEO_CELL(CHR, COL) ((u16)(((u16)(COL) << 8) | (u8)(CHR)))
+#define VIDEO_CELL_BLANK VIDEO_CELL(' ', VIDEO_COL_DEF)
 #define VIDEO_POS_CHR(X, Y) (*(VIDEO_BUF_PTR + (Y) * VIDEO_BUF_LINEMAX * 2 + (X) * 2))
 #define VIDEO_POS_COL(X, Y) (*(VIDEO_BUF_PTR + (Y) * VIDEO_BUF_LINEMAX * 2 + (X) * 2 + 1))
 #define VIDEO_SET(CHR, COL, X, Y)  \
@@ -28,6 +56,11 @@ typedef signed int errno_t;
 	}
 #define CURSOR_PORT (0x3D4)
 
+#define PIT_PORT (0x40)
+#define PIT_CMD_PORT (0x43)
+#define PIT_FREQ ((u32)1193182)
+#define TIMER_HZ ((u32)100)
+
 #define KSCAN_OFFSET (0x80)
 #define KSCAN_SPACE (0x29)
 #define KSCAN_RETURN (0x1C)
@@ -36,30 +69,52 @@ typedef signed int errno_t;
 #define KSCAN_ALT (0x38)
 #define KSCAN_BACK (0x0E)
 
+#define KSCAN_PGUP (0x49)
+#define KSCAN_PGDN (0x51)
+#define KEYBOARD_RING_SZ ((u32)0x40)	// Power of two
+
 #define TERMINAL_STDIN_SZ ((size_t)0xFF)
-#define TERMINAL_STDOUT_SZ ((size_t)0x7FF)
-#define TERMINAL_OUT_SZ (TERMINAL_STDIN_SZ + TERMINAL_STDOUT_SZ)
+#define TERMINAL_INPUT_MAX ((size_t)(VIDEO_BUF_LINEMAX - 4))	// Fits one line after the prompt
+#define TERMINAL_ARGS_MAX ((TERMINAL_INPUT_MAX + 1) / 2)	// Every argument takes a byte and a separator
 #define TERMINAL_MAX_LINES ((size_t)25)
-#define BUFSIZE ((size_t)0xFF)
 
-#define KSHARE_COUNT_MAX ((size_t)0x10)
-#define KSHARE_ALLOC_MAX ((size_t)0x1FF)
-#define KSHARE_NAMEMAX ((size_t)0x20)
+#define CONSOLE_SCROLLBACK ((size_t)512)	// Lines kept for scrollback, power of two
+#define SCREEN_ROW(SCR, Y) (((SCR)->Row0 + (Y)) % TERMINAL_MAX_LINES)
+#define CONSOLE_LINE(CON, N) ((CON)->Lines[(N) & (CONSOLE_SCROLLBACK - 1)])
+#define CONSOLE_CLEAN ((u32)0xFFFFFFFF)
+#define CONSOLE_PAGER_PROMPT "-- More -- (space: page, enter: line, q: quit)"
+#define CONSOLE_PAGER_COL 0x70
+
+#define WRITER_BUF_SZ ((size_t)0x100)
+#define WRITER_NUM_SZ ((size_t)12)
+
+#define KHEAP_BASE ((u8 *)0x00100000)	// First megabyte above the BIOS area, A20 is on
+
+#define KSHARE_SLOTS_MIN ((u32)16)	// Initial hash slots, doubled when 3/4 full
+
+#define PROGRAM_HASH_BITS 6
+#define PROGRAM_HASH_SLOTS ((u32)1 << PROGRAM_HASH_BITS)	// Built-in dispatch table
+#define PROGRAM_HASH_EMPTY ((u8)0xFF)
+#define PROGRAM_EXTRA_SLOTS ((u32)16)	// Runtime-added programs, 3/4 usable
+
+#define PIPE_SZ ((u32)0x4000)			// Ring bytes between two stages, power of two
+#define PIPE_LINE_MAX ((u32)BUFSIZE)	// Longer lines reach PipeReadLine() in pieces
+#define PIPE_STAGES_MAX ((size_t)8)
+#define TASK_STACK_SZ ((size_t)0x4000)	// Stack of every pipeline stage
+
+#define TEMPLATE_SET_MAX ((size_t)4)
 
-#define PROGRAM_MAX ((size_t)0xFF)		// Maximum loadable number of programs
-#define PROGRAM_NAMEMAX	((size_t)32)
-#define PROGRAM_ARGMAX ((size_t)4)
+#define SCAN_CONTEXT ((size_t)48)	// Bytes from a hit on that scan prints
+
+#define BENCH_CORPUS_MAX ((size_t)0x100000)
+#define BENCH_CORPUS_DEF ((size_t)0x4000)
+#define BENCH_PATTERN_MAX ((size_t)32)
+#define BENCH_CALIB_TICKS ((u32)10)
+#define BENCH_SEED ((u32)0x5EED1234)
 
-#define SUCCESS						0
-#define FAIL						1
-#define ERR_NULL_POINTER			2
 #define ERR_TERMINAL_BUFFER_CRASHED 3
 #define ERR_TERMINAL_INPUT_IS_EMPTY	4
 
-#define FALSE 0
-#define TRUE 1
-
-#define NULL (0UL)
 #define IS_OK(VAR, EXIT)  \
 	if ((VAR) != SUCCESS) \
 	{                     \
@@ -71,11 +126,62 @@ typedef signed int errno_t;
 		goto EXIT;         \
 	}
 
+#define TRACE_RING_SZ ((u32)0x400)	// Power of two
+#define TRACE_STAT_MAX ((size_t)16)
+
 #define IDT_TYPE_INTR (0x0E)
 #define IDT_TYPE_TRAP (0x0F)
 
 #define GDT_CS (0x8)
 #define PIC1_PORT (0x20)
+#define PIC2_PORT (0xA0)
+#define PIC2_VECTOR (0x70)	// Slave PIC base the BIOS set up, left in place
+
+#define PCI_CONFIG_ADDR (0xCF8)
+#define PCI_CONFIG_DATA (0xCFC)
+#define PCI_DEVICES ((u32)256)	// Bus 0: 32 slots of 8 functions
+#define PCI_CLASS_IDE ((u32)0x0101)
+
+#define ATA_IO (0x1F0)			// Primary channel, the master drive only
+#define ATA_CTL (0x3F6)
+#define ATA_IRQ 14
+#define ATA_SECTOR_SZ ((u32)512)
+#define ATA_WINDOW_SECTORS ((u32)128)	// One command fills one 64 KB read-ahead window
+#define ATA_PRD_MAX 2			// A window crosses at most one 64 KB boundary
+#define ATA_LBA28_END ((u32)0x10000000)
+#define ATA_NO_LBA ((u32)0xFFFFFFFF)
+#define ATA_TIMEOUT_TICKS ((u32)(3 * TIMER_HZ))
+#define ATA_POLL_MAX ((u32)0x100000)
+
+#define ATA_REG_DATA 0			// Task file, offsets from ATA_IO
+#define ATA_REG_COUNT 2
+#define ATA_REG_LBA0 3
+#define ATA_REG_LBA1 4
+#define ATA_REG_LBA2 5
+#define ATA_REG_DRIVE 6
+#define ATA_REG_CMD 7			// Status when read
+#define ATA_SR_ERR 0x01
+#define ATA_SR_DRQ 0x08
+#define ATA_SR_DF 0x20
+#define ATA_SR_BSY 0x80
+#define ATA_CMD_READ_PIO 0x20
+#define ATA_CMD_READ_PIO_EXT 0x24
+#define ATA_CMD_READ_DMA 0xC8
+#define ATA_CMD_READ_DMA_EXT 0x25
+#define ATA_CMD_IDENTIFY 0xEC
+
+#define ATA_BM_CMD 0			// Bus master registers of the channel
+#define ATA_BM_STATUS 2
+#define ATA_BM_PRDT 4
+#define ATA_BM_START 0x01
+#define ATA_BM_TO_MEMORY 0x08
+#define ATA_BM_SR_ERR 0x02
+#define ATA_BM_SR_IRQ 0x04
+#define ATA_PRD_LAST ((u16)0x8000)
+
+#define DISK_IMAGE_MAGIC ((u32)0x52534F53)	// "SOSR", header sector of host/mkdisk
+
+#define CACHE_BLOCK_SECTORS ((u32)(CACHE_BLOCK_SZ / ATA_SECTOR_SZ))
 
 //
 // Structures
@@ -98,11 +204,108 @@ struct _IdtPtr
 } __attribute__((packed));
 typedef struct _IdtPtr IdtPtr;
 
+// Filled by the keyboard interrupt, drained by the main loop
+typedef struct _KeyRing
+{
+	volatile u8 Codes[KEYBOARD_RING_SZ];
+	volatile u32 Head;	// Written by the interrupt only
+	volatile u32 Tail;	// Written by the main loop only
+} KeyRing;
+
+typedef struct _TraceEvent
+{
+	u64 Stamp;			// rdtsc
+	const char *Name;	// Probe name, a string literal
+	u32 Payload;
+	u8 Kind;
+} TraceEvent;
+
+typedef struct _TraceRing
+{
+	TraceEvent Events[TRACE_RING_SZ];
+	u32 Head;			// Events recorded since the last clear
+	boolean IsOn;
+} TraceRing;
+
+// How the kernel image was loaded, see bootsect.asm
+typedef struct _BootInfo
+{
+	u32 Sectors;
+	u32 Ticks;			// BIOS timer ticks the load took
+	u16 Reads;			// int 0x13 requests, one per track over CHS
+	u16 Retries;
+	u8 Method;			// BOOT_METHOD_*
+	boolean IsPacked;	// Read as packed by host/lzpack, unpacked by the loader
+	u32 ImageSize;		// Unpacked bytes
+	u32 DiskBase;		// RAM disk, see host/mkdisk.cpp
+	u32 DiskSize;		// 0 when the disk image has none
+} BootInfo;
+
 IdtEntry g_idt[256];
 IdtPtr g_idt_ptr;
+volatile u32 g_ticks;
+KeyRing g_keys;
+TraceRing g_trace;
 
 typedef void (*IntrHandler)();
 
+// Latched by the disk interrupt, reading the status register acknowledges it
+typedef struct _AtaIrq
+{
+	volatile u32 Count;
+	volatile u8 Status;
+	volatile u8 BmStatus;
+	u16 Bm;				// Bus master ports, 0 without DMA
+} AtaIrq;
+
+// Physical region descriptor, read by the bus master
+typedef struct _AtaPrd
+{
+	u32 Addr;
+	u16 Bytes;			// 0 is 64 KB
+	u16 Flags;			// ATA_PRD_LAST on the final entry
+} AtaPrd;
+
+// Sectors of one read command. A DMA read may still be running into it.
+typedef struct _AtaWindow
+{
+	u8 *Buf;
+	u32 Lba;			// ATA_NO_LBA while it holds nothing
+	u32 Count;
+	u32 Seen;			// Interrupt count when its DMA read went out
+	boolean IsPending;
+	boolean IsAhead;	// Read ahead and not asked for yet
+} AtaWindow;
+
+typedef struct _AtaStats
+{
+	u32 Commands;
+	u32 Sectors;
+	u32 WindowHits;		// Requests served from a window already read
+	u32 ReadAheads;
+	u32 AheadUsed;
+	u32 Errors;
+	u32 WaitTicks;		// Spent in hlt waiting for the drive
+} AtaStats;
+
+// The master drive of the primary channel. Two windows: the one a
+// sequential reader works on and the next one, read ahead over DMA.
+typedef struct _AtaDisk
+{
+	boolean IsPresent;
+	boolean IsLba48;
+	boolean UseDma;
+	u32 Sectors;
+	char Model[41];
+	AtaPrd *Prd;
+	AtaWindow Win[2];
+	u32 Last;			// Window of the latest request
+	u32 NextLba;		// Where a sequential reader asks next
+	AtaStats Stats;
+} AtaDisk;
+
+AtaIrq g_ata_irq;
+
 typedef struct _Cursor
 {
 	size_t X;
@@ -110,67 +313,171 @@ typedef struct _Cursor
 	boolean IsInput;
 } Cursor;
 
+typedef struct _ScreenStats
+{
+	u32 Requests;		// TerminalFlush calls
+	u32 Coalesced;		// Requests merged into a later repaint
+	u32 Flushes;		// Repaints that reached video memory
+	u32 CellsWritten;	// Total cells written to video memory
+	u32 LastCells;		// Cells written by the last flush
+	u32 MaxCells;		// Largest single flush
+	u32 Scrolls;		// Hardware scrolls by one line
+	u32 Wraps;			// Scrolls that hit the end of the video window
+} ScreenStats;
+
+// Back and Front rows are a ring starting at Row0, so a scroll moves no cells.
+// Origin is the window line shown at the top of the display.
+typedef struct _Screen
+{
+	u16 Back[TERMINAL_MAX_LINES][VIDEO_BUF_LINEMAX];	// Next frame
+	u16 Front[TERMINAL_MAX_LINES][VIDEO_BUF_LINEMAX];	// Copy of video memory
+	u8 DirtyLo[TERMINAL_MAX_LINES];
+	u8 DirtyHi[TERMINAL_MAX_LINES];
+	u32 DirtyLines;		// Bit per row of Back
+	size_t Row0;
+	size_t Origin;
+	boolean IsHwScroll;
+	u32 LastTick;
+	volatile boolean Pending;
+	ScreenStats Stats;
+} Screen;
+
+typedef struct _ConsoleLine
+{
+	char Text[VIDEO_BUF_LINEMAX];
+	u8 Len;
+} ConsoleLine;
+
+// Line ring: lines are numbered from boot, only the last CONSOLE_SCROLLBACK are kept
+typedef struct _Console
+{
+	ConsoleLine Lines[CONSOLE_SCROLLBACK];
+	u32 First;			// Oldest line still kept
+	u32 Last;			// Line being appended to
+	u32 Home;			// Top line after the last clear
+	u32 View;			// Lines scrolled back from the bottom
+	u32 DirtyFrom;		// Lowest line changed since last repaint
+	u32 DrawnTop;		// Top line on last repaint
+	u32 Shown;			// Lines printed since input, for the pager
+	char In[TERMINAL_STDIN_SZ];
+	volatile u8 InLen;
+	volatile boolean InDone;
+	boolean IsPager;
+	boolean Paging;
+	boolean Mute;		// Pager was quit, drop output until next input
+	volatile char PagerKey;
+} Console;
+
+// Byte stream from one pipeline stage to the next. Head and Tail count
+// bytes since the pipe was made and wrap with u32, their difference is
+// the fill level.
+typedef struct _Pipe
+{
+	char *Buf;						// PIPE_SZ bytes from the kernel heap
+	u32 Head;						// Written by the producer only
+	u32 Tail;						// Written by the consumer only
+	u32 Hold;						// Bytes of the last line still in use by the consumer
+	boolean IsClosed;				// Producer has exited
+	boolean IsBroken;				// Consumer has exited, writes are dropped
+	char Spill[PIPE_LINE_MAX + 1];	// Lines that cannot be terminated in place
+} Pipe;
+
+typedef struct _Writer
+{
+	char Buf[WRITER_BUF_SZ];
+	size_t Len;
+	Pipe *Out;			// NULL for the terminal
+} Writer;
+
+// Read-only device the stage-2 loader filled from the disk image
+typedef struct _RamDisk
+{
+	const char *Data;
+	size_t Size;
+} RamDisk;
+
+// Named heap blocks shared between programs
 typedef struct _KerShare
 {
-	struct {
-		char Name[KSHARE_NAMEMAX];
-		u8 *Ptr;
-		u8 Size;
-	} Table[KSHARE_COUNT_MAX];
-	u8 Memory[KSHARE_ALLOC_MAX];
-	u8 *Next;
-	u8 *End;
-	u16 Count;
+	NameTable Names;
+	u32 Grows;
 } KerShare;
 
+// Arguments are terminated slices of the input line
 typedef struct _MsgProg
 {
 	u16 Count;
 	char **Args;
+	size_t *Lens;
+	Pipe *In;			// Output of the previous stage, NULL when there is none
+	Pipe *Out;			// Input of the next stage, NULL for the terminal
 } MsgProg;
 
+typedef struct _Task
+{
+	u32 Esp;			// Saved while the task is switched out
+	u8 *Stack;
+	int Result;
+	boolean IsDone;
+} Task;
+
+// The running pipeline. Stage n reads Pipes[n - 1] and writes Pipes[n].
+typedef struct _Pipeline
+{
+	MsgProg *Msgs;
+	u32 Count;			// 0 while no pipeline runs
+	u32 Current;		// Stage whose task is switched in
+	u32 ShellEsp;		// Stack of the terminal while a task runs
+	Task Tasks[PIPE_STAGES_MAX];
+	Pipe Pipes[PIPE_STAGES_MAX - 1];
+} Pipeline;
+
+Pipeline g_pipeline;
+
+typedef int (*ProgMain)(MsgProg *);
+
 typedef struct _SingleProg
 {
-	char Name[PROGRAM_NAMEMAX];
-	int (*Main)(MsgProg *);
+	const char *Name;
+	ProgMain Main;
 } SingleProg;
 
-typedef struct _ProgramBox
+// Slot of every built-in under ProgHash(name, Seed), see ProgHashBuild()
+typedef struct _ProgHashTable
+{
+	u32 Seed;
+	u8 Slots[PROGRAM_HASH_SLOTS];
+} ProgHashTable;
+
+// The "temp" share: the template text and its compiled matcher
+typedef struct _Template
+{
+	char Text[BUFSIZE];
+	MatchPattern Pat;
+} Template;
+
+typedef struct _TemplateBox
 {
 	u16 Count;
-	SingleProg Program[PROGRAM_MAX];
-} ProgramBox;
+	AhoCorasick *Sets[TEMPLATE_SET_MAX];	// Heap blocks, allocated on first use
+} TemplateBox;
 
-static const char alphabet[] = {
-	' ', '!', '"', '#', '$', '%', '&', '\'',
-	'(', ')', '*', '+', ',', '-', '.', '/',
-	'0', '1', '2', '3', '4', '5', '6', '7',
-	'8', '9', ':', ';', '<', '=', '>', '?',
-	'@', 'A', 'B', 'C', 'D', 'E', 'F', 'G',
-	'H', 'I', 'J', 'K', 'L', 'M', 'N', 'O',
-	'P', 'Q', 'R', 'S', 'T', 'U', 'V', 'W',
-	'X', 'Y', 'Z', '[', '\\', ']', '^', '_',
-	'`', 'a', 'b', 'c', 'd', 'e', 'f', 'g',
-	'h', 'i', 'j', 'k', 'l', 'm', 'n', 'o',
-	'p', 'q', 'r', 's', 't', 'u', 'v', 'w',
-	'x', 'y', 'z', '{', '|', '}', '~'
-};
+// Programs added at runtime, Ptr of each entry is its ProgMain
+typedef struct _ProgramBox
+{
+	NameTable Extra;
+	NameEntry Slots[PROGRAM_EXTRA_SLOTS];
+} ProgramBox;
 
 //
 // Prototypes
 //
 
-i32 idiv(i32 a, i32 b);
-u32 udiv(u32 a, u32 b);
-u32 mod(u32 a, u32 b);
-char *itoa(size_t num, char *p_str, size_t base);
-
 void TerminalClear(void);
-void TerminalApplyBackspace(void);
 errno_t TerminalGetChar(const char c);
 errno_t TerminalPutChar(const char c);
-void TerminalDelLastChar();
 errno_t TerminalPrint(const char *p_str);
+errno_t TerminalWrite(const char *p_data, size_t dataSz);
 void TerminalKeyHandle(Cursor *p_cur, const char c);
 Cursor *TerminalCursor(Cursor *p_cur);
 void TerminalCursorSetPos(size_t x, size_t y);
@@ -181,31 +488,31 @@ boolean TerminalReturn();
 void TerminalClose();
 boolean TerminalIsOpen();
 void TerminalFlush();
+void TerminalSync();
+void TerminalIdle();
+void TerminalRepaint();
+Screen *TerminalScreen(Screen *p_scr);
+Console *TerminalConsole(Console *p_con);
+void TerminalScroll(i32 lines);
+
+void ConsoleInit(Console *p_con);
+void ConsoleClear(Console *p_con);
+void ConsolePutChar(Console *p_con, const char c);
+void ConsoleNewLine(Console *p_con);
+void ConsolePause(Console *p_con);
+void ConsoleTouch(Console *p_con, u32 line);
+u32 ConsoleTop(Console *p_con);
+
+void ScreenInit(Screen *p_scr);
+void ScreenClear(Screen *p_scr);
+void ScreenPut(Screen *p_scr, size_t x, size_t y, u16 cell);
+void ScreenFlush(Screen *p_scr);
+void ScreenScroll(Screen *p_scr);
+void ScreenSetOrigin(Screen *p_scr, size_t line);
 
-errno_t StrCatA(char *p_dst, size_t dstSz, const char *p_src);
-errno_t StrCpyA(char *p_dst, size_t dstSz, const char *p_src);
-i8 StrCmpA(char *p_str, char *p_cmp);
-i8 StrnCmpA(char *p_str, char *p_cmp);
-size_t StrLenA(const char *p_str);
-const char *StrChrA(const char *p_str, const char c);
-char *StrChrA(char *p_str, const char c);
-const char *StrStrA(const char *p_str, const char *p_sub);
-char *StrTokA(char *p_str, const char delim);
-char *StrTokA(char *p_str, const char *p_sub);
-char *IntToStrA(size_t val);
-extern inline boolean IsUpper(const char c);
-extern inline boolean IsLower(const char c);
-char ToUpper(const char c);
-char ToLower(const char c);
-
-void ZeroMemory(void *p_buf, size_t bufSz);
-void CopyMemory(void *p_buf, void *p_data, size_t dataSz);
 char GetKeyChar(u8 code);
 
-char *Stdin(char p_newBuf[TERMINAL_STDIN_SZ]);
-char *Stdout(char p_newBuf[TERMINAL_STDOUT_SZ]);
-
-void DefaultIntrHandler();
+extern "C" void DefaultIntrHandler();
 void IntrRegHandler(i32 num, u16 segmSel, u16 flags, IntrHandler hndlr);
 void IntrStart();
 void IntrEnable();
@@ -213,34 +520,92 @@ void IntrDisable();
 extern inline char inb(u16 port);
 extern inline void outb(u16 port, char data);
 extern inline void outw(unsigned short port, unsigned int data);
-void KeyboardHandler();
-void KeyboardKey();
+extern "C" void TimerHandler();
+extern "C" void TimerTick();
+u32 TimerTicks();
+extern "C" void KeyboardHandler();
+extern "C" void KeyboardKey();
+size_t KeyboardPoll();
 void KeyHandler(u8 code);
 
-extern inline boolean GetOsMode();
+extern inline u32 inl(u16 port);
+extern inline void outl(u16 port, u32 data);
+extern inline void insw(u16 port, void *p_buf, size_t count);
+u32 PciRead(u32 dev, u32 reg);
+void PciWrite(u32 dev, u32 reg, u32 val);
+extern "C" void AtaHandler();
+extern "C" void AtaAck();
+errno_t DiskIdle(AtaDisk *p_disk);
+const u8 *DiskMap(AtaDisk *p_disk, u32 lba, u32 *p_count);
+errno_t DiskRead(AtaDisk *p_disk, u32 lba, u32 count, void *p_buf);
+void DiskFlush(AtaDisk *p_disk);
+errno_t CacheDiskRead(void *p_ctx, u32 block, u8 *p_buf);
+
+extern inline u64 ReadTsc();
+u32 TraceFirst();
+boolean TraceMatch(const char *p_name, const char *p_filter);
+
+extern inline u32 GetOsMode();
+void InitCpu();
+void InitMatcher();
 void InitTerminal();
 void InitIntr();
+void InitTimer();
+void InitTrace();
 void InitKeyboard();
+void InitHeap();
+void InitRamDisk();
+void InitAta();
+void InitCache();
 void InitShare();
 void InitProgBox();
+void InitTemplates();
+
+Heap *KernelHeap(Heap *p_heap);
+void *KernelAlloc(size_t size);
+void KernelFree(void *p_ptr);
+RamDisk *KernelRamDisk(RamDisk *p_disk);
+AtaDisk *KernelAta(AtaDisk *p_disk);
+BlockCache *KernelCache(BlockCache *p_bc);
 
 KerShare *KernelShare(KerShare *p_ks);
 u8 *KernelNewShare(const char *p_name, size_t blockSz);
 u8 *KernelGetShare(const char *p_name, size_t *p_size);
+void KernelFreeShare(const char *p_name);
 
 errno_t ProgStart(const char *p_progName, MsgProg *p_arg, int *p_result);
-boolean ProgExists(const char *p_progName, u16 *p_progId);
-errno_t ProgAdd(const char *p_name, int (*main)(MsgProg *));
+boolean ProgExists(const char *p_progName, ProgMain *p_main, u32 *p_progId);
+errno_t ProgAdd(const char *p_name, ProgMain main);
 ProgramBox *ProgBox(ProgramBox *p_progBox);
-
-void BoyerMooreBuildShift(const char *p_sub, size_t p_shift[sizeof(alphabet)]);
-size_t BoyerMoore(const char *p_str, const char *p_sub);
+TemplateBox *TemplateSets(TemplateBox *p_box);
+AhoCorasick *TemplateSetGet(const char *p_name, boolean isNew);
+
+Pipe *ProgStdout();
+void ProgWrite(const char *p_data, size_t dataSz);
+errno_t PipeInit(Pipe *p_pipe);
+void PipeWrite(Pipe *p_pipe, const char *p_data, size_t dataSz);
+size_t PipePeek(Pipe *p_pipe, const char **pp_data);
+void PipeSkip(Pipe *p_pipe, size_t count);
+boolean PipeReadLine(Pipe *p_pipe, StrSlice *p_line);
+errno_t TaskInit(Task *p_task);
+extern "C" void TaskSwitch(u32 *p_saveEsp, u32 loadEsp);
+void TaskYield();
+void PipelineRun(MsgProg *p_msgs, u32 count);
 
 //
 // Program staff
 //
 
+void WriterInit(Writer *p_wr);
+void WriterPutChar(Writer *p_wr, const char c);
+void WriterWrite(Writer *p_wr, const char *p_data, size_t dataSz);
+void WriterPuts(Writer *p_wr, const char *p_str);
+void WriterPad(Writer *p_wr, const char c, size_t count);
+void WriterFmt(Writer *p_wr, const char *p_format, va_list args);
+void WriterPrint(Writer *p_wr, const char *p_format, ...);
+void WriterFlush(Writer *p_wr);
 void PrintFmt(const char *p_format, ...);
+void PrintSpan(const char *p_data, size_t dataSz);
 
 //
 // Programs
@@ -253,20 +618,104 @@ static int StringOs_Downcase(MsgProg *p_msg);
 static int StringOs_Titlize(MsgProg *p_msg);
 static int StringOs_Template(MsgProg *p_msg);
 static int StringOs_Search(MsgProg *p_msg);
+static int StringOs_MSearch(MsgProg *p_msg);
+static int StringOs_FSearch(MsgProg *p_msg);
+static int StringOs_Scan(MsgProg *p_msg);
+static int StringOs_Disk(MsgProg *p_msg);
+static int StringOs_Cache(MsgProg *p_msg);
+static int StringOs_Screen(MsgProg *p_msg);
+static int StringOs_More(MsgProg *p_msg);
+static int StringOs_Trace(MsgProg *p_msg);
+static int StringOs_Mem(MsgProg *p_msg);
+static int StringOs_Bench(MsgProg *p_msg);
+static int StringOs_Mode(MsgProg *p_msg);
 static int StringOs_Shutdown(MsgProg *p_msg);
 
+// Built-in programs, in help order. The dispatch table below is computed
+// from these names by the compiler.
+static constexpr SingleProg g_builtins[] = {
+	{ "help", StringOs_Help },
+	{ "info", StringOs_Info },
+	{ "upcase", StringOs_Upcase },
+	{ "downcase", StringOs_Downcase },
+	{ "titlize", StringOs_Titlize },
+	{ "template", StringOs_Template },
+	{ "search", StringOs_Search },
+	{ "msearch", StringOs_MSearch },
+	{ "fsearch", StringOs_FSearch },
+	{ "scan", StringOs_Scan },
+	{ "disk", StringOs_Disk },
+	{ "cache", StringOs_Cache },
+	{ "screen", StringOs_Screen },
+	{ "more", StringOs_More },
+	{ "trace", StringOs_Trace },
+	{ "mem", StringOs_Mem },
+	{ "bench", StringOs_Bench },
+	{ "mode", StringOs_Mode },
+	{ "shutdown", StringOs_Shutdown },
+};
+#define PROGRAM_BUILTIN_COUNT ((u32)(sizeof(g_builtins) / sizeof(g_builtins[0])))
+
+static_assert(PROGRAM_BUILTIN_COUNT * 2 <= PROGRAM_HASH_SLOTS, "Grow PROGRAM_HASH_SLOTS");
+
+// StrHashSeedA() with the seed as the offset basis, cut to a slot
+constexpr u32 ProgHash(const char *p_name, u32 seed)
+{
+	return StrHashSeedA(p_name, seed) & (PROGRAM_HASH_SLOTS - 1);
+}
+
+// First seed from the FNV basis up that sends every built-in to its own slot
+constexpr ProgHashTable ProgHashBuild()
+{
+	ProgHashTable tab = {};
+	u32 n = 0;
+	u32 slot = 0;
+
+	for (tab.Seed = STR_HASH_BASIS; ; tab.Seed++)
+	{
+		for (slot = 0; slot < PROGRAM_HASH_SLOTS; slot++)
+		{
+			tab.Slots[slot] = PROGRAM_HASH_EMPTY;
+		}
+		for (n = 0; n < PROGRAM_BUILTIN_COUNT; n++)
+		{
+			slot = ProgHash(g_builtins[n].Name, tab.Seed);
+			if (tab.Slots[slot] != PROGRAM_HASH_EMPTY)
+			{
+				break;
+			}
+			tab.Slots[slot] = (u8)n;
+		}
+		if (n == PROGRAM_BUILTIN_COUNT)
+		{
+			return tab;
+		}
+	}
+}
+
+static constexpr ProgHashTable g_prog_hash = ProgHashBuild();
+
 //
 // Definitions
 //
 
-extern "C" int KernelStart()
+extern "C" __attribute__((used)) int KernelStart()
 {
+	InitCpu();
+	InitMatcher();
 	InitIntr();
 	InitKeyboard();
+	InitTimer();
+	InitTrace();
 	InitTerminal();
 	IntrStart();
 	IntrEnable();
+	InitHeap();
+	InitRamDisk();
+	InitAta();
+	InitCache();
 	InitShare();
+	InitTemplates();
 	InitProgBox();
 
 	TerminalPrint("Welcome to StringOS!\n");
@@ -280,170 +729,81 @@ extern "C" int KernelStart()
 	return SUCCESS;
 }
 
-i32 idiv(i32 a, i32 b)
+void TerminalClear(void)
 {
-	i32 res;
-	a = (a > 0) ? a : -a;
-	b = (b > 0) ? b : -b;
-	for (res = 0; a > 0; res++)
-	{
-		a -= b;
-	}
-	return res;
+	ConsoleClear(TerminalConsole(NULL));
+	TerminalScreen(NULL)->Pending = TRUE;
 }
 
-u32 udiv(u32 a, u32 b)
+errno_t TerminalGetChar(const char c)
 {
-	u32 res;
-	for (res = 0; a > 0; res++)
+	Console *p_con = TerminalConsole(NULL);
+
+	if (p_con->InDone)
 	{
-		a -= b;
+		return FAIL;
 	}
-	return res;
-}
 
-u32 mod(u32 a, u32 b)
-{
-	for (;;)
+	if (c == '\b')
 	{
-		if (a <= b)
+		if (p_con->InLen > 0)
 		{
-			return a;
+			p_con->InLen -= 1;
 		}
-		a -= b;
-	}
-}
-
-char *itoa(size_t num, char *p_str, size_t base)
-{
-	size_t i = 0;
-	bool isNegative = false;
-
-	if (num == 0)
-	{
-		p_str[i++] = '0';
-		p_str[i] = '\0';
-		return p_str;
 	}
-
-	if (num < 0 && base == 10)
+	else if (c == '\n')
 	{
-		isNegative = true;
-		num = -num;
+		p_con->InDone = TRUE;
 	}
-
-	while (num != 0)
+	else if (p_con->InLen < TERMINAL_INPUT_MAX)
 	{
-		size_t rem = num % base;
-		p_str[i++] = (rem > 9) ? (rem - 10) + 'a' : rem + '0';
-		num = num / base;
+		p_con->In[p_con->InLen] = c;
+		p_con->InLen += 1;
 	}
-
-	if (isNegative)
-		p_str[i++] = '-';
-
-	p_str[i] = '\0';
-
-	size_t start = 0;
-	size_t end = i - 1;
-	char buf;
-
-	while (start < end)
+	else
 	{
-		buf = *(p_str + start);
-		*(p_str + start) = *(p_str + end);
-		*(p_str + end) = buf;
-		start++;
-		end--;
+		return FAIL;
 	}
 
-	return p_str;
+	p_con->View = 0;
+	ConsoleTouch(p_con, p_con->Last);
+	return SUCCESS;
 }
 
-void TerminalClear(void)
+errno_t TerminalPutChar(const char c)
 {
-	u8 *p_video_buf = VIDEO_BUF_PTR;
-	while (p_video_buf < VIDEO_BUF_PTR_END)
-	{
-		*p_video_buf = 0;
-		p_video_buf++;
-	}
+	ConsolePutChar(TerminalConsole(NULL), c);
+	return SUCCESS;
 }
 
-void TerminalApplyBackspace(void)
+errno_t TerminalPrint(const char *p_str)
 {
-	char *p_stdin = Stdin(NULL);
-	char *p_stdout = Stdout(NULL);
-	size_t stdin_sz = StrLenA(p_stdin);
-	size_t stdout_sz = StrLenA(p_stdout);
+	Console *p_con = TerminalConsole(NULL);
 
-	for (size_t i = 0; i < stdin_sz; i++)
+	if (p_str == NULL)
 	{
-		if (p_stdin[i] == '\b')
-		{
-			if (i > 0)
-			{
-				p_stdin[i] = 0;
-				p_stdin[i - 1] = 0;
-			}
-			else
-			{
-				p_stdin[i] = 0;
-			}
-		}
+		return ERR_NULL_POINTER;
 	}
-
-	for (size_t i = 0; i < stdout_sz; i++)
+	for (; *p_str; p_str++)
 	{
-		if (p_stdout[i] == '\b')
-		{
-			if (i > 0)
-			{
-				p_stdout[i] = 0;
-				p_stdout[i - 1] = 0;
-			}
-			else
-			{
-				p_stdout[i] = 0;
-			}
-		}
+		ConsolePutChar(p_con, *p_str);
 	}
+	return SUCCESS;
 }
 
-errno_t TerminalGetChar(const char c)
+errno_t TerminalWrite(const char *p_data, size_t dataSz)
 {
-	char *p_stdin = Stdin(NULL);
-	size_t stdout_sz = StrLenA(p_stdin);
-	if (stdout_sz >= 40 && c != '\b' && c != '\n')
+	Console *p_con = TerminalConsole(NULL);
+
+	if (p_data == NULL)
 	{
-		return FAIL;
+		return ERR_NULL_POINTER;
 	}
-	char p_buf[2] = { c, '\0' };
-	return StrCatA(p_stdin, TERMINAL_STDIN_SZ, p_buf);
-}
-
-errno_t TerminalPutChar(const char c)
-{
-	char *p_stdout = Stdout(NULL);
-	char p_buf[2] = { c, '\0' };
-	return StrCatA(p_stdout, TERMINAL_STDOUT_SZ, p_buf);
-}
-
-void TerminalDelLastChar()
-{
-	char *p_stdin = Stdin(NULL);
-	size_t stdin_sz = StrLenA(p_stdin);
-	
-	if (stdin_sz > 0)
+	for (size_t i = 0; i < dataSz; i++)
 	{
-		p_stdin[stdin_sz] = 0;
+		ConsolePutChar(p_con, p_data[i]);
 	}
-}
-
-errno_t TerminalPrint(const char *p_str)
-{
-	char *p_stdout = Stdout(NULL);
-	return StrCatA(p_stdout, TERMINAL_STDOUT_SZ, p_str);
+	return SUCCESS;
 }
 
 void TerminalKeyHandle(Cursor *p_cur, const char c)
@@ -455,18 +815,21 @@ void TerminalKeyHandle(Cursor *p_cur, const char c)
 		is_input = p_cur->IsInput;
 	}
 
-	if (is_input && c != '\0')
+	if (TerminalConsole(NULL)->Paging)
+	{
+		TerminalConsole(NULL)->PagerKey = c;
+	}
+	else if (is_input && c != '\0')
 	{
 		if (c == '`')
 		{
 			TerminalClear();
-			ZeroMemory(Stdout(NULL), StrLenA(Stdout(NULL)));
 			TerminalPrint("(> ");
 			TerminalFlush();
 		}
-		else
+		else if (TerminalGetChar(c) == SUCCESS)
 		{
-			TerminalGetChar(c);
+			TerminalScreen(NULL)->Pending = TRUE;
 		}
 	}
 }
@@ -483,7 +846,13 @@ Cursor *TerminalCursor(Cursor *p_cur)
 
 void TerminalCursorSetPos(size_t x, size_t y)
 {
-	size_t new_pos = (y * VIDEO_BUF_LINEMAX) + x;
+	static size_t pos = -1;
+	size_t new_pos = ((TerminalScreen(NULL)->Origin + y) * VIDEO_BUF_LINEMAX) + x;
+	if (new_pos == pos)
+	{
+		return;
+	}
+	pos = new_pos;
 	outb(CURSOR_PORT, 0x0F);
 	outb(CURSOR_PORT + 1, (char)(new_pos & 0xFF));
 	outb(CURSOR_PORT, 0x0E);
@@ -492,96 +861,133 @@ void TerminalCursorSetPos(size_t x, size_t y)
 
 void TerminalInput(char *p_data, size_t *p_dataSz)
 {
-	char *p_stdin = Stdin(NULL);
-	size_t stdin_sz;
+	Console *p_con = TerminalConsole(NULL);
 	TerminalOpen();
+	TerminalFlush();
 	while (TerminalReturn() == FALSE)
 	{
-		TerminalFlush();
+		TerminalIdle();
 	}
 	TerminalClose();
 
-	stdin_sz = StrLenA(p_stdin);
-	for (size_t i = 0; i < stdin_sz; i++)
+	CopyMemory(p_data, p_con->In, p_con->InLen);
+	p_data[p_con->InLen] = '\0';
+	*p_dataSz = p_con->InLen + 1;
+
+	p_con->InLen = 0;
+	p_con->InDone = FALSE;
+}
+
+// Cuts the line at every '|' outside quotes. Quotes open only at the start
+// of an argument, as in StrTokNextA(). Returns the number of stages, of
+// which the first maxStages are stored.
+static size_t TerminalSplitStages(char *p_line, char **pp_stages, size_t maxStages)
+{
+	size_t count = 1;
+	char *p = p_line;
+	char quote;
+
+	pp_stages[0] = p_line;
+	while (*p)
 	{
-		if (p_stdin[i] == '\n')
+		if ((*p == '"' || *p == '\'') && (p == p_line || p[-1] == ' ' || p[-1] == '\t' || p[-1] == '\0'))
 		{
-			p_data[i] = '\0';
-			*p_dataSz = i + 1;
-			break;
+			quote = *p++;
+			for (; *p && *p != quote; p++)
+			{
+				continue;
+			}
+			p += (*p != '\0');
+			continue;
+		}
+		if (*p == '|')
+		{
+			*p = '\0';
+			if (count < maxStages)
+			{
+				pp_stages[count] = p + 1;
+			}
+			count++;
 		}
-		p_data[i] = p_stdin[i];
+		p++;
 	}
-
-	ZeroMemory(p_stdin, stdin_sz);
+	return count;
 }
 
 void TerminalEnter()
 {
 	char p_data[BUFSIZE];
-	static char pp_args[PROGRAM_ARGMAX][PROGRAM_NAMEMAX] = {0};
-	char *p_token;
+	char *pp_stages[PIPE_STAGES_MAX];
+	char *pp_args[TERMINAL_ARGS_MAX];
+	size_t p_lens[TERMINAL_ARGS_MAX];
+	MsgProg p_msgs[PIPE_STAGES_MAX];
 	size_t data_sz;
-	size_t i;
-	MsgProg msg = {0};
+	size_t stages;
+	size_t used = 0;
 	int result;
-	errno_t err;
 
 	TerminalPrint("(> ");
 	TerminalFlush();
 	TerminalInput(p_data, &data_sz);
 
-	if (p_data[0] == 0)
+	stages = TerminalSplitStages(p_data, pp_stages, PIPE_STAGES_MAX);
+	if (stages > PIPE_STAGES_MAX)
 	{
+		PrintFmt("A pipeline runs at most %u programs\n", PIPE_STAGES_MAX);
 		return;
 	}
 
-	p_token = StrTokA(p_data, ' ');
-	StrCpyA(pp_args[0], PROGRAM_NAMEMAX, p_token);
-	for (i = 1; i < PROGRAM_MAX; i++)
+	// Arguments point into p_data, which lives until the programs return
+	for (size_t s = 0; s < stages; s++)
 	{
-		p_token = StrTokA(NULL, ' ');
-		if (p_token == NULL)
+		p_msgs[s].Count = (u16)StrSplitArgsA(pp_stages[s], pp_args + used, p_lens + used, TERMINAL_ARGS_MAX - used);
+		if (p_msgs[s].Count == 0)
 		{
-			break;
+			if (stages > 1)
+			{
+				PrintFmt("Empty program in pipeline\n");
+			}
+			return;
 		}
-		StrCpyA(pp_args[i], PROGRAM_NAMEMAX, p_token);
+		p_msgs[s].Args = pp_args + used;
+		p_msgs[s].Lens = p_lens + used;
+		p_msgs[s].In = NULL;
+		p_msgs[s].Out = NULL;
+		used += p_msgs[s].Count;
 	}
-
-	msg.Count = i;
-	for (i = 0; i < msg.Count; i++)
+	if (stages == 1)
 	{
-		msg.Args[i] = pp_args[i];
+		ProgStart(p_msgs[0].Args[0], &p_msgs[0], &result);
+		return;
 	}
-	
-	ProgStart(pp_args[0], &msg, &result);
+	PipelineRun(p_msgs, (u32)stages);
 }
 
 void TerminalOpen()
 {
 	Cursor *p_cur = TerminalCursor(NULL);
+	Console *p_con = TerminalConsole(NULL);
+	p_con->Shown = 0;
+	p_con->Mute = FALSE;
 	p_cur->IsInput = TRUE;
 	TerminalKeyHandle(p_cur, '\0');
 }
 
 boolean TerminalReturn()
 {
-	char *p_buf = Stdin(NULL);
-	size_t len = StrLenA(p_buf);
-	
-	if (p_buf[len - 1] == '\n')
-	{
-		return TRUE;
-	}
-
-	return FALSE;
+	return TerminalConsole(NULL)->InDone;
 }
 
 void TerminalClose()
 {
 	Cursor *p_cur = TerminalCursor(NULL);
+	Console *p_con = TerminalConsole(NULL);
 	p_cur->IsInput = FALSE;
-	StrCatA(Stdout(NULL), TERMINAL_STDOUT_SZ, Stdin(NULL));
+	for (size_t i = 0; i < p_con->InLen; i++)
+	{
+		ConsolePutChar(p_con, p_con->In[i]);
+	}
+	ConsolePutChar(p_con, '\n');
 	TerminalKeyHandle(p_cur, '\0');
 }
 
@@ -592,336 +998,448 @@ boolean TerminalIsOpen()
 
 void TerminalFlush()
 {
+	Screen *p_scr = TerminalScreen(NULL);
+
+	// Bursts of output within one timer tick are merged into a single repaint
+	p_scr->Stats.Requests += 1;
+	if (p_scr->LastTick == TimerTicks())
+	{
+		p_scr->Pending = TRUE;
+		p_scr->Stats.Coalesced += 1;
+		return;
+	}
+
+	TerminalRepaint();
+}
+
+void TerminalSync()
+{
+	Screen *p_scr = TerminalScreen(NULL);
+	if (p_scr->Pending && p_scr->LastTick != TimerTicks())
+	{
+		TerminalRepaint();
+	}
+}
+
+void TerminalIdle()
+{
+	Screen *p_scr = TerminalScreen(NULL);
+
+	// Sleep until the next interrupt unless keys are queued. A pending repaint
+	// waits for the timer tick anyway. sti takes effect after hlt starts,
+	// so an interrupt arriving between the check and hlt still wakes us.
+	IntrDisable();
+	if (g_keys.Head == g_keys.Tail)
+	{
+		asm volatile ("sti; hlt");
+	}
+	else
+	{
+		IntrEnable();
+	}
+
+	KeyboardPoll();
+	if (p_scr->Pending)
+	{
+		TerminalSync();
+	}
+}
+
+void TerminalRepaint()
+{
+	Screen *p_scr = TerminalScreen(NULL);
+	Console *p_con = TerminalConsole(NULL);
 	Cursor *p_cur = TerminalCursor(NULL);
-	char out_buf[TERMINAL_OUT_SZ];
-	size_t out_len;
+	ConsoleLine *p_line;
+	u32 top = ConsoleTop(p_con);
+	u32 from;
+	u32 n;
 	size_t x;
 	size_t y;
-	
-	TerminalApplyBackspace();
-	ZeroMemory(out_buf, TERMINAL_OUT_SZ);
-	StrCatA(out_buf, TERMINAL_OUT_SZ, Stdout(NULL));
 
-	if (p_cur->IsInput)
+	TRACE_BEGIN("term.repaint", p_con->DirtyFrom);
+	p_scr->LastTick = TimerTicks();
+	p_scr->Pending = FALSE;
+
+	// Rows above the first changed line are still valid unless the view moved.
+	// Moving down by less than a screen is done by scrolling the display.
+	if (p_scr->IsHwScroll && top > p_con->DrawnTop && top - p_con->DrawnTop < TERMINAL_MAX_LINES)
 	{
-		StrCatA(out_buf, TERMINAL_OUT_SZ, Stdin(NULL));
+		for (n = p_con->DrawnTop; n < top; n++)
+		{
+			ScreenScroll(p_scr);
+		}
+		p_con->DrawnTop = top;
 	}
-
-	out_len = StrLenA(out_buf);
-	x = 0;
-	y = 0;
-
-	for (size_t i = 0; i < TERMINAL_OUT_SZ; i++)
+	from = (top != p_con->DrawnTop || p_con->DirtyFrom < top) ? top : p_con->DirtyFrom;
+	for (n = from; n < top + TERMINAL_MAX_LINES; n++)
 	{
-		if (out_buf[i] == '\n')
+		y = n - top;
+		x = 0;
+		if (n <= p_con->Last)
 		{
-			x = 0;
-			y += 1;
-			if (y == TERMINAL_MAX_LINES)
+			p_line = &CONSOLE_LINE(p_con, n);
+			for (; x < p_line->Len; x++)
 			{
-				ZeroMemory(Stdout(NULL), StrLenA(Stdout(NULL)));
-				TerminalPrint("(> ");
-				TerminalClear();
-				y = 0;
+				ScreenPut(p_scr, x, y, VIDEO_CELL(p_line->Text[x], VIDEO_COL_DEF));
 			}
 		}
-		else
+
+		if (n == p_con->Last && p_con->Paging)
 		{
-			if (i == out_len)
+			for (size_t i = 0; CONSOLE_PAGER_PROMPT[i]; i++, x++)
 			{
-				if (p_cur->IsInput)
-				{
-					p_cur->X = x;
-					p_cur->Y = y;
-					TerminalCursorSetPos(p_cur->X, p_cur->Y);
-				}
+				ScreenPut(p_scr, x, y, VIDEO_CELL(CONSOLE_PAGER_PROMPT[i], CONSOLE_PAGER_COL));
 			}
-
-			VIDEO_SET(out_buf[i], VIDEO_COL_DEF, x, y);
-
-			if (x == VIDEO_BUF_LINEMAX)
+		}
+		else if (n == p_con->Last && p_cur->IsInput)
+		{
+			for (size_t i = 0; i < p_con->InLen && x < VIDEO_BUF_LINEMAX; i++, x++)
 			{
-				x = 0;
-				y += 1;
+				ScreenPut(p_scr, x, y, VIDEO_CELL(p_con->In[i], VIDEO_COL_DEF));
 			}
-			else
+			if (x < VIDEO_BUF_LINEMAX)
 			{
-				x += 1;
+				p_cur->X = x;
+				p_cur->Y = y;
+				TerminalCursorSetPos(p_cur->X, p_cur->Y);
 			}
 		}
-	}
-}
 
-errno_t StrCatA(char *p_dst, size_t dstSz, const char *p_src)
-{
-	errno_t res = SUCCESS;
-	size_t src_len = StrLenA(p_src);
-	char *p_from = (char *)p_src;
-	for (; dstSz > src_len || ((res = FAIL) && 0); dstSz--)
-	{
-		if (*p_dst == 0)
-		{
-			break;
-		}
-		p_dst++;
-	}
-	if (res == SUCCESS)
-	{
-		while (*p_from)
+		for (; x < VIDEO_BUF_LINEMAX; x++)
 		{
-			*p_dst = *p_from;
-			p_dst++;
-			p_from++;
+			ScreenPut(p_scr, x, y, VIDEO_CELL_BLANK);
 		}
 	}
-	return res;
+	p_con->DrawnTop = top;
+	p_con->DirtyFrom = CONSOLE_CLEAN;
+
+	ScreenFlush(p_scr);
+	TRACE_END("term.repaint", p_scr->Stats.LastCells);
 }
 
-errno_t StrCpyA(char *p_dst, size_t dstSz, const char *p_src)
+Console *TerminalConsole(Console *p_con)
 {
-	for (size_t i = 0; i < dstSz; i++)
+	static Console *p = NULL;
+	if (p_con != NULL)
 	{
-		if (i == dstSz)
-		{
-			return FAIL;
-		}
-		p_dst[i] = p_src[i];
+		p = p_con;
 	}
-	return SUCCESS;
+	return p;
 }
 
-i8 StrCmpA(char *p_str, char *p_cmp)
+void TerminalScroll(i32 lines)
 {
-	i8 res = 0;
-	while ((*p_str != '\0' && *p_cmp != '\0') && *p_str == *p_cmp)
+	Console *p_con = TerminalConsole(NULL);
+	i32 view = (i32)p_con->View + lines;
+	u32 bottom;
+
+	p_con->View = 0;
+	bottom = ConsoleTop(p_con);
+
+	if (view < 0)
+	{
+		view = 0;
+	}
+	if ((u32)view > bottom - p_con->First)
 	{
-		p_str++;
-		p_cmp++;
+		view = bottom - p_con->First;
 	}
-	res = (*p_str == *p_cmp) ? 0 : (*p_str > *p_cmp) ? 1
-										 : -1;
-	return res;
+	p_con->View = view;
+	TerminalScreen(NULL)->Pending = TRUE;
 }
 
-i8 StrnCmpA(char *p_str, char *p_cmp, size_t n)
+void ConsoleInit(Console *p_con)
 {
-	i8 res = 0;
-	for (size_t i = 0; i < n; i++)
-	{
-		if (p_str[i] != p_cmp[i])
-		{
-			res = (p_str[i] == p_cmp[i]) ? 0 : (p_str[i] > p_cmp[i]) ? 1
-																	 : -1;
-			break;
-		}
-		if (p_str[i] == 0 || p_cmp[i] == 0)
-		{
-			res = (p_str[i] == p_cmp[i]) ? 0 : (p_str[i] > p_cmp[i]) ? 1
-																	 : -1;
-			break;
-		}
-	}
-	return res;
+	ZeroMemory(p_con, sizeof(Console));
+	p_con->DirtyFrom = CONSOLE_CLEAN;
+	p_con->IsPager = TRUE;
 }
 
-size_t StrLenA(const char *p_str)
+void ConsoleClear(Console *p_con)
 {
-	size_t len = 0;
-	for (; p_str[len]; len++)
+	if (CONSOLE_LINE(p_con, p_con->Last).Len != 0)
 	{
-		continue;
+		ConsoleNewLine(p_con);
 	}
-	return len;
+	p_con->Home = p_con->Last;
+	p_con->View = 0;
 }
 
-const char *StrChrA(const char *p_str, const char c)
+void ConsolePutChar(Console *p_con, const char c)
 {
-	size_t len = StrLenA(p_str);
-	for (size_t i = 0; i < len; i++)
+	ConsoleLine *p_line;
+
+	if (p_con->Mute)
 	{
-		if (p_str[i] == c)
-		{
-			return p_str + i;
-		}
+		return;
 	}
-	return NULL;
-}
 
-char *StrChrA(char *p_str, const char c)
-{
-	size_t len = StrLenA(p_str);
-	for (size_t i = 0; i < len; i++)
+	if (c == '\n')
 	{
-		if (p_str[i] == c)
-		{
-			return p_str + i;
-		}
+		ConsoleNewLine(p_con);
+		return;
 	}
-	return NULL;
-}
 
-const char *StrStrA(const char *p_str, const char *p_sub)
-{
-	size_t off;
-	if (GetOsMode() == OSMODE_BM)
+	p_line = &CONSOLE_LINE(p_con, p_con->Last);
+	if (c == '\b')
 	{
-		off = BoyerMoore(p_str, p_sub);
-		if (off != -1)
+		if (p_line->Len > 0)
 		{
-			return p_str + off;
+			p_line->Len -= 1;
+			ConsoleTouch(p_con, p_con->Last);
 		}
+		return;
 	}
-	else
+
+	if (p_line->Len == VIDEO_BUF_LINEMAX)
 	{
-		if (StrLenA(p_str) < StrLenA(p_sub))
-		{
-			return NULL;
-		}
-		size_t len = StrLenA(p_str) - StrLenA(p_sub);
-		for (off = 0; off <= len; off++)
+		ConsoleNewLine(p_con);
+		if (p_con->Mute)
 		{
-			if (StrnCmpA((char *)(p_str + off), (char *)p_sub, StrLenA(p_sub)) == 0)
-			{
-				return p_str + off;
-			}
+			return;
 		}
+		p_line = &CONSOLE_LINE(p_con, p_con->Last);
 	}
-	return NULL;
+	p_line->Text[p_line->Len++] = c;
+	ConsoleTouch(p_con, p_con->Last);
 }
 
-char *StrTokA(char *p_str, const char delim)
+void ConsoleNewLine(Console *p_con)
 {
-	static char p_save[BUFSIZE];
-	static char *p_ret;
-	static size_t len;
-	static size_t i;
-	char c;
-
-	if (p_str)
+	p_con->Last += 1;
+	CONSOLE_LINE(p_con, p_con->Last).Len = 0;
+	if (p_con->Last - p_con->First == CONSOLE_SCROLLBACK)
 	{
-		len = StrLenA(p_str);
-		if (len >= BUFSIZE || len == 0)
-		{
-			return NULL;
-		}
-		StrCpyA(p_save, BUFSIZE, p_str);
-		i = 0;
+		p_con->First += 1;
+	}
+	if (p_con->Home < p_con->First)
+	{
+		p_con->Home = p_con->First;
 	}
+	p_con->View = 0;
+	p_con->Shown += 1;
+	ConsoleTouch(p_con, p_con->Last);
 
-	if (i)
+	if (p_con->IsPager && !TerminalIsOpen() && p_con->Shown >= TERMINAL_MAX_LINES - 1)
 	{
-		i++;
+		ConsolePause(p_con);
 	}
-	
-	if (i >= len)
+}
+
+void ConsolePause(Console *p_con)
+{
+	char key = 0;
+
+	p_con->PagerKey = 0;
+	p_con->Paging = TRUE;
+	ConsoleTouch(p_con, p_con->Last);
+	TerminalRepaint();
+
+	while (key != ' ' && key != '\n' && key != 'q')
 	{
-		return NULL;
+		TerminalIdle();
+		key = p_con->PagerKey;
+		p_con->PagerKey = 0;
 	}
 
-	p_ret = p_save + i;
-	for (; p_save[i] && p_save[i] != delim; i++)
+	if (key == ' ')
 	{
-		continue;
+		p_con->Shown = 0;
+	}
+	else if (key == '\n')
+	{
+		p_con->Shown = TERMINAL_MAX_LINES - 2;
 	}
+	else
+	{
+		p_con->Mute = TRUE;
+	}
+	p_con->Paging = FALSE;
+	ConsoleTouch(p_con, p_con->Last);
+	TerminalRepaint();
+}
 
-	p_save[i] = '\0';
-	return p_ret;
+void ConsoleTouch(Console *p_con, u32 line)
+{
+	if (line < p_con->DirtyFrom)
+	{
+		p_con->DirtyFrom = line;
+	}
 }
 
-char *StrTokA(char *p_str, const char *p_delim)
+u32 ConsoleTop(Console *p_con)
 {
-	static char *buf;
-	char *ret;
-	char *b;
-	const char *d;
+	u32 top = p_con->Home;
 
-	if (p_str != NULL) buf = p_str;
-	if (buf[0] == '\0') return NULL;
+	if (p_con->Last - top >= TERMINAL_MAX_LINES)
+	{
+		top = p_con->Last - (TERMINAL_MAX_LINES - 1);
+	}
+	if (top - p_con->First < p_con->View)
+	{
+		return p_con->First;
+	}
+	return top - p_con->View;
+}
+
+Screen *TerminalScreen(Screen *p_scr)
+{
+	static Screen *p = NULL;
+	if (p_scr != NULL)
+	{
+		p = p_scr;
+	}
+	return p;
+}
 
-	ret = buf;
+void ScreenInit(Screen *p_scr)
+{
+	u16 *p_video = (u16 *)VIDEO_BUF_PTR;
 
-	for (b = buf; *b != '\0'; b++)
+	ZeroMemory(p_scr, sizeof(Screen));
+	for (size_t y = 0; y < TERMINAL_MAX_LINES; y++)
 	{
-		for (d = p_delim; *d != '\0'; d++)
+		for (size_t x = 0; x < VIDEO_BUF_LINEMAX; x++)
 		{
-			if (*b == *d)
-			{
-				*b = '\0';
-				buf = b + 1;
-
-				if (b == ret)
-				{
-					ret++;
-					continue;
-				}
-				return ret;
-			}
+			p_scr->Back[y][x] = VIDEO_CELL_BLANK;
+			p_scr->Front[y][x] = VIDEO_CELL_BLANK;
+			p_video[y * VIDEO_BUF_LINEMAX + x] = VIDEO_CELL_BLANK;
 		}
 	}
-
-	return ret;
+	p_scr->LastTick = TimerTicks() - 1;
+	p_scr->IsHwScroll = TRUE;
+	ScreenSetOrigin(p_scr, 0);
 }
 
-char *IntToStrA(size_t val)
+void ScreenClear(Screen *p_scr)
 {
-	static char buf[BUFSIZE];
-	return itoa(val, buf, 10);
+	for (size_t y = 0; y < TERMINAL_MAX_LINES; y++)
+	{
+		for (size_t x = 0; x < VIDEO_BUF_LINEMAX; x++)
+		{
+			ScreenPut(p_scr, x, y, VIDEO_CELL_BLANK);
+		}
+	}
 }
 
-inline boolean IsUpper(const char c)
+void ScreenPut(Screen *p_scr, size_t x, size_t y, u16 cell)
 {
-	return (c >= 'A') && (c <= 'Z');
-}
+	size_t r = SCREEN_ROW(p_scr, y);
+	u32 bit = (u32)1 << r;
 
-inline boolean IsLower(const char c)
-{
-	return (c >= 'a') && (c <= 'z');
+	if (p_scr->Back[r][x] == cell)
+	{
+		return;
+	}
+	p_scr->Back[r][x] = cell;
+
+	if ((p_scr->DirtyLines & bit) == 0)
+	{
+		p_scr->DirtyLines |= bit;
+		p_scr->DirtyLo[r] = (u8)x;
+		p_scr->DirtyHi[r] = (u8)x;
+	}
+	else if (x < p_scr->DirtyLo[r])
+	{
+		p_scr->DirtyLo[r] = (u8)x;
+	}
+	else if (x > p_scr->DirtyHi[r])
+	{
+		p_scr->DirtyHi[r] = (u8)x;
+	}
 }
 
-char ToUpper(const char c)
+void ScreenFlush(Screen *p_scr)
 {
-	if (IsLower(c))
+	u16 *p_video = (u16 *)VIDEO_BUF_PTR;
+	u16 *p_line;
+	u32 cells = 0;
+	size_t y;
+
+	if (p_scr->DirtyLines == 0)
 	{
-		return c - ('a' - 'A');
+		return;
 	}
-	else
+
+	for (size_t r = 0; r < TERMINAL_MAX_LINES; r++)
+	{
+		if ((p_scr->DirtyLines & ((u32)1 << r)) == 0)
+		{
+			continue;
+		}
+		y = (r + TERMINAL_MAX_LINES - p_scr->Row0) % TERMINAL_MAX_LINES;
+		p_line = p_video + (p_scr->Origin + y) * VIDEO_BUF_LINEMAX;
+		for (size_t x = p_scr->DirtyLo[r]; x <= p_scr->DirtyHi[r]; x++)
+		{
+			if (p_scr->Back[r][x] != p_scr->Front[r][x])
+			{
+				p_scr->Front[r][x] = p_scr->Back[r][x];
+				p_line[x] = p_scr->Back[r][x];
+				cells += 1;
+			}
+		}
+	}
+	p_scr->DirtyLines = 0;
+
+	p_scr->Stats.Flushes += 1;
+	p_scr->Stats.CellsWritten += cells;
+	p_scr->Stats.LastCells = cells;
+	if (cells > p_scr->Stats.MaxCells)
 	{
-		return c;
+		p_scr->Stats.MaxCells = cells;
 	}
 }
 
-char ToLower(const char c)
+void ScreenScroll(Screen *p_scr)
 {
-	if (IsUpper(c))
+	u16 *p_video = (u16 *)VIDEO_BUF_PTR;
+	u16 *p_line;
+	size_t r;
+
+	if (p_scr->Origin + TERMINAL_MAX_LINES == VIDEO_WINDOW_LINES)
 	{
-		return c + ('a' - 'A');
+		// End of the window: move what is shown back to the window start
+		for (size_t y = 1; y < TERMINAL_MAX_LINES; y++)
+		{
+			r = SCREEN_ROW(p_scr, y);
+			p_line = p_video + (y - 1) * VIDEO_BUF_LINEMAX;
+			for (size_t x = 0; x < VIDEO_BUF_LINEMAX; x++)
+			{
+				p_line[x] = p_scr->Front[r][x];
+			}
+		}
+		p_scr->Stats.CellsWritten += (TERMINAL_MAX_LINES - 1) * VIDEO_BUF_LINEMAX;
+		p_scr->Stats.Wraps += 1;
+		ScreenSetOrigin(p_scr, 0);
 	}
 	else
 	{
-		return c;
+		ScreenSetOrigin(p_scr, p_scr->Origin + 1);
 	}
-}
 
-void ZeroMemory(void *p_buf, size_t bufSz)
-{
-	u8 *p = (u8 *)p_buf;
-	for (; bufSz; bufSz--)
+	// Top row of the ring becomes the new bottom line
+	r = p_scr->Row0;
+	p_scr->Row0 = (p_scr->Row0 + 1) % TERMINAL_MAX_LINES;
+	p_scr->DirtyLines &= ~((u32)1 << r);
+	p_line = p_video + (p_scr->Origin + TERMINAL_MAX_LINES - 1) * VIDEO_BUF_LINEMAX;
+	for (size_t x = 0; x < VIDEO_BUF_LINEMAX; x++)
 	{
-		*p = 0;
-		p++;
+		p_scr->Back[r][x] = VIDEO_CELL_BLANK;
+		p_scr->Front[r][x] = VIDEO_CELL_BLANK;
+		p_line[x] = VIDEO_CELL_BLANK;
 	}
+	p_scr->Stats.CellsWritten += VIDEO_BUF_LINEMAX;
+	p_scr->Stats.Scrolls += 1;
+	TRACE_POINT("term.scroll", p_scr->Origin);
 }
 
-void CopyMemory(void *p_buf, void *p_data, size_t dataSz)
+void ScreenSetOrigin(Screen *p_scr, size_t line)
 {
-	i8 *p_dst = (i8 *)p_buf;
-	i8 *p_src = (i8 *)p_data;
-	for (; dataSz; dataSz--)
-	{
-		*p_dst = *p_src;
-		p_dst++;
-		p_src++;
-	}
+	size_t start = line * VIDEO_BUF_LINEMAX;
+	p_scr->Origin = line;
+	outw(CURSOR_PORT, 0x0C | (start & 0xFF00));
+	outw(CURSOR_PORT, 0x0D | ((start & 0xFF) << 8));
 }
 
 char GetKeyChar(u8 code)
@@ -937,30 +1455,13 @@ char GetKeyChar(u8 code)
 	return key_map[code];
 }
 
-char *Stdin(char p_newBuf[TERMINAL_STDIN_SZ])
-{
-	static char *p_buf = NULL;
-	if (p_newBuf != NULL)
-	{
-		p_buf = p_newBuf;
-	}
-	return p_buf;
-}
-
-char *Stdout(char p_newBuf[TERMINAL_STDOUT_SZ])
+// Interrupt entry points are naked: the CPU pushes no return address a C
+// prologue could rely on, and with the frame pointer omitted a trailing
+// "leave" would pop the wrong stack. The stubs save every general register
+// around a plain C call instead.
+extern "C" __attribute__((naked)) void DefaultIntrHandler()
 {
-	static char *p_buf = NULL;
-	if (p_newBuf != NULL)
-	{
-		p_buf = p_newBuf;
-	}
-	return p_buf;
-}
-
-void DefaultIntrHandler()
-{
-	asm("pusha");
-	asm("popa; leave; iret");
+	asm("iret\n");
 }
 
 void IntrRegHandler(i32 num, u16 segmSel, u16 flags, IntrHandler hndlr)
@@ -1008,22 +1509,66 @@ inline void outw (unsigned short port, unsigned int data)
   asm volatile ("outw %w0, %w1" : : "a" (data), "Nd" (port));
 }
 
-void KeyboardHandler()
+extern "C" __attribute__((naked)) void TimerHandler()
+{
+	asm(
+		"pushal\n"
+		"cld\n"
+		"call TimerTick\n"
+		"popal\n"
+		"iret\n"
+	);
+}
+
+extern "C" __attribute__((used)) void TimerTick()
 {
-	asm("pusha");
-	KeyboardKey();
+	g_ticks++;
 	outb(PIC1_PORT, 0x20);
-	asm("popa; leave; iret");
 }
 
-void KeyboardKey()
+u32 TimerTicks()
+{
+	return g_ticks;
+}
+
+extern "C" __attribute__((naked)) void KeyboardHandler()
+{
+	asm(
+		"pushal\n"
+		"cld\n"
+		"call KeyboardKey\n"
+		"popal\n"
+		"iret\n"
+	);
+}
+
+extern "C" __attribute__((used)) void KeyboardKey()
 {
 	if (inb(0x64) & 0x01)
 	{
 		u8 scan_code;
 		scan_code = inb(0x60);
-		KeyHandler(scan_code);
+		if (g_keys.Head - g_keys.Tail < KEYBOARD_RING_SZ)
+		{
+			g_keys.Codes[g_keys.Head & (KEYBOARD_RING_SZ - 1)] = scan_code;
+			g_keys.Head = g_keys.Head + 1;
+		}
+	}
+	outb(PIC1_PORT, 0x20);
+}
+
+size_t KeyboardPoll()
+{
+	u32 head = g_keys.Head;
+	u32 tail = g_keys.Tail;
+	size_t count = head - tail;
+
+	for (; tail != head; tail++)
+	{
+		KeyHandler(g_keys.Codes[tail & (KEYBOARD_RING_SZ - 1)]);
 	}
+	g_keys.Tail = tail;
+	return count;
 }
 
 void KeyHandler(u8 code)
@@ -1039,6 +1584,12 @@ void KeyHandler(u8 code)
 			return;
 		}
 
+		if (code == KSCAN_PGUP || code == KSCAN_PGDN)
+		{
+			TerminalScroll((code == KSCAN_PGUP) ? TERMINAL_MAX_LINES - 1 : -(i32)(TERMINAL_MAX_LINES - 1));
+			return;
+		}
+
 		c = GetKeyChar(code);
 		if (c != '\0')
 		{
@@ -1066,443 +1617,2720 @@ void KeyHandler(u8 code)
 	}
 }
 
-inline boolean GetOsMode()
+inline u32 inl(u16 port)
 {
-	return *(OSMODE);
+	u32 data;
+	asm volatile ("inl %w1, %0" : "=a" (data) : "Nd" (port));
+	return data;
 }
 
-void InitTerminal()
+inline void outl(u16 port, u32 data)
 {
-	static Cursor cur = {0};
-	static char p_stdin[TERMINAL_STDIN_SZ];
-	static char p_stdout[TERMINAL_STDOUT_SZ];
-	TerminalClear();
-	TerminalCursor(&cur);
-	ZeroMemory(p_stdin, TERMINAL_STDIN_SZ);
-	ZeroMemory(p_stdout, TERMINAL_STDOUT_SZ);
-	Stdin(p_stdin);
-	Stdout(p_stdout);
+	asm volatile ("outl %0, %w1" : : "a" (data), "Nd" (port));
 }
 
-void InitIntr()
+inline void insw(u16 port, void *p_buf, size_t count)
 {
-	int i;
-	int idt_count = sizeof(g_idt) / sizeof(g_idt[0]);
-	for (i = 0; i < idt_count; i++)
-		IntrRegHandler(i, GDT_CS, 0x80 | IDT_TYPE_INTR, DefaultIntrHandler);
+	asm volatile ("cld; rep insw" : "+D" (p_buf), "+c" (count) : "d" (port) : "memory");
 }
 
-void InitKeyboard()
+// Config space of bus 0, dev is slot << 3 | function
+u32 PciRead(u32 dev, u32 reg)
 {
-	IntrRegHandler(0x09, GDT_CS, 0x80 | IDT_TYPE_INTR, KeyboardHandler);
-	outb(PIC1_PORT + 1, 0xFF ^ 0x02);
+	outl(PCI_CONFIG_ADDR, 0x80000000 | (dev << 8) | (reg & 0xFC));
+	return inl(PCI_CONFIG_DATA);
 }
 
-void InitShare()
+void PciWrite(u32 dev, u32 reg, u32 val)
 {
-	static KerShare ks = {0};
-	KernelShare(&ks);
+	outl(PCI_CONFIG_ADDR, 0x80000000 | (dev << 8) | (reg & 0xFC));
+	outl(PCI_CONFIG_DATA, val);
 }
 
-void InitProgBox()
+extern "C" __attribute__((naked)) void AtaHandler()
 {
-	static ProgramBox prog_box;
-	ZeroMemory(&prog_box, sizeof(ProgramBox));
-	ProgBox(&prog_box);
-
-	// Programs here
-	ProgAdd("help", StringOs_Help);
-	ProgAdd("info", StringOs_Info);
-	ProgAdd("upcase", StringOs_Upcase);
-	ProgAdd("downcase", StringOs_Downcase);
-	ProgAdd("titlize", StringOs_Titlize);
-	ProgAdd("template", StringOs_Template);
-	ProgAdd("search", StringOs_Search);
-	ProgAdd("shutdown", StringOs_Shutdown);
+	asm(
+		"pushal\n"
+		"cld\n"
+		"call AtaAck\n"
+		"popal\n"
+		"iret\n"
+	);
 }
 
-KerShare *KernelShare(KerShare *p_ks)
+extern "C" __attribute__((used)) void AtaAck()
 {
-	static KerShare *p = NULL;
-	if (p_ks != NULL)
+	if (g_ata_irq.Bm != 0)
 	{
-		p = p_ks;
+		g_ata_irq.BmStatus = inb(g_ata_irq.Bm + ATA_BM_STATUS);
 	}
-	return p;
+	g_ata_irq.Status = inb(ATA_IO + ATA_REG_CMD);
+	g_ata_irq.Count = g_ata_irq.Count + 1;
+	outb(PIC2_PORT, 0x20);
+	outb(PIC1_PORT, 0x20);
 }
 
-u8 *KernelNewShare(const char *p_name, size_t blockSz)
+// Four reads of the alternate status take the 400 ns the drive needs
+static u8 AtaAltStatus()
 {
-	KerShare *p_ks = KernelShare(NULL);
-	u8 *p_ret = NULL;
-	if (p_ks->Next == NULL)
+	for (u32 i = 0; i < 3; i++)
 	{
-		p_ks->Next = p_ks->Memory;
-		p_ks->End = p_ks->Memory + KSHARE_ALLOC_MAX;
+		inb(ATA_CTL);
 	}
-	if (p_ks->Count < KSHARE_COUNT_MAX)
+	return inb(ATA_CTL);
+}
+
+static errno_t AtaWaitReady()
+{
+	for (u32 i = 0; i < ATA_POLL_MAX; i++)
 	{
-		if (p_ks->Next + blockSz < p_ks->End)
+		if (!(AtaAltStatus() & ATA_SR_BSY))
 		{
-			p_ret = p_ks->Next;
-			p_ks->Next += blockSz;
-			StrCpyA(p_ks->Table[p_ks->Count].Name, KSHARE_NAMEMAX, p_name);
-			p_ks->Table[p_ks->Count].Ptr = p_ret;
-			p_ks->Table[p_ks->Count].Size = blockSz;
-			p_ks->Count += 1;
+			return SUCCESS;
 		}
 	}
-	return p_ret;
+	return FAIL;
 }
 
-u8 *KernelGetShare(const char *p_name, size_t *p_size)
+// Sleeps until the interrupt after the one counted in seen
+static errno_t AtaWaitIrq(AtaDisk *p_disk, u32 seen)
 {
-	KerShare *p_ks = KernelShare(NULL);
-	u16 count = p_ks->Count;
-	for (u16 i = 0; i < count; i++)
+	u32 start = TimerTicks();
+	errno_t err = SUCCESS;
+
+	for (;;)
 	{
-		if (StrCmpA(p_ks->Table[i].Name, (char*)p_name) == 0)
+		IntrDisable();
+		if (g_ata_irq.Count != seen)
+		{
+			IntrEnable();
+			break;
+		}
+		if (TimerTicks() - start > ATA_TIMEOUT_TICKS)
 		{
-			*p_size = p_ks->Table[i].Size;
-			return p_ks->Table[i].Ptr;
+			IntrEnable();
+			err = FAIL;
+			break;
 		}
+		asm volatile ("sti; hlt");
 	}
-	return NULL;
+	p_disk->Stats.WaitTicks += TimerTicks() - start;
+	return err;
 }
 
-errno_t ProgStart(const char *p_progName, MsgProg *p_arg, int *p_result)
+static errno_t AtaIssue(u32 lba, u32 count, u8 cmd28, u8 cmd48)
 {
-	errno_t err = FAIL;
-	char *p_stdout = Stdout(NULL);
-	size_t stdout_sz = StrLenA(p_stdout);
-	ProgramBox *p_prog_box = ProgBox(NULL);
-	u16 prog_id;
-	
-	// TerminalClear();
-	// ZeroMemory(p_stdout, stdout_sz);
-
-	if (ProgExists(p_progName, &prog_id))
+	if (AtaWaitReady() != SUCCESS)
 	{
-		*p_result = p_prog_box->Program[prog_id].Main(p_arg);
-		err = SUCCESS;
+		return FAIL;
+	}
+	if (lba + count > ATA_LBA28_END)
+	{
+		outb(ATA_IO + ATA_REG_DRIVE, 0x40);
+		AtaAltStatus();
+		outb(ATA_IO + ATA_REG_COUNT, (char)(count >> 8));
+		outb(ATA_IO + ATA_REG_LBA0, (char)(lba >> 24));
+		outb(ATA_IO + ATA_REG_LBA1, 0);
+		outb(ATA_IO + ATA_REG_LBA2, 0);
+		outb(ATA_IO + ATA_REG_COUNT, (char)count);
+		outb(ATA_IO + ATA_REG_LBA0, (char)lba);
+		outb(ATA_IO + ATA_REG_LBA1, (char)(lba >> 8));
+		outb(ATA_IO + ATA_REG_LBA2, (char)(lba >> 16));
+		outb(ATA_IO + ATA_REG_CMD, (char)cmd48);
 	}
 	else
 	{
-		TerminalPrint("Program ");
-		TerminalPrint(p_progName);
-		TerminalPrint(" doesn't exists\n");
-		TerminalFlush();
+		outb(ATA_IO + ATA_REG_DRIVE, (char)(0xE0 | ((lba >> 24) & 0x0F)));
+		AtaAltStatus();
+		outb(ATA_IO + ATA_REG_COUNT, (char)count);	// 256 is sent as 0
+		outb(ATA_IO + ATA_REG_LBA0, (char)lba);
+		outb(ATA_IO + ATA_REG_LBA1, (char)(lba >> 8));
+		outb(ATA_IO + ATA_REG_LBA2, (char)(lba >> 16));
+		outb(ATA_IO + ATA_REG_CMD, (char)cmd28);
 	}
-
-	return err;
+	return SUCCESS;
 }
 
-boolean ProgExists(const char *p_progName, u16 *p_progId)
+// The drive interrupts once per sector, when it has the sector ready
+static errno_t AtaReadPio(AtaDisk *p_disk, u32 lba, u32 count, u8 *p_buf)
 {
-	ProgramBox *p_prog_box = ProgBox(NULL);
-	SingleProg *p_program = p_prog_box->Program;
-	u16 n = p_prog_box->Count;
+	u32 seen = g_ata_irq.Count;
 
-	for (u16 i = 0; i < n; i++)
+	if (AtaIssue(lba, count, ATA_CMD_READ_PIO, ATA_CMD_READ_PIO_EXT) != SUCCESS)
+	{
+		return FAIL;
+	}
+	for (u32 i = 0; i < count; i++)
 	{
-		if (StrCmpA(p_program[i].Name, (char*)p_progName) == 0)
+		if (AtaWaitIrq(p_disk, seen) != SUCCESS || (g_ata_irq.Status & (ATA_SR_ERR | ATA_SR_DF)) || !(g_ata_irq.Status & ATA_SR_DRQ))
 		{
-			*p_progId = i;
-			return TRUE;
+			return FAIL;
 		}
+		seen = g_ata_irq.Count;
+		insw(ATA_IO + ATA_REG_DATA, p_buf + i * ATA_SECTOR_SZ, ATA_SECTOR_SZ / 2);
 	}
-	return FALSE;
+	return SUCCESS;
 }
 
-errno_t ProgAdd(const char *p_name, int (*main)(MsgProg *))
+// Starts a bus master read and returns at once, AtaFinishDma() waits for it
+static errno_t AtaStartDma(AtaDisk *p_disk, AtaWindow *p_win)
 {
-	errno_t err = FAIL;
-	ProgramBox *p_prog_box = ProgBox(NULL);
-	u16 n = p_prog_box->Count;
+	u16 bm = g_ata_irq.Bm;
+	u32 addr = (u32)p_win->Buf;
+	u32 left = p_win->Count * ATA_SECTOR_SZ;
+	u32 n = 0;
+	u32 len;
 
-	if (p_name && main)
+	for (; left != 0; n++)
 	{
-		if (n < PROGRAM_MAX)
-		{
-			StrCpyA(p_prog_box->Program[n].Name, PROGRAM_NAMEMAX, p_name);
-			p_prog_box->Program[n].Main = main;
-			p_prog_box->Count += 1;
-			err = SUCCESS;
-		}
+		len = 0x10000 - (addr & 0xFFFF);
+		len = (len < left) ? len : left;
+		p_disk->Prd[n].Addr = addr;
+		p_disk->Prd[n].Bytes = (u16)len;
+		p_disk->Prd[n].Flags = 0;
+		addr += len;
+		left -= len;
 	}
+	p_disk->Prd[n - 1].Flags = ATA_PRD_LAST;
+
+	outb(bm + ATA_BM_CMD, 0);
+	outl(bm + ATA_BM_PRDT, (u32)p_disk->Prd);
+	outb(bm + ATA_BM_CMD, ATA_BM_TO_MEMORY);
+	outb(bm + ATA_BM_STATUS, inb(bm + ATA_BM_STATUS) | ATA_BM_SR_ERR | ATA_BM_SR_IRQ);
+	p_win->IsPending = TRUE;
+	p_win->Seen = g_ata_irq.Count;
+	if (AtaIssue(p_win->Lba, p_win->Count, ATA_CMD_READ_DMA, ATA_CMD_READ_DMA_EXT) != SUCCESS)
+	{
+		p_win->IsPending = FALSE;
+		return FAIL;
+	}
+	outb(bm + ATA_BM_CMD, ATA_BM_TO_MEMORY | ATA_BM_START);
+	return SUCCESS;
+}
+
+static errno_t AtaFinishDma(AtaDisk *p_disk, AtaWindow *p_win)
+{
+	u16 bm = g_ata_irq.Bm;
+	errno_t err = AtaWaitIrq(p_disk, p_win->Seen);
+
+	outb(bm + ATA_BM_CMD, 0);
+	outb(bm + ATA_BM_STATUS, ATA_BM_SR_ERR | ATA_BM_SR_IRQ);
+	p_win->IsPending = FALSE;
+	if (err != SUCCESS || (g_ata_irq.BmStatus & ATA_BM_SR_ERR) || (g_ata_irq.Status & (ATA_SR_ERR | ATA_SR_DF)))
+	{
+		return FAIL;
+	}
+	return SUCCESS;
+}
+
+// One read command for the window at lba. Over DMA it is still running on return.
+static errno_t AtaFill(AtaDisk *p_disk, AtaWindow *p_win, u32 lba, boolean isAhead)
+{
+	errno_t err;
 
+	p_win->Lba = lba;
+	p_win->Count = p_disk->Sectors - lba;
+	p_win->Count = (p_win->Count < ATA_WINDOW_SECTORS) ? p_win->Count : ATA_WINDOW_SECTORS;
+	p_win->IsAhead = isAhead;
+	p_disk->Stats.Commands += 1;
+	p_disk->Stats.Sectors += p_win->Count;
+	p_disk->Stats.ReadAheads += isAhead;
+	TRACE_POINT("ata.read", lba);
+	err = p_disk->UseDma ? AtaStartDma(p_disk, p_win) : AtaReadPio(p_disk, lba, p_win->Count, p_win->Buf);
+	if (err != SUCCESS)
+	{
+		p_win->Lba = ATA_NO_LBA;
+		p_disk->Stats.Errors += 1;
+	}
 	return err;
 }
 
-ProgramBox *ProgBox(ProgramBox *p_progBox)
+static errno_t AtaSettle(AtaDisk *p_disk, AtaWindow *p_win)
 {
-	static ProgramBox *p = NULL;
-	if (p_progBox != NULL)
+	if (!p_win->IsPending)
 	{
-		p = p_progBox;
+		return (p_win->Lba != ATA_NO_LBA) ? SUCCESS : FAIL;
 	}
-	return p;
+	if (AtaFinishDma(p_disk, p_win) != SUCCESS)
+	{
+		p_win->Lba = ATA_NO_LBA;
+		p_disk->Stats.Errors += 1;
+		return FAIL;
+	}
+	return SUCCESS;
 }
 
-void BoyerMooreBuildShift(const char *p_sub, size_t p_shift[sizeof(alphabet)])
+// Waits for a read ahead still running, nothing else may use the channel meanwhile
+errno_t DiskIdle(AtaDisk *p_disk)
 {
-	size_t len = StrLenA(p_sub);
-	for (size_t i = 0; i < sizeof(alphabet); i++)
+	errno_t err = SUCCESS;
+
+	for (u32 i = 0; i < 2; i++)
 	{
-		const char *p = StrChrA(p_sub, alphabet[i]);
-		if (p != NULL && p != p_sub + len - 1)
+		if (p_disk->Win[i].IsPending && AtaSettle(p_disk, &p_disk->Win[i]) != SUCCESS)
 		{
-			p_shift[i] = (size_t)(p_sub + len - 1 - p);
-		}
-		else
-		{
-			p_shift[i] = len;
+			err = FAIL;
 		}
 	}
+	return err;
 }
 
-size_t BoyerMoore(const char *p_str, const char *p_sub)
+// Sectors from lba on, read in place inside a window. *p_count is cut to
+// what the window holds. The pointer stays valid until the next call.
+// A reader that continues where it stopped gets the following window
+// read ahead over DMA while it works on this one.
+const u8 *DiskMap(AtaDisk *p_disk, u32 lba, u32 *p_count)
 {
-	size_t p_shift[sizeof(alphabet)];
-	size_t str_len = StrLenA(p_str);
-	size_t sub_len = StrLenA(p_sub);
-	size_t i = sub_len - 1;
-	size_t v = i;
-	size_t k = i;
+	boolean is_seq = (lba == p_disk->NextLba);
+	AtaWindow *p_win = NULL;
+	AtaWindow *p_next;
+	u32 end;
 
-	if (sub_len > str_len)
+	if (!p_disk->IsPresent || lba >= p_disk->Sectors || *p_count == 0)
 	{
-		return -1;
+		return NULL;
 	}
-
-	BoyerMooreBuildShift(p_sub, p_shift);
-
-	while (v >= 0 && i <= str_len - 1)
+	for (u32 i = 0; i < 2; i++)
 	{
-		v = sub_len - 1;
-		k = i;
-		while (p_str[k] == p_sub[v])
+		if (p_disk->Win[i].Lba != ATA_NO_LBA && lba - p_disk->Win[i].Lba < p_disk->Win[i].Count)
 		{
-			if (v == 0)
-			{
-				return k;
-			}
-			k--;
-			v--;
+			p_win = &p_disk->Win[i];
 		}
-		i += p_shift[p_str[i] - 32]; // 32 - 127 ASCII range
 	}
-
-	if (k >= str_len - sub_len)
+	if (p_win != NULL)
 	{
-		return -1;
+		if (AtaSettle(p_disk, p_win) != SUCCESS)
+		{
+			return NULL;
+		}
+		p_disk->Stats.WindowHits += 1;
+		p_disk->Stats.AheadUsed += p_win->IsAhead;
+		p_win->IsAhead = FALSE;
 	}
 	else
 	{
-		return k;
+		DiskIdle(p_disk);
+		p_win = &p_disk->Win[p_disk->Last ^ 1];
+		if (AtaFill(p_disk, p_win, lba, FALSE) != SUCCESS || AtaSettle(p_disk, p_win) != SUCCESS)
+		{
+			return NULL;
+		}
 	}
-}
+	p_disk->Last = (u32)(p_win - p_disk->Win);
+	end = p_win->Lba + p_win->Count;
+	*p_count = (*p_count < end - lba) ? *p_count : end - lba;
+	p_disk->NextLba = lba + *p_count;
 
-//
-// Program staff
-//
+	p_next = &p_disk->Win[p_disk->Last ^ 1];
+	if (is_seq && p_disk->UseDma && end < p_disk->Sectors && p_next->Lba != end && !p_next->IsPending)
+	{
+		AtaFill(p_disk, p_next, end, TRUE);
+	}
+	return p_win->Buf + (lba - p_win->Lba) * ATA_SECTOR_SZ;
+}
 
-void PrintFmt(const char *p_format, ...)
+// Multi-sector read into the caller's buffer, window by window
+errno_t DiskRead(AtaDisk *p_disk, u32 lba, u32 count, void *p_buf)
 {
-	size_t i;
-	char c;
-	register char **v asm("esi");
+	u8 *p_dst = (u8 *)p_buf;
+	const u8 *p_src;
+	u32 n;
 
-	asm("lea 12(%%ebp), %0" : "=r"(v));
-
-	for (size_t i = 0;; i++)
+	while (count != 0)
 	{
-		c = p_format[i];
-		if (c == '\0')
-		{
-			break;
-		}
-		if (c == '%')
-		{
-			TerminalPrint(*v);
-			v++;
-		}
-		else if (c == '$')
+		n = count;
+		p_src = DiskMap(p_disk, lba, &n);
+		if (p_src == NULL)
 		{
-			TerminalPrint(IntToStrA(*((size_t *)v)));
-			v++;
-		}
-		else if (c == '^')
-		{
-			TerminalPutChar(*((char *)v));
-			v++;
+			return FAIL;
 		}
-		else
+		g_prims.MemCopy(p_dst, p_src, n * ATA_SECTOR_SZ);
+		p_dst += n * ATA_SECTOR_SZ;
+		lba += n;
+		count -= n;
+	}
+	return SUCCESS;
+}
+
+// Drops what the windows hold, the next request reads from the drive
+void DiskFlush(AtaDisk *p_disk)
+{
+	DiskIdle(p_disk);
+	for (u32 i = 0; i < 2; i++)
+	{
+		p_disk->Win[i].Lba = ATA_NO_LBA;
+		p_disk->Win[i].IsAhead = FALSE;
+	}
+	p_disk->NextLba = 0;
+}
+
+// Block reader of the cache, bytes past the last sector read as zeros
+errno_t CacheDiskRead(void *p_ctx, u32 block, u8 *p_buf)
+{
+	AtaDisk *p_disk = (AtaDisk *)p_ctx;
+	u32 lba = block * CACHE_BLOCK_SECTORS;
+	u32 n = p_disk->Sectors - lba;
+
+	n = (n < CACHE_BLOCK_SECTORS) ? n : CACHE_BLOCK_SECTORS;
+	if (DiskRead(p_disk, lba, n, p_buf) != SUCCESS)
+	{
+		return FAIL;
+	}
+	ZeroMemory(p_buf + n * ATA_SECTOR_SZ, (CACHE_BLOCK_SECTORS - n) * ATA_SECTOR_SZ);
+	return SUCCESS;
+}
+
+static errno_t AtaIdentify(AtaDisk *p_disk)
+{
+	static u16 p_id[256];
+	u32 seen = g_ata_irq.Count;
+	u8 status;
+	u32 i;
+
+	outb(ATA_IO + ATA_REG_DRIVE, (char)0xA0);
+	AtaAltStatus();
+	outb(ATA_IO + ATA_REG_COUNT, 0);
+	outb(ATA_IO + ATA_REG_LBA0, 0);
+	outb(ATA_IO + ATA_REG_LBA1, 0);
+	outb(ATA_IO + ATA_REG_LBA2, 0);
+	outb(ATA_IO + ATA_REG_CMD, (char)ATA_CMD_IDENTIFY);
+	status = AtaAltStatus();
+	if (status == 0 || status == 0xFF || AtaWaitReady() != SUCCESS)
+	{
+		return FAIL;	// No drive, or one that never gets ready
+	}
+	if (inb(ATA_IO + ATA_REG_LBA1) != 0 || inb(ATA_IO + ATA_REG_LBA2) != 0)
+	{
+		return FAIL;	// ATAPI or SATA signature
+	}
+	for (i = 0; i < ATA_POLL_MAX && !(AtaAltStatus() & (ATA_SR_DRQ | ATA_SR_ERR)); i++)
+	{
+		continue;
+	}
+	if (!(AtaAltStatus() & ATA_SR_DRQ))
+	{
+		return FAIL;
+	}
+	insw(ATA_IO + ATA_REG_DATA, p_id, 256);
+	if (g_ata_irq.Count == seen)
+	{
+		inb(ATA_IO + ATA_REG_CMD);	// Polled, drop the interrupt it raised
+	}
+
+	// Model bytes come swapped in every word
+	for (i = 0; i < 20; i++)
+	{
+		p_disk->Model[i * 2] = (char)(p_id[27 + i] >> 8);
+		p_disk->Model[i * 2 + 1] = (char)p_id[27 + i];
+	}
+	for (i = 40; i > 0 && p_disk->Model[i - 1] == ' '; i--)
+	{
+		continue;
+	}
+	p_disk->Model[i] = '\0';
+	p_disk->IsLba48 = (p_id[83] & 0x400) != 0;
+	p_disk->Sectors = (u32)p_id[60] | ((u32)p_id[61] << 16);
+	if (p_disk->IsLba48 && p_id[102] == 0 && p_id[103] == 0)
+	{
+		p_disk->Sectors = (u32)p_id[100] | ((u32)p_id[101] << 16);
+	}
+	p_disk->UseDma = (p_id[49] & 0x100) != 0;
+	return (p_disk->Sectors != 0) ? SUCCESS : FAIL;
+}
+
+// Bus master ports of the first IDE controller on bus 0, bus mastering enabled
+static u16 AtaFindBusMaster()
+{
+	u32 id;
+	u32 bar;
+
+	for (u32 dev = 0; dev < PCI_DEVICES; dev++)
+	{
+		id = PciRead(dev, 0x00);
+		if ((id & 0xFFFF) == 0xFFFF || (PciRead(dev, 0x08) >> 16) != PCI_CLASS_IDE)
+		{
+			continue;
+		}
+		bar = PciRead(dev, 0x20);
+		if (!(bar & 0x01) || !(PciRead(dev, 0x08) & 0x8000))
+		{
+			return 0;	// No I/O space bus master
+		}
+		PciWrite(dev, 0x04, PciRead(dev, 0x04) | 0x05);
+		return (u16)(bar & 0xFFFC);
+	}
+	return 0;
+}
+
+inline u64 ReadTsc()
+{
+	u64 tsc;
+	asm volatile ("rdtsc" : "=A" (tsc));
+	return tsc;
+}
+
+void TraceRecord(const char *p_name, u32 payload, u8 kind)
+{
+	TraceEvent *p_ev;
+
+	if (!g_trace.IsOn)
+	{
+		return;
+	}
+	p_ev = &g_trace.Events[g_trace.Head & (TRACE_RING_SZ - 1)];
+	p_ev->Stamp = ReadTsc();
+	p_ev->Name = p_name;
+	p_ev->Payload = payload;
+	p_ev->Kind = kind;
+	g_trace.Head += 1;
+}
+
+u32 TraceFirst()
+{
+	return (g_trace.Head > TRACE_RING_SZ) ? g_trace.Head - TRACE_RING_SZ : 0;
+}
+
+boolean TraceMatch(const char *p_name, const char *p_filter)
+{
+	if (p_filter == NULL)
+	{
+		return TRUE;
+	}
+	return StrnCmpA((char *)p_name, (char *)p_filter, StrLenA(p_filter)) == 0;
+}
+
+inline u32 GetOsMode()
+{
+	return *(OSMODE);
+}
+
+void InitTerminal()
+{
+	static Cursor cur = {0};
+	static Screen scr;
+	static Console con;
+	ScreenInit(&scr);
+	ConsoleInit(&con);
+	TerminalScreen(&scr);
+	TerminalConsole(&con);
+	TerminalCursor(&cur);
+}
+
+void InitIntr()
+{
+	int i;
+	int idt_count = sizeof(g_idt) / sizeof(g_idt[0]);
+	for (i = 0; i < idt_count; i++)
+		IntrRegHandler(i, GDT_CS, 0x80 | IDT_TYPE_INTR, DefaultIntrHandler);
+}
+
+void InitCpu()
+{
+	u32 level = StrPrimsDetect();
+	u32 cr;
+
+	if (level == STR_PRIMS_SSE2)
+	{
+		// xmm registers are usable once CR0.EM is clear, CR0.MP set and
+		// CR4.OSFXSR/OSXMMEXCPT on. Interrupt handlers never touch them.
+		asm volatile ("movl %%cr0, %0" : "=r" (cr));
+		cr = (cr & ~(u32)0x04) | 0x02;
+		asm volatile ("movl %0, %%cr0" : : "r" (cr));
+		asm volatile ("movl %%cr4, %0" : "=r" (cr));
+		cr |= 0x600;
+		asm volatile ("movl %0, %%cr4" : : "r" (cr));
+		asm volatile ("fninit");
+	}
+	StrPrimsSelect(level);
+}
+
+void InitMatcher()
+{
+	// An unknown boot mode leaves the default engine in place
+	MatcherSelect(GetOsMode());
+}
+
+void InitTimer()
+{
+	u32 divisor = PIT_FREQ / TIMER_HZ;
+	IntrRegHandler(0x08, GDT_CS, 0x80 | IDT_TYPE_INTR, TimerHandler);
+	outb(PIT_CMD_PORT, 0x36); // Channel 0, lo/hi byte, square wave
+	outb(PIT_PORT, (char)(divisor & 0xFF));
+	outb(PIT_PORT, (char)((divisor >> 8) & 0xFF));
+	outb(PIC1_PORT + 1, inb(PIC1_PORT + 1) & (0xFF ^ 0x01));
+}
+
+void InitTrace()
+{
+	g_trace.Head = 0;
+	g_trace.IsOn = KTRACE;
+}
+
+void InitKeyboard()
+{
+	IntrRegHandler(0x09, GDT_CS, 0x80 | IDT_TYPE_INTR, KeyboardHandler);
+	outb(PIC1_PORT + 1, 0xFF ^ 0x02);
+}
+
+void InitHeap()
+{
+	static Heap heap;
+	HeapInit(&heap, KHEAP_BASE, KHEAP_SIZE);
+	KernelHeap(&heap);
+}
+
+void InitRamDisk()
+{
+	static RamDisk disk;
+	const BootInfo *p_boot = BOOT_INFO;
+
+	disk.Data = (const char *)p_boot->DiskBase;
+	disk.Size = p_boot->DiskSize;
+	KernelRamDisk(&disk);
+}
+
+// Interrupts must be on already, the identify and every read wait for them
+void InitAta()
+{
+	static AtaDisk disk;
+	AtaDisk *p_disk = &disk;
+
+	p_disk->Win[0].Lba = ATA_NO_LBA;
+	p_disk->Win[1].Lba = ATA_NO_LBA;
+	KernelAta(p_disk);
+	IntrRegHandler(PIC2_VECTOR + ATA_IRQ - 8, GDT_CS, 0x80 | IDT_TYPE_INTR, AtaHandler);
+	outb(ATA_CTL, 0);	// nIEN clear, the drive raises its interrupt
+	outb(PIC2_PORT + 1, inb(PIC2_PORT + 1) & (0xFF ^ (1 << (ATA_IRQ - 8))));
+	outb(PIC1_PORT + 1, inb(PIC1_PORT + 1) & (0xFF ^ 0x04));	// Cascade
+	if (AtaIdentify(p_disk) != SUCCESS)
+	{
+		return;
+	}
+	p_disk->Win[0].Buf = (u8 *)KernelAlloc(ATA_WINDOW_SECTORS * ATA_SECTOR_SZ);
+	p_disk->Win[1].Buf = (u8 *)KernelAlloc(ATA_WINDOW_SECTORS * ATA_SECTOR_SZ);
+	p_disk->Prd = (AtaPrd *)KernelAlloc(sizeof(AtaPrd) * ATA_PRD_MAX);
+	if (p_disk->Win[0].Buf == NULL || p_disk->Win[1].Buf == NULL || p_disk->Prd == NULL)
+	{
+		return;
+	}
+	g_ata_irq.Bm = AtaFindBusMaster();
+	p_disk->UseDma = p_disk->UseDma && g_ata_irq.Bm != 0;
+	p_disk->IsPresent = TRUE;
+}
+
+void InitCache()
+{
+	static BlockCache bc;
+	AtaDisk *p_disk = KernelAta(NULL);
+
+	CacheInit(&bc, KernelHeap(NULL), CacheDiskRead, p_disk, (p_disk->Sectors + CACHE_BLOCK_SECTORS - 1) / CACHE_BLOCK_SECTORS);
+	KernelCache(&bc);
+	if (p_disk->IsPresent)
+	{
+		CacheSetBudget(&bc, CACHE_BUDGET_DEFAULT);
+	}
+}
+
+void InitShare()
+{
+	static KerShare ks;
+	static NameEntry p_slots[KSHARE_SLOTS_MIN];
+	NameTableInit(&ks.Names, p_slots, KSHARE_SLOTS_MIN);
+	ks.Grows = 0;
+	KernelShare(&ks);
+}
+
+void InitProgBox()
+{
+	static ProgramBox prog_box;
+	NameTableInit(&prog_box.Extra, prog_box.Slots, PROGRAM_EXTRA_SLOTS);
+	ProgBox(&prog_box);
+}
+
+void InitTemplates()
+{
+	static TemplateBox box;
+	box.Count = 0;
+	TemplateSets(&box);
+}
+
+Heap *KernelHeap(Heap *p_heap)
+{
+	static Heap *p = NULL;
+	if (p_heap != NULL)
+	{
+		p = p_heap;
+	}
+	return p;
+}
+
+void *KernelAlloc(size_t size)
+{
+	return HeapAlloc(KernelHeap(NULL), size);
+}
+
+void KernelFree(void *p_ptr)
+{
+	HeapFree(KernelHeap(NULL), p_ptr);
+}
+
+RamDisk *KernelRamDisk(RamDisk *p_disk)
+{
+	static RamDisk *p = NULL;
+	if (p_disk != NULL)
+	{
+		p = p_disk;
+	}
+	return p;
+}
+
+AtaDisk *KernelAta(AtaDisk *p_disk)
+{
+	static AtaDisk *p = NULL;
+	if (p_disk != NULL)
+	{
+		p = p_disk;
+	}
+	return p;
+}
+
+BlockCache *KernelCache(BlockCache *p_bc)
+{
+	static BlockCache *p = NULL;
+	if (p_bc != NULL)
+	{
+		p = p_bc;
+	}
+	return p;
+}
+
+KerShare *KernelShare(KerShare *p_ks)
+{
+	static KerShare *p = NULL;
+	if (p_ks != NULL)
+	{
+		p = p_ks;
+	}
+	return p;
+}
+
+u8 *KernelNewShare(const char *p_name, size_t blockSz)
+{
+	KerShare *p_ks = KernelShare(NULL);
+	NameTable *p_tab = &p_ks->Names;
+	NameEntry *p_slots;
+	NameEntry *p_ent;
+	u8 *p_ret;
+
+	if (NameTableIsFull(p_tab))
+	{
+		p_slots = (NameEntry *)KernelAlloc((p_tab->Mask + 1) * 2 * sizeof(NameEntry));
+		if (p_slots == NULL)
+		{
+			return NULL;
+		}
+		p_slots = NameTableRehash(p_tab, p_slots, (p_tab->Mask + 1) * 2);
+		// The first slots are static
+		if (p_ks->Grows != 0)
+		{
+			KernelFree(p_slots);
+		}
+		p_ks->Grows += 1;
+	}
+	p_ret = (u8 *)KernelAlloc(blockSz);
+	if (p_ret == NULL)
+	{
+		return NULL;
+	}
+	p_ent = NameTableInsert(p_tab, p_name);
+	if (p_ent == NULL)
+	{
+		KernelFree(p_ret);
+		return NULL;
+	}
+	p_ent->Ptr = p_ret;
+	p_ent->Size = blockSz;
+	return p_ret;
+}
+
+u8 *KernelGetShare(const char *p_name, size_t *p_size)
+{
+	NameEntry *p_ent = NameTableFind(&KernelShare(NULL)->Names, p_name);
+
+	if (p_ent == NULL)
+	{
+		return NULL;
+	}
+	*p_size = p_ent->Size;
+	return (u8 *)p_ent->Ptr;
+}
+
+void KernelFreeShare(const char *p_name)
+{
+	KerShare *p_ks = KernelShare(NULL);
+	NameEntry *p_ent = NameTableFind(&p_ks->Names, p_name);
+
+	if (p_ent != NULL)
+	{
+		KernelFree(p_ent->Ptr);
+		NameTableRemove(&p_ks->Names, p_name);
+	}
+}
+
+errno_t ProgStart(const char *p_progName, MsgProg *p_arg, int *p_result)
+{
+	errno_t err = FAIL;
+	ProgMain main;
+	u32 prog_id;
+
+	if (ProgExists(p_progName, &main, &prog_id))
+	{
+		TRACE_BEGIN("prog.start", prog_id);
+		*p_result = main(p_arg);
+		TRACE_END("prog.start", *p_result);
+		err = SUCCESS;
+	}
+	else
+	{
+		TerminalPrint("Program ");
+		TerminalPrint(p_progName);
+		TerminalPrint(" doesn't exists\n");
+		TerminalFlush();
+	}
+
+	return err;
+}
+
+// Built-ins take one hash and one compare; the id of a runtime-added
+// program is PROGRAM_BUILTIN_COUNT plus its slot in the fallback table
+boolean ProgExists(const char *p_progName, ProgMain *p_main, u32 *p_progId)
+{
+	ProgramBox *p_prog_box = ProgBox(NULL);
+	u32 slot = ProgHash(p_progName, g_prog_hash.Seed);
+	u8 n = g_prog_hash.Slots[slot];
+	NameEntry *p_ent;
+
+	if (n != PROGRAM_HASH_EMPTY && StrCmpA((char *)g_builtins[n].Name, (char *)p_progName) == 0)
+	{
+		*p_main = g_builtins[n].Main;
+		*p_progId = n;
+		return TRUE;
+	}
+	p_ent = NameTableFind(&p_prog_box->Extra, p_progName);
+	if (p_ent != NULL)
+	{
+		*p_main = (ProgMain)p_ent->Ptr;
+		*p_progId = PROGRAM_BUILTIN_COUNT + (u32)(p_ent - p_prog_box->Extra.Slots);
+		return TRUE;
+	}
+	return FALSE;
+}
+
+// Built-in names cannot be shadowed
+errno_t ProgAdd(const char *p_name, ProgMain main)
+{
+	ProgramBox *p_prog_box = ProgBox(NULL);
+	NameEntry *p_ent;
+	ProgMain unused_main;
+	u32 unused_id;
+
+	if (p_name == NULL || main == NULL || ProgExists(p_name, &unused_main, &unused_id))
+	{
+		return FAIL;
+	}
+	p_ent = NameTableInsert(&p_prog_box->Extra, p_name);
+	if (p_ent == NULL)
+	{
+		return FAIL;
+	}
+	p_ent->Ptr = (void *)main;
+	return SUCCESS;
+}
+
+ProgramBox *ProgBox(ProgramBox *p_progBox)
+{
+	static ProgramBox *p = NULL;
+	if (p_progBox != NULL)
+	{
+		p = p_progBox;
+	}
+	return p;
+}
+
+TemplateBox *TemplateSets(TemplateBox *p_box)
+{
+	static TemplateBox *p = NULL;
+	if (p_box != NULL)
+	{
+		p = p_box;
+	}
+	return p;
+}
+
+AhoCorasick *TemplateSetGet(const char *p_name, boolean isNew)
+{
+	TemplateBox *p_box = TemplateSets(NULL);
+	AhoCorasick *p_ac;
+
+	for (u16 i = 0; i < p_box->Count; i++)
+	{
+		if (StrCmpA(p_box->Sets[i]->Name, (char *)p_name) == 0)
+		{
+			return p_box->Sets[i];
+		}
+	}
+	if (!isNew || p_box->Count >= TEMPLATE_SET_MAX)
+	{
+		return NULL;
+	}
+	p_ac = (AhoCorasick *)KernelAlloc(sizeof(AhoCorasick));
+	if (p_ac == NULL)
+	{
+		return NULL;
+	}
+	p_box->Sets[p_box->Count] = p_ac;
+	AhoCorasickInit(p_ac, p_name);
+	p_box->Count += 1;
+	return p_ac;
+}
+
+//
+// Pipes
+//
+
+// Output of the running program: the pipe to the next stage, NULL for the terminal
+Pipe *ProgStdout()
+{
+	return (g_pipeline.Count != 0) ? g_pipeline.Msgs[g_pipeline.Current].Out : NULL;
+}
+
+void ProgWrite(const char *p_data, size_t dataSz)
+{
+	Pipe *p_out = ProgStdout();
+
+	if (p_out != NULL)
+	{
+		PipeWrite(p_out, p_data, dataSz);
+	}
+	else
+	{
+		TerminalWrite(p_data, dataSz);
+	}
+}
+
+errno_t PipeInit(Pipe *p_pipe)
+{
+	p_pipe->Buf = (char *)KernelAlloc(PIPE_SZ);
+	p_pipe->Head = 0;
+	p_pipe->Tail = 0;
+	p_pipe->Hold = 0;
+	p_pipe->IsClosed = FALSE;
+	p_pipe->IsBroken = FALSE;
+	return (p_pipe->Buf != NULL) ? SUCCESS : FAIL;
+}
+
+// Yields while the ring is full. Once the consumer has exited the bytes
+// have nowhere to go and are dropped.
+void PipeWrite(Pipe *p_pipe, const char *p_data, size_t dataSz)
+{
+	u32 at;
+	u32 n;
+
+	while (dataSz != 0 && !p_pipe->IsBroken)
+	{
+		n = PIPE_SZ - (p_pipe->Head - p_pipe->Tail);
+		if (n == 0)
+		{
+			TaskYield();
+			continue;
+		}
+		at = p_pipe->Head & (PIPE_SZ - 1);
+		n = (n < PIPE_SZ - at) ? n : PIPE_SZ - at;
+		n = (n < dataSz) ? n : (u32)dataSz;
+		CopyMemory(p_pipe->Buf + at, (void *)p_data, n);
+		p_pipe->Head += n;
+		p_data += n;
+		dataSz -= n;
+	}
+}
+
+// Longest unread run that lies in one piece in the ring. The bytes stay
+// owned by the consumer until PipeSkip(). Yields while the pipe is empty,
+// 0 means the producer has exited.
+size_t PipePeek(Pipe *p_pipe, const char **pp_data)
+{
+	u32 at;
+	u32 n;
+
+	p_pipe->Tail += p_pipe->Hold;
+	p_pipe->Hold = 0;
+	while ((n = p_pipe->Head - p_pipe->Tail) == 0 && !p_pipe->IsClosed)
+	{
+		TaskYield();
+	}
+	at = p_pipe->Tail & (PIPE_SZ - 1);
+	*pp_data = p_pipe->Buf + at;
+	return (n < PIPE_SZ - at) ? n : PIPE_SZ - at;
+}
+
+void PipeSkip(Pipe *p_pipe, size_t count)
+{
+	p_pipe->Tail += (u32)count;
+}
+
+// Next line without its newline, NUL-terminated and valid until the next
+// read from the pipe. A line in one piece is terminated in place over its
+// newline; one that wraps the ring, is the unterminated end of the input
+// or is cut at PIPE_LINE_MAX is copied to Spill.
+boolean PipeReadLine(Pipe *p_pipe, StrSlice *p_line)
+{
+	boolean has_nl = FALSE;
+	u32 avail;
+	u32 len = 0;
+	u32 at;
+
+	p_pipe->Tail += p_pipe->Hold;
+	p_pipe->Hold = 0;
+	while (TRUE)
+	{
+		avail = p_pipe->Head - p_pipe->Tail;
+		for (; len < avail && len < PIPE_LINE_MAX; len++)
+		{
+			if (p_pipe->Buf[(p_pipe->Tail + len) & (PIPE_SZ - 1)] == '\n')
+			{
+				has_nl = TRUE;
+				break;
+			}
+		}
+		if (has_nl || len == PIPE_LINE_MAX || p_pipe->IsClosed)
+		{
+			break;
+		}
+		TaskYield();
+	}
+	if (len == 0 && !has_nl)
+	{
+		return FALSE;
+	}
+
+	at = p_pipe->Tail & (PIPE_SZ - 1);
+	if (has_nl && at + len < PIPE_SZ)
+	{
+		p_pipe->Buf[at + len] = '\0';
+		p_line->Ptr = p_pipe->Buf + at;
+	}
+	else
+	{
+		for (u32 i = 0; i < len; i++)
+		{
+			p_pipe->Spill[i] = p_pipe->Buf[(p_pipe->Tail + i) & (PIPE_SZ - 1)];
+		}
+		p_pipe->Spill[len] = '\0';
+		p_line->Ptr = p_pipe->Spill;
+	}
+	p_line->Len = len;
+	p_pipe->Hold = len + has_nl;
+	return TRUE;
+}
+
+// Saves the callee-saved registers of the running side on its own stack,
+// stores its stack pointer to *p_saveEsp and resumes the side at loadEsp
+extern "C" __attribute__((naked)) void TaskSwitch(u32 *p_saveEsp, u32 loadEsp)
+{
+	asm(
+		"movl 4(%esp), %eax\n"
+		"movl 8(%esp), %edx\n"
+		"pushl %ebp\n"
+		"pushl %ebx\n"
+		"pushl %esi\n"
+		"pushl %edi\n"
+		"movl %esp, (%eax)\n"
+		"movl %edx, %esp\n"
+		"popl %edi\n"
+		"popl %esi\n"
+		"popl %ebx\n"
+		"popl %ebp\n"
+		"ret\n"
+	);
+}
+
+// First code of every stage, entered from the frame TaskInit() builds
+static void TaskStart()
+{
+	Pipeline *p_run = &g_pipeline;
+	MsgProg *p_msg = &p_run->Msgs[p_run->Current];
+	Task *p_task = &p_run->Tasks[p_run->Current];
+
+	ProgStart(p_msg->Args[0], p_msg, &p_task->Result);
+	if (p_msg->Out != NULL)
+	{
+		p_msg->Out->IsClosed = TRUE;
+	}
+	if (p_msg->In != NULL)
+	{
+		p_msg->In->IsBroken = TRUE;
+	}
+	p_task->IsDone = TRUE;
+	TaskSwitch(&p_task->Esp, p_run->ShellEsp);
+}
+
+// The stack starts as if TaskSwitch() had parked the task: four zeroed
+// registers and TaskStart as the return address, aligned like a call
+errno_t TaskInit(Task *p_task)
+{
+	u32 *p_top;
+
+	p_task->Stack = (u8 *)KernelAlloc(TASK_STACK_SZ);
+	if (p_task->Stack == NULL)
+	{
+		return FAIL;
+	}
+	p_top = (u32 *)(p_task->Stack + TASK_STACK_SZ);
+	p_top[-1] = 0;							// Return address of TaskStart, never used
+	p_top[-2] = (u32)TaskStart;
+	ZeroMemory(p_top - 6, 4 * sizeof(u32));	// ebp, ebx, esi, edi
+	p_task->Esp = (u32)(p_top - 6);
+	p_task->Result = 0;
+	p_task->IsDone = FALSE;
+	return SUCCESS;
+}
+
+// Called by a stage that waits on a pipe, the terminal resumes it later
+void TaskYield()
+{
+	Pipeline *p_run = &g_pipeline;
+	TaskSwitch(&p_run->Tasks[p_run->Current].Esp, p_run->ShellEsp);
+}
+
+// Every stage runs as a task on its own stack. A task comes back here when
+// it waits on a pipe or exits, and the live ones are resumed in order. A
+// producer only waits on a full pipe and a consumer on an empty one, so
+// some stage can always go on.
+void PipelineRun(MsgProg *p_msgs, u32 count)
+{
+	Pipeline *p_run = &g_pipeline;
+	errno_t err = SUCCESS;
+	ProgMain unused_main;
+	u32 unused_id;
+	u32 live;
+	u32 i;
+
+	for (i = 0; i < count; i++)
+	{
+		if (!ProgExists(p_msgs[i].Args[0], &unused_main, &unused_id))
+		{
+			PrintFmt("Program %s doesn't exists\n", p_msgs[i].Args[0]);
+			return;
+		}
+	}
+
+	ZeroMemory(p_run, sizeof(Pipeline));
+	for (i = 0; i < count && err == SUCCESS; i++)
+	{
+		err = TaskInit(&p_run->Tasks[i]);
+		if (err == SUCCESS && i + 1 < count)
+		{
+			err = PipeInit(&p_run->Pipes[i]);
+		}
+		p_msgs[i].In = (i > 0) ? &p_run->Pipes[i - 1] : NULL;
+		p_msgs[i].Out = (i + 1 < count) ? &p_run->Pipes[i] : NULL;
+	}
+	if (err != SUCCESS)
+	{
+		PrintFmt("Out of memory for the pipeline\n");
+	}
+	else
+	{
+		TRACE_BEGIN("pipe.run", count);
+		p_run->Msgs = p_msgs;
+		p_run->Count = count;
+		for (live = count; live != 0; )
+		{
+			live = 0;
+			for (i = 0; i < count; i++)
+			{
+				if (!p_run->Tasks[i].IsDone)
+				{
+					p_run->Current = i;
+					TaskSwitch(&p_run->ShellEsp, p_run->Tasks[i].Esp);
+					live += !p_run->Tasks[i].IsDone;
+				}
+			}
+		}
+		p_run->Count = 0;
+		TRACE_END("pipe.run", p_run->Tasks[count - 1].Result);
+		TerminalFlush();
+	}
+
+	for (i = 0; i < count; i++)
+	{
+		KernelFree(p_run->Tasks[i].Stack);
+		KernelFree((i + 1 < count) ? p_run->Pipes[i].Buf : NULL);
+	}
+}
+
+//
+// Program staff
+//
+
+void WriterInit(Writer *p_wr)
+{
+	p_wr->Len = 0;
+	p_wr->Out = ProgStdout();
+}
+
+static void WriterEmit(Writer *p_wr)
+{
+	if (p_wr->Out != NULL)
+	{
+		PipeWrite(p_wr->Out, p_wr->Buf, p_wr->Len);
+	}
+	else
+	{
+		TerminalWrite(p_wr->Buf, p_wr->Len);
+	}
+	p_wr->Len = 0;
+}
+
+void WriterPutChar(Writer *p_wr, const char c)
+{
+	if (p_wr->Len == WRITER_BUF_SZ)
+	{
+		WriterEmit(p_wr);
+	}
+	p_wr->Buf[p_wr->Len++] = c;
+	if (c == '\n')
+	{
+		WriterEmit(p_wr);
+	}
+}
+
+void WriterWrite(Writer *p_wr, const char *p_data, size_t dataSz)
+{
+	for (size_t i = 0; i < dataSz; i++)
+	{
+		WriterPutChar(p_wr, p_data[i]);
+	}
+}
+
+void WriterPuts(Writer *p_wr, const char *p_str)
+{
+	for (; *p_str; p_str++)
+	{
+		WriterPutChar(p_wr, *p_str);
+	}
+}
+
+void WriterPad(Writer *p_wr, const char c, size_t count)
+{
+	for (; count; count--)
+	{
+		WriterPutChar(p_wr, c);
+	}
+}
+
+// Supports %[-][0][width]{s,c,d,i,u,x,X,p,%}
+void WriterFmt(Writer *p_wr, const char *p_format, va_list args)
+{
+	char p_num[WRITER_NUM_SZ];
+	char *p_end = p_num + sizeof(p_num) - 1;
+	const char *p_str;
+	char *p_hex;
+	size_t width;
+	size_t len;
+	boolean is_left;
+	boolean is_zero;
+	boolean is_neg;
+	char c;
+	u32 num;
+
+	*p_end = '\0';
+	for (; *p_format; p_format++)
+	{
+		c = *p_format;
+		if (c != '%')
+		{
+			WriterPutChar(p_wr, c);
+			continue;
+		}
+
+		is_left = FALSE;
+		is_zero = FALSE;
+		is_neg = FALSE;
+		width = 0;
+
+		c = *++p_format;
+		for (; c == '-' || c == '0'; c = *++p_format)
+		{
+			if (c == '-')
+			{
+				is_left = TRUE;
+			}
+			else
+			{
+				is_zero = TRUE;
+			}
+		}
+		for (; c >= '0' && c <= '9'; c = *++p_format)
+		{
+			width = width * 10 + (c - '0');
+		}
+
+		p_str = p_num;
+		switch (c)
+		{
+		case 's':
+			p_str = va_arg(args, const char *);
+			if (p_str == NULL)
+			{
+				p_str = "(null)";
+			}
+			is_zero = FALSE;
+			break;
+		case 'c':
+			p_num[0] = (char)va_arg(args, int);
+			p_num[1] = '\0';
+			is_zero = FALSE;
+			break;
+		case 'd':
+		case 'i':
+			num = (u32)va_arg(args, i32);
+			if ((i32)num < 0)
+			{
+				is_neg = TRUE;
+				num = -num;
+			}
+			p_str = FmtDecA(p_end, num);
+			break;
+		case 'u':
+			p_str = FmtDecA(p_end, va_arg(args, u32));
+			break;
+		case 'x':
+		case 'X':
+			p_str = FmtHexA(p_end, va_arg(args, u32));
+			for (char *p = (char *)p_str; c == 'X' && *p; p++)
+			{
+				*p = ToUpper(*p);
+			}
+			break;
+		case 'p':
+			// 0x and all 8 digits, so a pointer never reads as a plain number
+			p_hex = FmtHexA(p_end, (u32)(size_t)va_arg(args, void *));
+			while (p_end - p_hex < 8)
+			{
+				*--p_hex = '0';
+			}
+			p_hex -= 2;
+			p_hex[0] = '0';
+			p_hex[1] = 'x';
+			p_str = p_hex;
+			is_zero = FALSE;
+			break;
+		case '%':
+			WriterPutChar(p_wr, '%');
+			continue;
+		case '\0':
+			return;
+		default:
+			WriterPutChar(p_wr, '%');
+			WriterPutChar(p_wr, c);
+			continue;
+		}
+
+		len = StrLenA(p_str) + (is_neg ? 1 : 0);
+		width = (width > len) ? width - len : 0;
+		if (is_zero && !is_left)
+		{
+			if (is_neg)
+			{
+				WriterPutChar(p_wr, '-');
+			}
+			WriterPad(p_wr, '0', width);
+		}
+		else
+		{
+			if (!is_left)
+			{
+				WriterPad(p_wr, ' ', width);
+			}
+			if (is_neg)
+			{
+				WriterPutChar(p_wr, '-');
+			}
+		}
+		WriterPuts(p_wr, p_str);
+		if (is_left)
+		{
+			WriterPad(p_wr, ' ', width);
+		}
+	}
+}
+
+void WriterPrint(Writer *p_wr, const char *p_format, ...)
+{
+	va_list args;
+	va_start(args, p_format);
+	WriterFmt(p_wr, p_format, args);
+	va_end(args);
+}
+
+void WriterFlush(Writer *p_wr)
+{
+	if (p_wr->Len != 0)
+	{
+		WriterEmit(p_wr);
+	}
+	if (p_wr->Out == NULL)
+	{
+		TerminalFlush();
+	}
+}
+
+void PrintFmt(const char *p_format, ...)
+{
+	Writer wr;
+	va_list args;
+
+	WriterInit(&wr);
+	va_start(args, p_format);
+	WriterFmt(&wr, p_format, args);
+	va_end(args);
+	WriterFlush(&wr);
+}
+
+void PrintSpan(const char *p_data, size_t dataSz)
+{
+	ProgWrite(p_data, dataSz);
+	if (ProgStdout() == NULL)
+	{
+		TerminalFlush();
+	}
+}
+
+//
+// Programs
+//
+
+static int StringOs_Help(MsgProg *p_msg)
+{
+	NameTable *p_extra = &ProgBox(NULL)->Extra;
+	NameEntry *p_ent;
+	u32 iter = 0;
+	u32 i;
+	Writer wr;
+
+	WriterInit(&wr);
+	WriterPuts(&wr, "Available commands:\n");
+	for (i = 0; i < PROGRAM_BUILTIN_COUNT; i++)
+	{
+		WriterPrint(&wr, "%u: %s\n", i, g_builtins[i].Name);
+	}
+	while ((p_ent = NameTableNext(p_extra, &iter)) != NULL)
+	{
+		WriterPrint(&wr, "%u: %s\n", i++, p_ent->Name);
+	}
+	WriterFlush(&wr);
+
+	return 0;
+}
+
+static int StringOs_Info(MsgProg *p_msg)
+{
+	const BootInfo *p_boot = BOOT_INFO;
+
+	PrintFmt(
+		"Author: Kuchiev.\n"
+		"OS: Linux\n"
+		"Translator: GNU assembler, AT&T\n"
+		"Compiler: GCC\n"
+		"Task: StringOS\n"
+		"Mode: %s\n"
+		"String primitives: %s\n"
+		"Boot: %u KB read in %u ms, %u %s reads, %u retries\n"
+		"Kernel image: %u KB%s\n"
+		"RAM disk: %u KB at 0x%x\n",
+		MatcherName(g_match_mode),
+		g_prims.Name,
+		p_boot->Sectors / 2, MulDivU32(p_boot->Ticks, 10000, BOOT_TICKS_10S),
+		p_boot->Reads, (p_boot->Method == BOOT_METHOD_LBA) ? "LBA" : "track", p_boot->Retries,
+		p_boot->ImageSize >> 10, p_boot->IsPacked ? ", unpacked by the loader" : "",
+		p_boot->DiskSize >> 10, p_boot->DiskBase
+	);
+	return 0;
+}
+
+// upcase, downcase and titlize without words convert stdin, run by run
+// straight out of the ring. A NULL p_conv capitalizes the words.
+static int CaseStream(Pipe *p_in, char (*p_conv)(const char))
+{
+	const char *p_data;
+	size_t len;
+	char prev = ' ';
+	Writer wr;
+
+	WriterInit(&wr);
+	while ((len = PipePeek(p_in, &p_data)) != 0)
+	{
+		for (size_t i = 0; i < len; i++)
+		{
+			if (p_conv != NULL)
+			{
+				WriterPutChar(&wr, p_conv(p_data[i]));
+			}
+			else
+			{
+				WriterPutChar(&wr, (prev == ' ' || prev == '\t' || prev == '\n') ? ToUpper(p_data[i]) : p_data[i]);
+			}
+			prev = p_data[i];
+		}
+		PipeSkip(p_in, len);
+	}
+	WriterFlush(&wr);
+	return 0;
+}
+
+static int StringOs_Upcase(MsgProg *p_msg)
+{
+	Writer wr;
+
+	if (p_msg->Count < 2 && p_msg->In != NULL)
+	{
+		return CaseStream(p_msg->In, ToUpper);
+	}
+	if (p_msg->Count < 2)
+	{
+		PrintFmt("Usage %s <word> [word] [word..\n", p_msg->Args[0]);
+		return 1;
+	}
+	WriterInit(&wr);
+	for (u16 i = 1; i < p_msg->Count; i++)
+	{
+		for (const char *p = p_msg->Args[i]; *p; p++)
+		{
+			WriterPutChar(&wr, ToUpper(*p));
+		}
+		WriterPutChar(&wr, ' ');
+	}
+	WriterPutChar(&wr, '\n');
+	WriterFlush(&wr);
+	return 0;
+}
+
+static int StringOs_Downcase(MsgProg *p_msg)
+{
+	Writer wr;
+
+	if (p_msg->Count < 2 && p_msg->In != NULL)
+	{
+		return CaseStream(p_msg->In, ToLower);
+	}
+	if (p_msg->Count < 2)
+	{
+		PrintFmt("Usage %s <word> [word] [word..\n", p_msg->Args[0]);
+		return 1;
+	}
+	WriterInit(&wr);
+	for (u16 i = 1; i < p_msg->Count; i++)
+	{
+		for (const char *p = p_msg->Args[i]; *p; p++)
+		{
+			WriterPutChar(&wr, ToLower(*p));
+		}
+		WriterPutChar(&wr, ' ');
+	}
+	WriterPutChar(&wr, '\n');
+	WriterFlush(&wr);
+	return 0;
+}
+
+static int StringOs_Titlize(MsgProg *p_msg)
+{
+	Writer wr;
+
+	if (p_msg->Count < 2 && p_msg->In != NULL)
+	{
+		return CaseStream(p_msg->In, NULL);
+	}
+	if (p_msg->Count < 2)
+	{
+		PrintFmt("Usage %s <word> [word] [word..\n", p_msg->Args[0]);
+		return 1;
+	}
+	WriterInit(&wr);
+	for (u16 i = 1; i < p_msg->Count; i++)
+	{
+		WriterPutChar(&wr, ToUpper(p_msg->Args[i][0]));
+		WriterPuts(&wr, p_msg->Args[i] + 1);
+		WriterPutChar(&wr, ' ');
+	}
+	WriterPutChar(&wr, '\n');
+	WriterFlush(&wr);
+	return 0;
+}
+
+static int TemplateSetAdd(MsgProg *p_msg)
+{
+	AhoCorasick *p_ac = TemplateSetGet(p_msg->Args[2], TRUE);
+
+	if (p_ac == NULL)
+	{
+		PrintFmt("No room for set '%s', %u sets max\n", p_msg->Args[2], TEMPLATE_SET_MAX);
+		return 2;
+	}
+	if (AhoCorasickAdd(p_ac, p_msg->Args[3]) != SUCCESS)
+	{
+		PrintFmt("Set '%s' is full\n", p_ac->Name);
+		return 2;
+	}
+	PrintFmt("Set '%s': %u words\n", p_ac->Name, p_ac->WordCount);
+	return 0;
+}
+
+static int TemplateSetList(MsgProg *p_msg)
+{
+	TemplateBox *p_box = TemplateSets(NULL);
+	AhoCorasick *p_ac;
+	Writer wr;
+
+	WriterInit(&wr);
+	if (p_msg->Count < 3)
+	{
+		for (u16 i = 0; i < p_box->Count; i++)
+		{
+			p_ac = p_box->Sets[i];
+			WriterPrint(&wr, "%-16s %u words, %u nodes%s\n", p_ac->Name, p_ac->WordCount,
+				p_ac->NodeCount, p_ac->IsDirty ? " (not compiled)" : "");
+		}
+	}
+	else if ((p_ac = TemplateSetGet(p_msg->Args[2], FALSE)) != NULL)
+	{
+		for (u16 i = 0; i < p_ac->WordCount; i++)
+		{
+			WriterPrint(&wr, "%u: ", i);
+			WriterWrite(&wr, p_ac->Text + p_ac->WordOff[i], p_ac->WordLen[i]);
+			WriterPutChar(&wr, '\n');
+		}
+	}
+	else
+	{
+		WriterPrint(&wr, "No set '%s'\n", p_msg->Args[2]);
+	}
+	WriterFlush(&wr);
+	return 0;
+}
+
+static int StringOs_Template(MsgProg *p_msg)
+{	
+	if (p_msg->Count >= 4 && StrCmpA(p_msg->Args[1], (char *)"add") == 0)
+	{
+		return TemplateSetAdd(p_msg);
+	}
+	if (p_msg->Count >= 2 && StrCmpA(p_msg->Args[1], (char *)"sets") == 0)
+	{
+		return TemplateSetList(p_msg);
+	}
+	if (p_msg->Count < 2)
+	{
+		PrintFmt("Usage %s <substring> | add <set> <word> | sets [set]\n", p_msg->Args[0]);
+		return 1;
+	}
+
+	Template *p_tpl;
+	MatchPattern *p_pat;
+	size_t unused;
+	Writer wr;
+
+	p_tpl = (Template *)KernelGetShare("temp", &unused);
+	if (p_tpl == NULL)
+	{
+		p_tpl = (Template *)KernelNewShare("temp", sizeof(Template));
+		if (p_tpl == NULL)
+		{
+			PrintFmt("Out of memory\n");
+			return 2;
+		}
+	}
+
+	StrCpyA(p_tpl->Text, BUFSIZE, p_msg->Args[1]);
+	p_pat = &p_tpl->Pat;
+	PatternCompile(p_pat, p_tpl->Text, g_match_mode);
+
+	WriterInit(&wr);
+	WriterPrint(&wr, "Template '%s' loaded. Engine %s", p_tpl->Text, MatcherName(p_pat->Mode));
+	if (p_pat->Mode == MATCHER_TWOWAY)
+	{
+		WriterPrint(&wr, ", critical pos %d, period %d", p_pat->Ell + 1, p_pat->Per);
+	}
+	else if (p_pat->Mode != MATCHER_STD)
+	{
+		WriterPuts(&wr, ", shifts:\n");
+		for (size_t i = 0; i < p_pat->Len; i++)
+		{
+			WriterPrint(&wr, "%c:%d ", p_tpl->Text[i], p_pat->Shift[(u8)p_tpl->Text[i]]);
+		}
+	}
+	WriterPutChar(&wr, '\n');
+	WriterFlush(&wr);
+	return 0;
+}
+
+// search over stdin prints every line with a match as "line:pos: text"
+static int SearchStream(Pipe *p_in, const Template *p_tpl)
+{
+	StrSlice line;
+	const char *p_res;
+	u32 line_no = 0;
+	u32 hits = 0;
+	Writer wr;
+
+	WriterInit(&wr);
+	TRACE_BEGIN("str.lines", p_tpl->Pat.Mode);
+	while (PipeReadLine(p_in, &line))
+	{
+		line_no++;
+		p_res = PatternFind(&p_tpl->Pat, line.Ptr);
+		if (p_res != NULL)
+		{
+			WriterPrint(&wr, "%u:%u: ", line_no, (size_t)(p_res - line.Ptr));
+			WriterWrite(&wr, line.Ptr, line.Len);
+			WriterPutChar(&wr, '\n');
+			hits++;
+		}
+	}
+	TRACE_END("str.lines", hits);
+	WriterFlush(&wr);
+	return 0;
+}
+
+static int StringOs_Search(MsgProg *p_msg)
+{
+	if (p_msg->Count < 2 && p_msg->In == NULL)
+	{
+		PrintFmt("Usage %s <substring>\n", p_msg->Args[0]);
+		return 1;
+	}
+
+	Template *p_tpl;
+	size_t temp_sz;
+	const char *p_res;
+
+	p_tpl = (Template *)KernelGetShare("temp", &temp_sz);
+	if (p_tpl == NULL)
+	{
+		PrintFmt("No template loaded. Use <template> command to add template.\n");
+		return 2;
+	}
+
+	// The tables stay valid until the template or the engine changes
+	if (p_tpl->Pat.Asked != g_match_mode)
+	{
+		PatternCompile(&p_tpl->Pat, p_tpl->Text, g_match_mode);
+	}
+	if (p_msg->Count < 2)
+	{
+		return SearchStream(p_msg->In, p_tpl);
+	}
+	TRACE_BEGIN("str.strstr", p_tpl->Pat.Mode);
+	p_res = PatternFind(&p_tpl->Pat, p_msg->Args[1]);
+	TRACE_END("str.strstr", (p_res != NULL) ? p_res - p_msg->Args[1] : -1);
+	if (p_res)
+	{
+		PrintFmt("Found '%s' at pos: %u\n", p_tpl->Text, (size_t)(p_res - p_msg->Args[1]));
+	}
+	else
+	{
+		PrintFmt("Not found '%s'\n", p_tpl->Text);
+	}
+
+	return 0;
+}
+
+typedef struct _MSearchCtx
+{
+	Writer *Wr;
+	const AhoCorasick *Set;
+	u32 Line;					// Line of stdin being scanned, 0 for an argument
+} MSearchCtx;
+
+static void MSearchHit(void *p_ctx, size_t pos, u16 word)
+{
+	MSearchCtx *p_ms = (MSearchCtx *)p_ctx;
+	if (p_ms->Line != 0)
+	{
+		WriterPrint(p_ms->Wr, "%u:", p_ms->Line);
+	}
+	WriterPrint(p_ms->Wr, "%u: ", pos);
+	WriterWrite(p_ms->Wr, p_ms->Set->Text + p_ms->Set->WordOff[word], p_ms->Set->WordLen[word]);
+	WriterPutChar(p_ms->Wr, '\n');
+}
+
+static int StringOs_MSearch(MsgProg *p_msg)
+{
+	AhoCorasick *p_ac;
+	MSearchCtx ctx;
+	StrSlice line;
+	size_t hits = 0;
+	Writer wr;
+
+	if (p_msg->Count < ((p_msg->In != NULL) ? 2 : 3))
+	{
+		PrintFmt("Usage %s <set> <text>\n", p_msg->Args[0]);
+		return 1;
+	}
+	p_ac = TemplateSetGet(p_msg->Args[1], FALSE);
+	if (p_ac == NULL)
+	{
+		PrintFmt("No set '%s'. Use <template add> to create it.\n", p_msg->Args[1]);
+		return 2;
+	}
+	if (p_ac->IsDirty)
+	{
+		TRACE_BEGIN("ac.compile", p_ac->WordCount);
+		if (AhoCorasickCompile(p_ac) != SUCCESS)
+		{
+			PrintFmt("Set '%s' has too many nodes\n", p_ac->Name);
+			return 2;
+		}
+		TRACE_END("ac.compile", p_ac->NodeCount);
+	}
+
+	WriterInit(&wr);
+	ctx.Wr = &wr;
+	ctx.Set = p_ac;
+	ctx.Line = 0;
+	TRACE_BEGIN("ac.scan", p_ac->WordCount);
+	if (p_msg->Count >= 3)
+	{
+		hits = AhoCorasickScan(p_ac, p_msg->Args[2], MSearchHit, &ctx);
+	}
+	else
+	{
+		while (PipeReadLine(p_msg->In, &line))
+		{
+			ctx.Line++;
+			hits += AhoCorasickScan(p_ac, line.Ptr, MSearchHit, &ctx);
+		}
+	}
+	TRACE_END("ac.scan", hits);
+	WriterPrint(&wr, "%u hits\n", hits);
+	WriterFlush(&wr);
+	return 0;
+}
+
+// Neighbouring end positions of one approximate match arrive as a run,
+// only its best end is printed
+typedef struct _FSearchCtx
+{
+	Writer *Wr;
+	u32 Line;					// Line of stdin being scanned, 0 for an argument
+	size_t Matches;
+	size_t Last;				// Last end position seen
+	size_t BestEnd;
+	u32 BestEdits;
+	boolean IsOpen;
+} FSearchCtx;
+
+static void FSearchFlush(FSearchCtx *p_fs)
+{
+	if (p_fs->IsOpen)
+	{
+		if (p_fs->Line != 0)
+		{
+			WriterPrint(p_fs->Wr, "%u:", p_fs->Line);
+		}
+		WriterPrint(p_fs->Wr, "end %u: %u edits\n", p_fs->BestEnd, p_fs->BestEdits);
+		p_fs->Matches++;
+		p_fs->IsOpen = FALSE;
+	}
+}
+
+static void FSearchHit(void *p_ctx, size_t end, u32 edits)
+{
+	FSearchCtx *p_fs = (FSearchCtx *)p_ctx;
+
+	if (p_fs->IsOpen && end == p_fs->Last + 1)
+	{
+		if (edits < p_fs->BestEdits)
+		{
+			p_fs->BestEnd = end;
+			p_fs->BestEdits = edits;
+		}
+	}
+	else
+	{
+		FSearchFlush(p_fs);
+		p_fs->BestEnd = end;
+		p_fs->BestEdits = edits;
+		p_fs->IsOpen = TRUE;
+	}
+	p_fs->Last = end;
+}
+
+// The pattern is a heap block, two fsearch stages of one pipeline must
+// not share it
+static int StringOs_FSearch(MsgProg *p_msg)
+{
+	BitapPattern *p_bp;
+	Template *p_tpl;
+	FSearchCtx ctx;
+	StrSlice line;
+	size_t temp_sz;
+	size_t k;
+	Writer wr;
+
+	if (p_msg->Count < ((p_msg->In != NULL) ? 2 : 3) || StrToUIntA(p_msg->Args[1], &k) != SUCCESS || k > BITAP_K_MAX)
+	{
+		PrintFmt("Usage %s <edits 0..%u> <text>\n", p_msg->Args[0], BITAP_K_MAX);
+		return 1;
+	}
+	p_tpl = (Template *)KernelGetShare("temp", &temp_sz);
+	if (p_tpl == NULL)
+	{
+		PrintFmt("No template loaded. Use <template> command to add template.\n");
+		return 2;
+	}
+	p_bp = (BitapPattern *)KernelAlloc(sizeof(BitapPattern));
+	if (p_bp == NULL)
+	{
+		PrintFmt("Out of memory\n");
+		return 2;
+	}
+	if (k >= p_tpl->Pat.Len || BitapCompile(p_bp, p_tpl->Text) != SUCCESS)
+	{
+		PrintFmt("Template '%s' is too short for %u edits\n", p_tpl->Text, k);
+		KernelFree(p_bp);
+		return 2;
+	}
+
+	WriterInit(&wr);
+	ctx.Wr = &wr;
+	ctx.Line = 0;
+	ctx.Matches = 0;
+	ctx.IsOpen = FALSE;
+	TRACE_BEGIN("bitap.scan", k);
+	if (p_msg->Count >= 3)
+	{
+		BitapScan(p_bp, p_msg->Args[2], (u32)k, FSearchHit, &ctx);
+		FSearchFlush(&ctx);
+	}
+	else
+	{
+		while (PipeReadLine(p_msg->In, &line))
+		{
+			ctx.Line++;
+			BitapScan(p_bp, line.Ptr, (u32)k, FSearchHit, &ctx);
+			FSearchFlush(&ctx);
+		}
+	}
+	TRACE_END("bitap.scan", ctx.Matches);
+	WriterPrint(&wr, "%u matches of '%s'\n", ctx.Matches, p_tpl->Text);
+	WriterFlush(&wr);
+	KernelFree(p_bp);
+	return 0;
+}
+
+// One span of a device in memory, hits are printed as device offsets
+typedef struct _ScanCtx
+{
+	Writer *Wr;
+	const char *Data;
+	size_t Size;
+	size_t Base;		// Device offset of Data
+} ScanCtx;
+
+// "offset: text" with the text from the hit to the end of its line
+static void ScanHit(void *p_ctx, size_t pos)
+{
+	ScanCtx *p_sc = (ScanCtx *)p_ctx;
+	const char *p_text = p_sc->Data + pos;
+	const char *p_nl;
+	size_t len = p_sc->Size - pos;
+
+	len = (len < SCAN_CONTEXT) ? len : SCAN_CONTEXT;
+	p_nl = (const char *)g_prims.MemChr(p_text, '\n', len);
+	if (p_nl != NULL)
+	{
+		len = (size_t)(p_nl - p_text);
+	}
+	WriterPrint(p_sc->Wr, "%u: ", p_sc->Base + pos);
+	WriterWrite(p_sc->Wr, p_text, len);
+	WriterPutChar(p_sc->Wr, '\n');
+}
+
+// Hits in one span, the engine reads it in place chunk by chunk
+static u32 ScanSpan(ScanCtx *p_sc, const MatchPattern *p_pat, const char *p_data, size_t size, size_t base)
+{
+	MatchStream ms;
+
+	p_sc->Data = p_data;
+	p_sc->Size = size;
+	p_sc->Base = base;
+	MatchStreamInit(&ms, p_pat, p_data, size, ScanHit, p_sc);
+	while (MatchStreamNext(&ms))
+	{
+		continue;
+	}
+	return ms.Hits;
+}
+
+// The substring in argument arg, or else the loaded template
+static const MatchPattern *ScanPattern(MsgProg *p_msg, u16 arg, MatchPattern **pp_own)
+{
+	Template *p_tpl;
+	size_t temp_sz;
+
+	*pp_own = NULL;
+	if (p_msg->Count > arg)
+	{
+		*pp_own = (MatchPattern *)KernelAlloc(sizeof(MatchPattern));
+		if (*pp_own == NULL)
 		{
-			TerminalPutChar(c);
+			PrintFmt("Out of memory\n");
+			return NULL;
 		}
-		TerminalFlush();
+		PatternCompile(*pp_own, p_msg->Args[arg], g_match_mode);
+		return *pp_own;
+	}
+	p_tpl = (Template *)KernelGetShare("temp", &temp_sz);
+	if (p_tpl == NULL)
+	{
+		PrintFmt("Give a substring or load a template first\n");
+		return NULL;
+	}
+	if (p_tpl->Pat.Asked != g_match_mode)
+	{
+		PatternCompile(&p_tpl->Pat, p_tpl->Text, g_match_mode);
 	}
+	return &p_tpl->Pat;
 }
 
-//
-// Programs
-//
-
-static int StringOs_Help(MsgProg *p_msg)
+// Every hit on the RAM disk
+static int StringOs_Scan(MsgProg *p_msg)
 {
-	ProgramBox *p_pb = ProgBox(NULL);
-	SingleProg *p_sp = p_pb->Program;
-	u16 count = p_pb->Count;
-
-	PrintFmt("Available commands:\n");
-	for (u16 i = 0; i < count; i++)
+	const RamDisk *p_disk = KernelRamDisk(NULL);
+	MatchPattern *p_own;
+	const MatchPattern *p_pat;
+	ScanCtx ctx;
+	u32 hits;
+	u32 ticks;
+	Writer wr;
+
+	if (p_disk->Size == 0)
+	{
+		PrintFmt("No RAM disk. Build the disk image with host/mkdisk.\n");
+		return 2;
+	}
+	p_pat = ScanPattern(p_msg, 1, &p_own);
+	if (p_pat == NULL)
 	{
-		PrintFmt("$: %\n", i, p_sp[i].Name);
+		return 1;
 	}
 
+	WriterInit(&wr);
+	ctx.Wr = &wr;
+	ticks = TimerTicks();
+	hits = ScanSpan(&ctx, p_pat, p_disk->Data, p_disk->Size, 0);
+	ticks = TimerTicks() - ticks;
+	WriterPrint(&wr, "%u hits of '%s' in %u KB, %u chunks, %u ms, engine %s\n",
+		hits, p_pat->Sub, p_disk->Size >> 10, (p_disk->Size + MATCH_CHUNK_SZ - 1) / MATCH_CHUNK_SZ,
+		ticks * (1000 / TIMER_HZ), MatcherName(p_pat->Mode));
+	WriterFlush(&wr);
+	KernelFree(p_own);
 	return 0;
 }
 
-static int StringOs_Info(MsgProg *p_msg)
+// Sequential read of the first sectors, through the read-ahead windows
+static int DiskBench(AtaDisk *p_disk, MsgProg *p_msg)
 {
-	PrintFmt(
-		"Author: Kuchiev.\n"
-		"OS: Linux\n"
-		"Translator: GNU assembler, AT&T\n"
-		"Compiler: GCC\n"
-		"Task: StringOS\n"
-		"Mode: %\n",
-		(GetOsMode() == OSMODE_STD) ? "Standard" : "Boyer-Moore"
-	);
+	size_t total = p_disk->Sectors;
+	u32 commands = p_disk->Stats.Commands;
+	u32 waited = p_disk->Stats.WaitTicks;
+	u32 lba = 0;
+	u32 ticks;
+	u32 n;
+
+	if (p_msg->Count >= 3 && (StrToUIntA(p_msg->Args[2], &total) != SUCCESS || total == 0))
+	{
+		PrintFmt("Usage %s read [sectors]\n", p_msg->Args[0]);
+		return 1;
+	}
+	total = (total < p_disk->Sectors) ? total : p_disk->Sectors;
+	DiskFlush(p_disk);
+	ticks = TimerTicks();
+	for (; lba < total; lba += n)
+	{
+		n = (u32)total - lba;
+		if (DiskMap(p_disk, lba, &n) == NULL)
+		{
+			PrintFmt("Read error at sector %u\n", lba);
+			return 2;
+		}
+	}
+	ticks = TimerTicks() - ticks;
+	PrintFmt("%u KB in %u ms, %u KB/s, %u commands, %u ms waiting\n",
+		lba / 2, ticks * (1000 / TIMER_HZ), (ticks != 0) ? MulDivU32(lba / 2, TIMER_HZ, ticks) : 0,
+		p_disk->Stats.Commands - commands, (p_disk->Stats.WaitTicks - waited) * (1000 / TIMER_HZ));
 	return 0;
 }
 
-static int StringOs_Upcase(MsgProg *p_msg)
+// Bytes from pos on, in place: a pinned cache block, or straight from a
+// read-ahead window past the blocks the cache keeps. *pp_ent is the block
+// to put back, NULL for a window.
+static const char *ScanFetch(BlockCache *p_bc, boolean isDirect, size_t pos, size_t *p_len, CacheEntry **pp_ent)
 {
-	if (p_msg->Count < 2)
+	u32 n = ATA_WINDOW_SECTORS;
+	const u8 *p_data;
+
+	*pp_ent = NULL;
+	if (isDirect)
+	{
+		p_data = DiskMap(KernelAta(NULL), (u32)(pos / ATA_SECTOR_SZ), &n);
+		*p_len = n * ATA_SECTOR_SZ - pos % ATA_SECTOR_SZ;
+		return (p_data != NULL) ? (const char *)p_data + pos % ATA_SECTOR_SZ : NULL;
+	}
+	*pp_ent = CacheGet(p_bc, (u32)(pos / CACHE_BLOCK_SZ));
+	*p_len = CACHE_BLOCK_SZ - pos % CACHE_BLOCK_SZ;
+	return (*pp_ent != NULL) ? (const char *)(*pp_ent)->Data + pos % CACHE_BLOCK_SZ : NULL;
+}
+
+// Scans the disk in place. The first blocks, as many as the cache holds,
+// come through it and stay for the next scan; the rest of a larger disk is
+// read from the windows directly, see CacheScanEnd(). Only the Len - 1
+// bytes on each side of a block edge are copied, to find the matches
+// across it.
+static int DiskScan(BlockCache *p_bc, MsgProg *p_msg)
+{
+	AtaDisk *p_disk = KernelAta(NULL);
+	char p_seam[2 * BUFSIZE];
+	const MatchPattern *p_pat;
+	MatchPattern *p_own;
+	CacheEntry *p_ent;
+	const char *p_data;
+	ScanCtx ctx;
+	size_t keep;
+	size_t start = 0;
+	size_t end;
+	size_t pos;
+	size_t len;
+	size_t tail = 0;
+	size_t head;
+	size_t cached;
+	u32 cached_end;
+	u32 waited = p_disk->Stats.WaitTicks;
+	u32 sectors = p_disk->Stats.Sectors;
+	u32 hits = 0;
+	u32 ticks;
+	Writer wr;
+
+	p_pat = ScanPattern(p_msg, 2, &p_own);
+	if (p_pat == NULL)
 	{
-		PrintFmt("Usage % <word> [word] [word..\n", p_msg->Args[0]);
 		return 1;
 	}
-	for (u16 i = 1; i < p_msg->Count; i++)
+	keep = (p_pat->Len != 0) ? p_pat->Len - 1 : 0;
+
+	// A host/mkdisk image says how many bytes follow its header sector
+	end = (p_disk->Sectors < 0x800000) ? p_disk->Sectors * ATA_SECTOR_SZ : 0xFFFFFE00;
+	p_data = ScanFetch(p_bc, p_bc->Count == 0, 0, &len, &p_ent);
+	if (p_data != NULL && *(const u32 *)p_data == DISK_IMAGE_MAGIC)
+	{
+		start = ATA_SECTOR_SZ;
+		len = ((const u32 *)p_data)[1];
+		end = (len < end - start) ? start + len : end;
+	}
+	if (p_ent != NULL)
+	{
+		CachePut(p_bc, p_ent);
+	}
+	cached_end = CacheScanEnd(p_bc, (u32)(start / CACHE_BLOCK_SZ));
+	cached = end - start;
+	if (cached_end <= (end - 1) / CACHE_BLOCK_SZ)
 	{
-		for (size_t v = 0; v < StrLenA(p_msg->Args[i]); v++)
+		cached = (cached_end != start / CACHE_BLOCK_SZ) ? (size_t)cached_end * CACHE_BLOCK_SZ - start : 0;
+	}
+
+	WriterInit(&wr);
+	ctx.Wr = &wr;
+	ticks = TimerTicks();
+	for (pos = start; pos < end; pos += len)
+	{
+		p_data = ScanFetch(p_bc, pos / CACHE_BLOCK_SZ >= cached_end, pos, &len, &p_ent);
+		if (p_data == NULL)
+		{
+			WriterPrint(&wr, "Read error at sector %u\n", pos / ATA_SECTOR_SZ);
+			break;
+		}
+		len = (len < end - pos) ? len : end - pos;
+		if (tail != 0)
+		{
+			head = (keep < len) ? keep : len;
+			g_prims.MemCopy(p_seam + tail, p_data, head);
+			hits += ScanSpan(&ctx, p_pat, p_seam, tail + head, pos - start - tail);
+		}
+		hits += ScanSpan(&ctx, p_pat, p_data, len, pos - start);
+		tail = (keep < len) ? keep : len;
+		g_prims.MemCopy(p_seam, p_data + len - tail, tail);
+		if (p_ent != NULL)
 		{
-			PrintFmt("^", ToUpper(p_msg->Args[i][v]));
+			CachePut(p_bc, p_ent);
 		}
-		PrintFmt(" ");
 	}
-	PrintFmt("\n");
+	ticks = TimerTicks() - ticks;
+	WriterPrint(&wr, "%u hits of '%s' in %u KB, %u ms, engine %s\n"
+		"%u KB read from the disk, %u ms waiting for it, the first %u KB go through the cache\n",
+		hits, p_pat->Sub, (pos - start) >> 10, ticks * (1000 / TIMER_HZ), MatcherName(p_pat->Mode),
+		(p_disk->Stats.Sectors - sectors) / 2, (p_disk->Stats.WaitTicks - waited) * (1000 / TIMER_HZ), cached >> 10);
+	WriterFlush(&wr);
+	KernelFree(p_own);
 	return 0;
 }
 
-static int StringOs_Downcase(MsgProg *p_msg)
+static int StringOs_Disk(MsgProg *p_msg)
 {
-	if (p_msg->Count < 2)
+	AtaDisk *p_disk = KernelAta(NULL);
+	AtaStats *p_st = &p_disk->Stats;
+	const char *p_cmd = (p_msg->Count >= 2) ? p_msg->Args[1] : "";
+	u32 kb;
+
+	if (!p_disk->IsPresent)
 	{
-		PrintFmt("Usage % <word> [word] [word..\n", p_msg->Args[0]);
-		return 1;
+		PrintFmt("No ATA disk on the primary channel\n");
+		return 2;
 	}
-	for (u16 i = 1; i < p_msg->Count; i++)
+	if (StrCmpA((char *)p_cmd, (char *)"read") == 0)
+	{
+		return DiskBench(p_disk, p_msg);
+	}
+	if (StrCmpA((char *)p_cmd, (char *)"scan") == 0)
 	{
-		for (size_t v = 0; v < StrLenA(p_msg->Args[i]); v++)
+		return DiskScan(KernelCache(NULL), p_msg);
+	}
+	if (StrCmpA((char *)p_cmd, (char *)"pio") == 0 || StrCmpA((char *)p_cmd, (char *)"dma") == 0)
+	{
+		if (p_cmd[0] == 'd' && g_ata_irq.Bm == 0)
 		{
-			PrintFmt("^", ToLower(p_msg->Args[i][v]));
+			PrintFmt("No bus master, PIO only\n");
+			return 2;
 		}
-		PrintFmt(" ");
+		DiskFlush(p_disk);
+		CacheFlush(KernelCache(NULL));
+		p_disk->UseDma = (p_cmd[0] == 'd');
+	}
+	else if (StrCmpA((char *)p_cmd, (char *)"reset") == 0)
+	{
+		ZeroMemory(p_st, sizeof(AtaStats));
+	}
+	else if (p_cmd[0] != '\0')
+	{
+		PrintFmt("Usage %s [read [sectors] | scan [substring] | pio | dma | reset]\n", p_msg->Args[0]);
+		return 1;
 	}
-	PrintFmt("\n");
+
+	kb = p_st->Sectors / 2;
+	PrintFmt(
+		"Disk: %s, %u MB, %u sectors, %s, %s\n"
+		"Read: %u commands, %u KB, %u window hits, %u read ahead, %u of them used, %u errors\n"
+		"Waited %u ms for the drive, %u KB/s while waiting\n",
+		p_disk->Model, p_disk->Sectors >> 11, p_disk->Sectors, p_disk->IsLba48 ? "LBA48" : "LBA28",
+		p_disk->UseDma ? "bus master DMA" : "PIO",
+		p_st->Commands, kb, p_st->WindowHits, p_st->ReadAheads, p_st->AheadUsed, p_st->Errors,
+		p_st->WaitTicks * (1000 / TIMER_HZ), (p_st->WaitTicks != 0) ? MulDivU32(kb, TIMER_HZ, p_st->WaitTicks) : 0
+	);
 	return 0;
 }
 
-static int StringOs_Titlize(MsgProg *p_msg)
+// Counters of the block cache, or a new memory budget for it
+static int StringOs_Cache(MsgProg *p_msg)
 {
-	if (p_msg->Count < 2)
+	BlockCache *p_bc = KernelCache(NULL);
+	CacheStats *p_st = &p_bc->Stats;
+	const char *p_cmd = (p_msg->Count >= 2) ? p_msg->Args[1] : "";
+	size_t kb;
+	u32 asked;
+
+	if (!KernelAta(NULL)->IsPresent)
+	{
+		PrintFmt("No ATA disk on the primary channel\n");
+		return 2;
+	}
+	if (StrCmpA((char *)p_cmd, (char *)"size") == 0)
+	{
+		if (p_msg->Count != 3 || StrToUIntA(p_msg->Args[2], &kb) != SUCCESS)
+		{
+			PrintFmt("Usage %s size <KB>\n", p_msg->Args[0]);
+			return 1;
+		}
+		if (kb > (KHEAP_SIZE >> 10))
+		{
+			PrintFmt("The heap has %u KB\n", KHEAP_SIZE >> 10);
+			return 1;
+		}
+		if (CacheSetBudget(p_bc, kb << 10) != SUCCESS)
+		{
+			PrintFmt("Blocks are pinned, the budget stays %u KB\n", p_bc->Budget >> 10);
+			return 2;
+		}
+		if (p_bc->Budget < ((kb << 10) & ~(CACHE_BLOCK_SZ - 1)))
+		{
+			PrintFmt("Got %u of %u KB, a quarter of the heap stays free\n", p_bc->Budget >> 10, kb);
+		}
+	}
+	else if (StrCmpA((char *)p_cmd, (char *)"flush") == 0)
+	{
+		CacheFlush(p_bc);
+	}
+	else if (StrCmpA((char *)p_cmd, (char *)"reset") == 0)
+	{
+		ZeroMemory(p_st, sizeof(CacheStats));
+	}
+	else if (p_cmd[0] != '\0')
 	{
-		PrintFmt("Usage % <word> [word] [word..\n", p_msg->Args[0]);
+		PrintFmt("Usage %s [size <KB> | flush | reset]\n", p_msg->Args[0]);
 		return 1;
 	}
-	for (u16 i = 1; i < p_msg->Count; i++)
+
+	asked = p_st->Hits + p_st->Misses;
+	PrintFmt(
+		"Cache: %u KB budget, %u blocks of %u KB, %u in use, %u pinned\n"
+		"%u hits, %u misses, %u%% hit rate, %u evictions, %u stalls, %u errors\n",
+		p_bc->Budget >> 10, p_bc->Count, CACHE_BLOCK_SZ >> 10, p_bc->Used, p_bc->Pinned,
+		p_st->Hits, p_st->Misses, (asked != 0) ? MulDivU32(p_st->Hits, 100, asked) : 0,
+		p_st->Evictions, p_st->Stalls, p_st->Errors
+	);
+	return 0;
+}
+
+static int StringOs_Screen(MsgProg *p_msg)
+{
+	Screen *p_scr = TerminalScreen(NULL);
+	ScreenStats st = p_scr->Stats;
+
+	if (p_msg->Count >= 2)
 	{
-		PrintFmt("^", ToUpper(p_msg->Args[i][0]));
-		for (size_t v = 1; v < StrLenA(p_msg->Args[i]); v++)
+		if (StrCmpA(p_msg->Args[1], (char *)"hw") == 0)
+		{
+			p_scr->IsHwScroll = TRUE;
+		}
+		else if (StrCmpA(p_msg->Args[1], (char *)"soft") == 0)
+		{
+			p_scr->IsHwScroll = FALSE;
+		}
+		else
 		{
-			PrintFmt("^", p_msg->Args[i][v]);
+			PrintFmt("Usage %s [hw|soft]\n", p_msg->Args[0]);
+			return 1;
 		}
-		PrintFmt(" ");
 	}
-	PrintFmt("\n");
+
+	PrintFmt(
+		"Flush requests: %u\n"
+		"Coalesced: %u\n"
+		"Repaints: %u\n"
+		"Cells written: %u\n"
+		"Cells last/max: %u/%u\n"
+		"Cells per repaint: %u\n"
+		"Scrolling: %s, origin line %u\n"
+		"Scrolls/wraps: %u/%u\n",
+		st.Requests, st.Coalesced, st.Flushes, st.CellsWritten,
+		st.LastCells, st.MaxCells,
+		(st.Flushes != 0) ? st.CellsWritten / st.Flushes : 0,
+		p_scr->IsHwScroll ? "hardware" : "redraw", p_scr->Origin,
+		st.Scrolls, st.Wraps
+	);
 	return 0;
 }
 
-static int StringOs_Template(MsgProg *p_msg)
-{	
-	if (p_msg->Count < 2)
+static int StringOs_More(MsgProg *p_msg)
+{
+	Console *p_con = TerminalConsole(NULL);
+
+	if (p_msg->Count >= 2)
 	{
-		PrintFmt("Usage % <substring>\n", p_msg->Args[0]);
-		return 1;
+		if (StrCmpA(p_msg->Args[1], (char *)"on") == 0)
+		{
+			p_con->IsPager = TRUE;
+		}
+		else if (StrCmpA(p_msg->Args[1], (char *)"off") == 0)
+		{
+			p_con->IsPager = FALSE;
+		}
+		else
+		{
+			PrintFmt("Usage %s [on|off]\n", p_msg->Args[0]);
+			return 1;
+		}
 	}
 
-	char *p_temp;
-	size_t unused;
-	size_t p_shift[sizeof(alphabet)];
+	PrintFmt("Pager: %s\n", p_con->IsPager ? "on" : "off");
+	PrintFmt("Scrollback: %u of %u lines (PgUp/PgDn)\n",
+		(size_t)(p_con->Last - p_con->First), CONSOLE_SCROLLBACK);
+	return 0;
+}
 
-	p_temp = (char *)KernelGetShare("temp", &unused);
-	if (p_temp == NULL)
+static void TraceDump(const char *p_filter)
+{
+	static const char *pp_kinds[] = { "point", "begin", "end" };
+	TraceEvent *p_ev;
+	u64 prev = 0;
+	u64 delta;
+	u32 shown = 0;
+	Writer wr;
+
+	WriterInit(&wr);
+	WriterPrint(&wr, "%-6s %-10s %-5s %-16s %s\n", "event", "+cycles", "kind", "probe", "payload");
+	for (u32 n = TraceFirst(); n < g_trace.Head; n++)
 	{
-		p_temp = (char *)KernelNewShare("temp", BUFSIZE);
-		if (p_temp == NULL)
+		p_ev = &g_trace.Events[n & (TRACE_RING_SZ - 1)];
+		if (!TraceMatch(p_ev->Name, p_filter))
 		{
-			PrintFmt("Out of memory\n");
-			return 2;
+			continue;
 		}
+		delta = (shown != 0) ? p_ev->Stamp - prev : 0;
+		prev = p_ev->Stamp;
+		WriterPrint(&wr, "%6u %10u %-5s %-16s %x\n", n, TRACE_CLAMP(delta),
+			pp_kinds[p_ev->Kind], p_ev->Name, p_ev->Payload);
+		shown += 1;
 	}
+	WriterPrint(&wr, "%u of %u events\n", shown, g_trace.Head - TraceFirst());
+	WriterFlush(&wr);
+}
+
+static void TraceStat(const char *p_filter)
+{
+	struct {
+		const char *Name;
+		u32 Points;
+		u32 Count;
+		u32 Min;
+		u32 Max;
+		u64 Sum;
+	} p_stat[TRACE_STAT_MAX];
+	struct {
+		const char *Name;
+		u64 Stamp;
+	} p_open[TRACE_STAT_MAX];
+	size_t stat_count = 0;
+	size_t open_count = 0;
+	TraceEvent *p_ev;
+	size_t s;
+	size_t i;
+	u64 sum;
+	u32 count;
+	u32 cycles;
+	Writer wr;
 
-	StrCpyA(p_temp, BUFSIZE, p_msg->Args[1]);
-	PrintFmt("Template '%' loaded. ", p_temp);
-	if (GetOsMode() == OSMODE_BM)
+	for (u32 n = TraceFirst(); n < g_trace.Head; n++)
 	{
-		PrintFmt("BM info:\n");
-		BoyerMooreBuildShift(p_temp, p_shift);
-		for (size_t i = 0; p_temp[i]; i++)
+		p_ev = &g_trace.Events[n & (TRACE_RING_SZ - 1)];
+		if (!TraceMatch(p_ev->Name, p_filter))
+		{
+			continue;
+		}
+
+		for (s = 0; s < stat_count && StrCmpA((char *)p_stat[s].Name, (char *)p_ev->Name) != 0; s++)
+		{
+			continue;
+		}
+		if (s == stat_count)
+		{
+			if (stat_count == TRACE_STAT_MAX)
+			{
+				continue;
+			}
+			ZeroMemory(&p_stat[s], sizeof(p_stat[s]));
+			p_stat[s].Name = p_ev->Name;
+			p_stat[s].Min = 0xFFFFFFFF;
+			stat_count += 1;
+		}
+
+		if (p_ev->Kind == TRACE_KIND_POINT)
+		{
+			p_stat[s].Points += 1;
+		}
+		else if (p_ev->Kind == TRACE_KIND_BEGIN)
+		{
+			// Nesting deeper than the table is dropped
+			if (open_count < TRACE_STAT_MAX)
+			{
+				p_open[open_count].Name = p_ev->Name;
+				p_open[open_count].Stamp = p_ev->Stamp;
+				open_count += 1;
+			}
+		}
+		else
 		{
-			PrintFmt("^:$ ", p_temp[i], p_shift[p_temp[i] - 32]);
+			// Pair with the innermost open begin of the same probe
+			for (i = open_count; i > 0 && StrCmpA((char *)p_open[i - 1].Name, (char *)p_ev->Name) != 0; i--)
+			{
+				continue;
+			}
+			if (i == 0)
+			{
+				continue;
+			}
+			open_count = i - 1;
+			cycles = TRACE_CLAMP(p_ev->Stamp - p_open[open_count].Stamp);
+			p_stat[s].Count += 1;
+			p_stat[s].Sum += cycles;
+			if (cycles < p_stat[s].Min)
+			{
+				p_stat[s].Min = cycles;
+			}
+			if (cycles > p_stat[s].Max)
+			{
+				p_stat[s].Max = cycles;
+			}
 		}
 	}
-	PrintFmt("\n");
-	return 0;
+
+	WriterInit(&wr);
+	WriterPrint(&wr, "%-16s %6s %6s %10s %10s %10s\n", "probe", "points", "pairs", "min", "avg", "max");
+	for (s = 0; s < stat_count; s++)
+	{
+		count = p_stat[s].Count;
+		sum = (count != 0) ? UDivMod64(p_stat[s].Sum, count, NULL) : 0;
+		WriterPrint(&wr, "%-16s %6u %6u %10u %10u %10u\n", p_stat[s].Name,
+			p_stat[s].Points, p_stat[s].Count,
+			(p_stat[s].Count != 0) ? p_stat[s].Min : 0,
+			TRACE_CLAMP(sum),
+			p_stat[s].Max);
+	}
+	WriterFlush(&wr);
 }
 
-static int StringOs_Search(MsgProg *p_msg)
+static int StringOs_Trace(MsgProg *p_msg)
 {
-	if (p_msg->Count < 2)
+	const char *p_cmd = (p_msg->Count >= 2) ? p_msg->Args[1] : "stat";
+	const char *p_filter = (p_msg->Count >= 3) ? p_msg->Args[2] : NULL;
+
+	if (!KTRACE)
+	{
+		PrintFmt("Tracing is disabled in this build (KTRACE=0)\n");
+		return 2;
+	}
+
+	if (StrCmpA((char *)p_cmd, (char *)"stat") == 0)
+	{
+		TraceStat(p_filter);
+	}
+	else if (StrCmpA((char *)p_cmd, (char *)"dump") == 0)
 	{
-		PrintFmt("Usage % <substring>\n", p_msg->Args[0]);
+		TraceDump(p_filter);
+	}
+	else if (StrCmpA((char *)p_cmd, (char *)"clear") == 0)
+	{
+		g_trace.Head = 0;
+	}
+	else if (StrCmpA((char *)p_cmd, (char *)"on") == 0 || StrCmpA((char *)p_cmd, (char *)"off") == 0)
+	{
+		g_trace.IsOn = (p_cmd[1] == 'n');
+		PrintFmt("Tracing %s\n", p_cmd);
+	}
+	else
+	{
+		PrintFmt("Usage %s [stat|dump|clear|on|off] [probe prefix]\n", p_msg->Args[0]);
 		return 1;
 	}
+	return 0;
+}
+
+// Probe distance is how far an entry sits from its home slot
+static void MemShares(Writer *p_wr)
+{
+	NameTable *p_tab = &KernelShare(NULL)->Names;
+	NameEntry *p_ent;
+	u32 iter = 0;
+
+	WriterPrint(p_wr, "%-32s %8s %5s\n", "share", "bytes", "probe");
+	while ((p_ent = NameTableNext(p_tab, &iter)) != NULL)
+	{
+		WriterPrint(p_wr, "%-32s %8u %5u\n", p_ent->Name, p_ent->Size,
+			(iter - 1 - p_ent->Hash) & p_tab->Mask);
+	}
+}
 
-	char *p_temp;
-	size_t temp_sz;
-	const char *p_res;
+// Slack is carved or cached slab memory no object uses. Fragmentation is
+// the share of free pages outside the largest free block.
+static int StringOs_Mem(MsgProg *p_msg)
+{
+	Heap *p_heap = KernelHeap(NULL);
+	KerShare *p_ks = KernelShare(NULL);
+	HeapClass *p_cls;
+	u32 largest = HeapLargestFree(p_heap);
+	u32 held;
+	u32 used;
+	Writer wr;
+
+	WriterInit(&wr);
+	if (p_msg->Count >= 2)
+	{
+		if (StrCmpA(p_msg->Args[1], (char *)"shares") != 0)
+		{
+			PrintFmt("Usage %s [shares]\n", p_msg->Args[0]);
+			return 1;
+		}
+		MemShares(&wr);
+		WriterFlush(&wr);
+		return 0;
+	}
+	WriterPrint(&wr, "Heap at %p: %u pages of %u bytes, %u free, largest free block %u\n",
+		p_heap->Base, p_heap->Pages, HEAP_PAGE_SZ, p_heap->FreePages, largest);
+	WriterPrint(&wr, "%-6s %6s %6s %6s %8s %5s %6s\n", "class", "pages", "inuse", "peak", "allocs", "fails", "slack%");
+	for (u32 c = 0; c < HEAP_CLASS_COUNT; c++)
+	{
+		p_cls = &p_heap->Classes[c];
+		held = p_cls->Pages * HEAP_PAGE_SZ;
+		used = p_cls->InUse << (c + HEAP_CLASS_MIN_SHIFT);
+		WriterPrint(&wr, "%-6u %6u %6u %6u %8u %5u %6u\n", (u32)1 << (c + HEAP_CLASS_MIN_SHIFT),
+			p_cls->Pages, p_cls->InUse, p_cls->Peak, p_cls->Allocs, p_cls->Fails,
+			(held != 0) ? MulDivU32(held - used, 100, held) : 0);
+	}
+	WriterPrint(&wr, "%-6s %6u %6s %6s %8u %5u\n", "large", p_heap->LargeInUse, "", "",
+		p_heap->LargeAllocs, p_heap->LargeFails);
+	WriterPrint(&wr, "Free blocks by order:");
+	for (u32 order = 0; order < HEAP_ORDER_COUNT; order++)
+	{
+		WriterPrint(&wr, " %u", p_heap->OrderFree[order]);
+	}
+	WriterPrint(&wr, "\nFragmentation: %u%%\n",
+		(p_heap->FreePages != 0) ? MulDivU32(p_heap->FreePages - largest, 100, p_heap->FreePages) : 0);
+	WriterPrint(&wr, "Shares: %u in %u slots, grown %u times\n",
+		p_ks->Names.Count, p_ks->Names.Mask + 1, p_ks->Grows);
+	WriterFlush(&wr);
+	return 0;
+}
+
+static u32 BenchCalibrate()
+{
+	u32 tick = TimerTicks();
+	u64 start;
 
-	p_temp = (char *)KernelGetShare("temp", &temp_sz);
-	if (p_temp == NULL)
+	while (TimerTicks() == tick)
 	{
-		PrintFmt("No template loaded. Use <template> command to add template.\n");
+		asm volatile ("hlt");
+	}
+	start = ReadTsc();
+	tick = TimerTicks();
+	while (TimerTicks() - tick < BENCH_CALIB_TICKS)
+	{
+		asm volatile ("hlt");
+	}
+	return MulDivU32(TRACE_CLAMP(ReadTsc() - start), TIMER_HZ, BENCH_CALIB_TICKS);
+}
+
+static int StringOs_Bench(MsgProg *p_msg)
+{
+	static const size_t p_lens[] = { 2, 4, 8, 16, 32 };
+	char *p_corpus;
+	char p_sub[BENCH_PATTERN_MAX + 1];
+	size_t size = BENCH_CORPUS_DEF;
+	size_t kind_from = 0;
+	size_t kind_to = CORPUS_KIND_COUNT;
+	MatchPattern pat;
+	const char *p;
+	const char *p_end;
+	u32 seed;
+	u32 hz;
+	u32 matches;
+	u32 cpb;
+	u32 shift;
+	u64 start;
+	u64 cycles;
+	Writer wr;
+
+	if (p_msg->Count >= 2 && StrCmpA(p_msg->Args[1], (char *)"all") != 0)
+	{
+		for (kind_from = 0; kind_from < CORPUS_KIND_COUNT; kind_from++)
+		{
+			if (StrCmpA(p_msg->Args[1], (char *)g_corpus_kinds[kind_from]) == 0)
+			{
+				break;
+			}
+		}
+		kind_to = kind_from + 1;
+	}
+	if (p_msg->Count >= 3 && StrToUIntA(p_msg->Args[2], &size) != SUCCESS)
+	{
+		kind_from = CORPUS_KIND_COUNT;
+	}
+	if (kind_from == CORPUS_KIND_COUNT || size < BENCH_PATTERN_MAX * 2 || size > BENCH_CORPUS_MAX)
+	{
+		PrintFmt("Usage %s [all|ascii|dna|words|periodic] [size %u..%u]\n",
+			p_msg->Args[0], BENCH_PATTERN_MAX * 2, BENCH_CORPUS_MAX);
+		return 1;
+	}
+
+	p_corpus = (char *)KernelAlloc(size + 1);
+	if (p_corpus == NULL)
+	{
+		PrintFmt("Out of memory for a %u byte corpus\n", size);
 		return 2;
 	}
 
-	p_res = StrStrA(p_msg->Args[1], p_temp);
-	if (p_res)
+	hz = BenchCalibrate();
+	PrintFmt("TSC: %u kHz, corpus %u bytes\n", hz / 1000, size);
+	PrintFmt("%-8s %3s %-8s %9s %8s %10s\n", "corpus", "m", "engine", "cyc/byte", "matches", "matches/s");
+
+	for (size_t kind = kind_from; kind < kind_to; kind++)
 	{
-		PrintFmt("Found '%' at pos: $\n", p_temp, (size_t)(p_res - p_msg->Args[1]));
+		seed = BENCH_SEED + kind;
+		CorpusFill(p_corpus, size, kind, &seed);
+		p_end = p_corpus + size;
+		for (size_t l = 0; l < sizeof(p_lens) / sizeof(p_lens[0]); l++)
+		{
+			CorpusPattern(p_sub, p_lens[l], p_corpus, size, kind, &seed);
+			WriterInit(&wr);
+			for (size_t m = 0; m < MATCHER_COUNT; m++)
+			{
+				matches = 0;
+				PatternCompile(&pat, p_sub, m);
+				start = ReadTsc();
+				for (p = PatternFindN(&pat, p_corpus, size); p != NULL; p = PatternFindN(&pat, p + 1, p_end - p - 1))
+				{
+					matches += 1;
+				}
+				cycles = ReadTsc() - start;
+				cpb = TRACE_CLAMP(UDivMod64(cycles * 10, size, NULL));
+				// A megabyte scan can take more than 2^32 cycles, scale both sides down
+				for (shift = 0; (cycles >> shift) > 0xFFFFFFFF; shift++)
+				{
+					continue;
+				}
+				WriterPrint(&wr, "%-8s %3u %-8s %7u.%u %8u %10u\n",
+					g_corpus_kinds[kind], p_lens[l], g_matchers[m].Name, cpb / 10, cpb % 10, matches,
+					(cycles != 0) ? TRACE_CLAMP(UDivMod64(((u64)matches * hz) >> shift, (u32)(cycles >> shift), NULL)) : 0);
+			}
+			WriterFlush(&wr);
+		}
 	}
-	else
+	KernelFree(p_corpus);
+	return 0;
+}
+
+static int StringOs_Mode(MsgProg *p_msg)
+{
+	u32 mode;
+	Writer wr;
+
+	if (p_msg->Count >= 2)
 	{
-		PrintFmt("Not found '%'\n", p_temp);
+		mode = MatcherLookup(p_msg->Args[1]);
+		if (mode == MATCHER_NONE)
+		{
+			WriterInit(&wr);
+			WriterPrint(&wr, "Usage %s [", p_msg->Args[0]);
+			for (mode = 0; mode < MATCHER_COUNT; mode++)
+			{
+				WriterPrint(&wr, "%s|", g_matchers[mode].Name);
+			}
+			WriterPuts(&wr, "auto]\n");
+			WriterFlush(&wr);
+			return 1;
+		}
+		MatcherSelect(mode);
 	}
 
+	PrintFmt("Search engine: %s\n", MatcherName(g_match_mode));
 	return 0;
 }
 
@@ -0,0 +1,1945 @@
+#include "strcore.h"
+
+const char alphabet[ALPHABET_SZ] = {
+	' ', '!', '"', '#', '$', '%', '&', '\'',
+	'(', ')', '*', '+', ',', '-', '.', '/',
+	'0', '1', '2', '3', '4', '5', '6', '7',
+	'8', '9', ':', ';', '<', '=', '>', '?',
+	'@', 'A', 'B', 'C', 'D', 'E', 'F', 'G',
+	'H', 'I', 'J', 'K', 'L', 'M', 'N', 'O',
+	'P', 'Q', 'R', 'S', 'T', 'U', 'V', 'W',
+	'X', 'Y', 'Z', '[', '\\', ']', '^', '_',
+	'`', 'a', 'b', 'c', 'd', 'e', 'f', 'g',
+	'h', 'i', 'j', 'k', 'l', 'm', 'n', 'o',
+	'p', 'q', 'r', 's', 't', 'u', 'v', 'w',
+	'x', 'y', 'z', '{', '|', '}', '~'
+};
+
+const char *g_corpus_kinds[CORPUS_KIND_COUNT] = { "ascii", "dna", "words", "periodic" };
+
+typedef u32 __attribute__((may_alias)) u32w;
+typedef u32 __attribute__((may_alias, aligned(1))) u32u;
+typedef char v16qi __attribute__((vector_size(16), may_alias));
+typedef char v16qu __attribute__((vector_size(16), may_alias, aligned(1)));
+
+#define SWAR_ONES ((u32)0x01010101)
+#define SWAR_HIGHS ((u32)0x80808080)
+#define SWAR_HAS_ZERO(V) (((V) - SWAR_ONES) & ~(V) & SWAR_HIGHS)
+
+static size_t StrLenByte(const char *p_str);
+static const char *StrChrByte(const char *p_str, const char c);
+static const void *MemChrByte(const void *p_buf, u8 c, size_t bufSz);
+static i32 MemCmpByte(const void *p_a, const void *p_b, size_t n);
+static void MemSetByte(void *p_buf, u8 c, size_t bufSz);
+static void MemCopyByte(void *p_dst, const void *p_src, size_t n);
+
+// Byte loops until StrPrimsSelect() picks something better
+StrPrims g_prims = {
+	"byte", StrLenByte, StrChrByte, MemChrByte, MemCmpByte, MemSetByte, MemCopyByte
+};
+
+static void CompileNone(MatchPattern *p_pat);
+static void CompileBadChar(MatchPattern *p_pat);
+static void CompileSunday(MatchPattern *p_pat);
+static void CompileTwoWay(MatchPattern *p_pat);
+static void CompileBmGs(MatchPattern *p_pat);
+static const char *ScanNaive(const MatchPattern *p_pat, const char *p_str, size_t strLen);
+static const char *ScanBoyerMoore(const MatchPattern *p_pat, const char *p_str, size_t strLen);
+static const char *ScanHorspool(const MatchPattern *p_pat, const char *p_str, size_t strLen);
+static const char *ScanSunday(const MatchPattern *p_pat, const char *p_str, size_t strLen);
+static const char *ScanTwoWay(const MatchPattern *p_pat, const char *p_str, size_t strLen);
+static const char *ScanBmGs(const MatchPattern *p_pat, const char *p_str, size_t strLen);
+
+const Matcher g_matchers[MATCHER_COUNT] = {
+	{ "std", StrStrNaiveA, CompileNone, ScanNaive },
+	{ "bm", StrStrBoyerMooreA, CompileBadChar, ScanBoyerMoore },
+	{ "horspool", StrStrHorspoolA, CompileBadChar, ScanHorspool },
+	{ "sunday", StrStrSundayA, CompileSunday, ScanSunday },
+	{ "twoway", StrStrTwoWayA, CompileTwoWay, ScanTwoWay },
+	{ "bmgs", StrStrBmGsA, CompileBmGs, ScanBmGs },
+};
+
+u32 g_match_mode = MATCHER_STD;
+
+static const char *g_corpus_words[] = {
+	"the", "of", "and", "to", "in", "a", "is", "that", "for", "it",
+	"as", "was", "with", "be", "by", "on", "not", "he", "this", "are",
+	"or", "his", "from", "at", "which", "but", "have", "an", "had", "they",
+	"string", "search"
+};
+
+//
+// Definitions
+//
+
+// Truncates toward zero. Division by zero and INT_MIN / -1 saturate.
+i32 idiv(i32 a, i32 b)
+{
+	if (b == 0 || (b == -1 && a == (i32)0x80000000))
+	{
+		return (a < 0) ? (i32)0x80000000 : 0x7FFFFFFF;
+	}
+	return a / b;
+}
+
+// Division by zero saturates, like MulDivU32()
+u32 udiv(u32 a, u32 b)
+{
+	return (b != 0) ? a / b : 0xFFFFFFFF;
+}
+
+u32 mod(u32 a, u32 b)
+{
+	return (b != 0) ? a % b : a;
+}
+
+// 64 by 32 bit division in two divl steps, so no libgcc __udivdi3 is needed
+u64 UDivMod64(u64 num, u32 den, u32 *p_rem)
+{
+	u32 hi = (u32)(num >> 32);
+	u32 lo = (u32)num;
+	u32 q_hi = 0;
+	u32 q_lo;
+	u32 rem = 0;
+
+	if (den == 0)
+	{
+		q_hi = q_lo = 0xFFFFFFFF;
+	}
+	else
+	{
+		if (hi >= den)
+		{
+			q_hi = hi / den;
+			hi = hi % den;
+		}
+		asm ("divl %3" : "=a" (q_lo), "=d" (rem) : "a" (lo), "rm" (den), "d" (hi));
+	}
+	if (p_rem != NULL)
+	{
+		*p_rem = rem;
+	}
+	return ((u64)q_hi << 32) | q_lo;
+}
+
+// a * b / c with a 64-bit intermediate, saturated to 32 bits
+u32 MulDivU32(u32 a, u32 b, u32 c)
+{
+	u64 prod = (u64)a * b;
+	u32 hi = (u32)(prod >> 32);
+	u32 lo = (u32)prod;
+	u32 res;
+
+	if (c == 0 || hi >= c)
+	{
+		return 0xFFFFFFFF;
+	}
+	asm ("divl %3" : "=a" (res), "=d" (hi) : "a" (lo), "rm" (c), "d" (hi));
+	return res;
+}
+
+static const char g_digit_pairs[201] =
+	"00010203040506070809101112131415161718192021222324252627282930313233343536373839"
+	"40414243444546474849505152535455565758596061626364656667686970717273747576777879"
+	"8081828384858687888990919293949596979899";
+static const char g_hex_digits[17] = "0123456789abcdef";
+
+// Decimal digits of num ending just before p_end, two per division by a
+// constant. Returns the first digit; the caller terminates the buffer.
+char *FmtDecA(char *p_end, u32 num)
+{
+	u32 q;
+
+	while (num >= 100)
+	{
+		q = num / 100;
+		p_end -= 2;
+		p_end[0] = g_digit_pairs[(num - q * 100) * 2];
+		p_end[1] = g_digit_pairs[(num - q * 100) * 2 + 1];
+		num = q;
+	}
+	if (num >= 10)
+	{
+		p_end -= 2;
+		p_end[0] = g_digit_pairs[num * 2];
+		p_end[1] = g_digit_pairs[num * 2 + 1];
+	}
+	else
+	{
+		*--p_end = (char)('0' + num);
+	}
+	return p_end;
+}
+
+// Lowercase hex digits of num ending just before p_end, one byte per step
+char *FmtHexA(char *p_end, u32 num)
+{
+	do
+	{
+		p_end -= 2;
+		p_end[0] = g_hex_digits[(num >> 4) & 0xF];
+		p_end[1] = g_hex_digits[num & 0xF];
+		num >>= 8;
+	} while (num != 0);
+	return (*p_end == '0') ? p_end + 1 : p_end;
+}
+
+char *itoa(size_t num, char *p_str, size_t base)
+{
+	char p_buf[FMT_NUM_SZ];
+	char *p_end = p_buf + sizeof(p_buf) - 1;
+	char *p;
+
+	*p_end = '\0';
+	if (base == 10)
+	{
+		p = FmtDecA(p_end, (u32)num);
+	}
+	else if (base == 16)
+	{
+		p = FmtHexA(p_end, (u32)num);
+	}
+	else
+	{
+		p = p_end;
+		do
+		{
+			*--p = g_hex_digits[num % base];
+			num /= base;
+		} while (num != 0);
+	}
+	g_prims.MemCopy(p_str, p, (size_t)(p_end - p) + 1);
+	return p_str;
+}
+
+errno_t StrCatA(char *p_dst, size_t dstSz, const char *p_src)
+{
+	errno_t res = SUCCESS;
+	size_t src_len = StrLenA(p_src);
+	char *p_from = (char *)p_src;
+	for (; dstSz > src_len || ((res = FAIL) && 0); dstSz--)
+	{
+		if (*p_dst == 0)
+		{
+			break;
+		}
+		p_dst++;
+	}
+	if (res == SUCCESS)
+	{
+		while (*p_from)
+		{
+			*p_dst = *p_from;
+			p_dst++;
+			p_from++;
+		}
+	}
+	return res;
+}
+
+errno_t StrCpyA(char *p_dst, size_t dstSz, const char *p_src)
+{
+	if (dstSz == 0)
+	{
+		return FAIL;
+	}
+	for (size_t i = 0; i < dstSz; i++)
+	{
+		p_dst[i] = p_src[i];
+		if (p_src[i] == '\0')
+		{
+			return SUCCESS;
+		}
+	}
+	// Truncated, still terminated
+	p_dst[dstSz - 1] = '\0';
+	return FAIL;
+}
+
+i8 StrCmpA(char *p_str, char *p_cmp)
+{
+	i8 res = 0;
+	while ((*p_str != '\0' && *p_cmp != '\0') && *p_str == *p_cmp)
+	{
+		p_str++;
+		p_cmp++;
+	}
+	res = (*p_str == *p_cmp) ? 0 : (*p_str > *p_cmp) ? 1
+										 : -1;
+	return res;
+}
+
+STR_OVERREAD i8 StrnCmpA(char *p_str, char *p_cmp, size_t n)
+{
+	i8 res = 0;
+	size_t i = 0;
+
+	// Equally aligned strings are compared a word at a time up to the first
+	// difference or terminator; the byte loop below settles the result
+	if ((((size_t)p_str ^ (size_t)p_cmp) & 3) == 0)
+	{
+		for (; i < n && ((size_t)(p_str + i) & 3); i++)
+		{
+			if (p_str[i] != p_cmp[i] || p_str[i] == 0)
+			{
+				break;
+			}
+		}
+		if (i < n && ((size_t)(p_str + i) & 3) == 0)
+		{
+			for (; n - i >= 4; i += 4)
+			{
+				u32 a = *(const u32w *)(p_str + i);
+				if (a != *(const u32w *)(p_cmp + i) || SWAR_HAS_ZERO(a))
+				{
+					break;
+				}
+			}
+		}
+	}
+
+	for (; i < n; i++)
+	{
+		if (p_str[i] != p_cmp[i])
+		{
+			res = (p_str[i] > p_cmp[i]) ? 1 : -1;
+			break;
+		}
+		if (p_str[i] == 0)
+		{
+			break;
+		}
+	}
+	return res;
+}
+
+size_t StrLenA(const char *p_str)
+{
+	return g_prims.Len(p_str);
+}
+
+const char *StrChrA(const char *p_str, const char c)
+{
+	return g_prims.Chr(p_str, c);
+}
+
+char *StrChrA(char *p_str, const char c)
+{
+	return (char *)g_prims.Chr(p_str, c);
+}
+
+const char *StrStrA(const char *p_str, const char *p_sub)
+{
+	MatchPattern pat;
+	const char *p_res;
+
+	PatternCompile(&pat, p_sub, g_match_mode);
+	TRACE_BEGIN("str.strstr", pat.Mode);
+	p_res = PatternFind(&pat, p_str);
+	TRACE_END("str.strstr", (p_res != NULL) ? p_res - p_str : -1);
+	return p_res;
+}
+
+// One-shot search: compile into a stack pattern and scan once
+static const char *MatcherOnce(u32 mode, const char *p_str, const char *p_sub)
+{
+	MatchPattern pat;
+	PatternCompile(&pat, p_sub, mode);
+	return PatternFind(&pat, p_str);
+}
+
+const char *StrStrNaiveA(const char *p_str, const char *p_sub)
+{
+	return MatcherOnce(MATCHER_STD, p_str, p_sub);
+}
+
+const char *StrStrBoyerMooreA(const char *p_str, const char *p_sub)
+{
+	return MatcherOnce(MATCHER_BM, p_str, p_sub);
+}
+
+const char *StrStrHorspoolA(const char *p_str, const char *p_sub)
+{
+	return MatcherOnce(MATCHER_HORSPOOL, p_str, p_sub);
+}
+
+const char *StrStrSundayA(const char *p_str, const char *p_sub)
+{
+	return MatcherOnce(MATCHER_SUNDAY, p_str, p_sub);
+}
+
+const char *StrStrTwoWayA(const char *p_str, const char *p_sub)
+{
+	return MatcherOnce(MATCHER_TWOWAY, p_str, p_sub);
+}
+
+const char *StrStrBmGsA(const char *p_str, const char *p_sub)
+{
+	return MatcherOnce(MATCHER_BMGS, p_str, p_sub);
+}
+
+size_t BoyerMoore(const char *p_str, const char *p_sub)
+{
+	const char *p_res = MatcherOnce(MATCHER_BM, p_str, p_sub);
+	return (p_res != NULL) ? (size_t)(p_res - p_str) : (size_t)-1;
+}
+
+//
+// Engines. Compile fills the pattern tables once, Scan only walks the
+// text; PatternFind() has already handled empty and too long patterns.
+//
+
+static void CompileNone(MatchPattern *p_pat)
+{
+	return;
+}
+
+static const char *ScanNaive(const MatchPattern *p_pat, const char *p_str, size_t strLen)
+{
+	const char *p_sub = p_pat->Sub;
+	size_t sub_len = p_pat->Len;
+
+	for (size_t off = 0; off <= strLen - sub_len; off++)
+	{
+		if (p_str[off] == p_sub[0] && g_prims.MemCmp(p_str + off, p_sub, sub_len) == 0)
+		{
+			return p_str + off;
+		}
+	}
+	return NULL;
+}
+
+// Last occurrence of every byte except the final one, distance to the end
+static void CompileBadChar(MatchPattern *p_pat)
+{
+	i32 len = (i32)p_pat->Len;
+	const u8 *p_x = (const u8 *)p_pat->Sub;
+
+	for (i32 i = 0; i < 256; i++)
+	{
+		p_pat->Shift[i] = len;
+	}
+	for (i32 i = 0; i + 1 < len; i++)
+	{
+		p_pat->Shift[p_x[i]] = len - 1 - i;
+	}
+}
+
+// Compare right to left, shift by the byte under the window's last position
+static const char *ScanBoyerMoore(const MatchPattern *p_pat, const char *p_str, size_t strLen)
+{
+	const char *p_sub = p_pat->Sub;
+	size_t sub_len = p_pat->Len;
+	size_t i, k, v;
+
+	TRACE_POINT("bm.scan", sub_len);
+	for (i = sub_len - 1; i < strLen; i += p_pat->Shift[(u8)p_str[i]])
+	{
+		v = sub_len - 1;
+		k = i;
+		while (p_str[k] == p_sub[v])
+		{
+			if (v == 0)
+			{
+				return p_str + k;
+			}
+			k--;
+			v--;
+		}
+	}
+	return NULL;
+}
+
+// Same table, but test the last byte first and the rest with MemCmp
+static const char *ScanHorspool(const MatchPattern *p_pat, const char *p_str, size_t strLen)
+{
+	const char *p_sub = p_pat->Sub;
+	size_t sub_len = p_pat->Len;
+	u8 last = (u8)p_sub[sub_len - 1];
+	size_t i;
+
+	for (i = 0; i <= strLen - sub_len; i += p_pat->Shift[(u8)p_str[i + sub_len - 1]])
+	{
+		if ((u8)p_str[i + sub_len - 1] == last && g_prims.MemCmp(p_str + i, p_sub, sub_len - 1) == 0)
+		{
+			return p_str + i;
+		}
+	}
+	return NULL;
+}
+
+// Quick search: shift on the byte just past the window, so at least one
+static void CompileSunday(MatchPattern *p_pat)
+{
+	i32 len = (i32)p_pat->Len;
+	const u8 *p_x = (const u8 *)p_pat->Sub;
+
+	for (i32 i = 0; i < 256; i++)
+	{
+		p_pat->Shift[i] = len + 1;
+	}
+	for (i32 i = 0; i < len; i++)
+	{
+		p_pat->Shift[p_x[i]] = len - i;
+	}
+}
+
+static const char *ScanSunday(const MatchPattern *p_pat, const char *p_str, size_t strLen)
+{
+	const char *p_sub = p_pat->Sub;
+	size_t sub_len = p_pat->Len;
+	size_t i;
+
+	// The last window stops before the shift, nothing past p_str[strLen - 1] is read
+	for (i = 0; i <= strLen - sub_len; i += p_pat->Shift[(u8)p_str[i + sub_len]])
+	{
+		if (g_prims.MemCmp(p_str + i, p_sub, sub_len) == 0)
+		{
+			return p_str + i;
+		}
+		if (i == strLen - sub_len)
+		{
+			break;
+		}
+	}
+	return NULL;
+}
+
+// Start of the maximal suffix of p_sub under the byte order (or its reverse), -1 for the whole pattern
+static i32 TwoWayMaxSuffix(const u8 *p_sub, i32 len, i32 *p_period, boolean isReverse)
+{
+	i32 ms = -1;
+	i32 j = 0;
+	i32 k = 1;
+	i32 p = 1;
+	u8 a, b;
+
+	while (j + k < len)
+	{
+		a = p_sub[j + k];
+		b = p_sub[ms + k];
+		if (isReverse ? (a > b) : (a < b))
+		{
+			j += k;
+			k = 1;
+			p = j - ms;
+		}
+		else if (a == b)
+		{
+			if (k != p)
+			{
+				k++;
+			}
+			else
+			{
+				j += p;
+				k = 1;
+			}
+		}
+		else
+		{
+			ms = j;
+			j = ms + 1;
+			k = p = 1;
+		}
+	}
+	*p_period = p;
+	return ms;
+}
+
+// Crochemore-Perrin critical factorisation: the later of the two maximal suffixes
+static void CompileTwoWay(MatchPattern *p_pat)
+{
+	const u8 *p_x = (const u8 *)p_pat->Sub;
+	i32 len = (i32)p_pat->Len;
+	i32 ell, per, ell_rev, per_rev;
+
+	ell = TwoWayMaxSuffix(p_x, len, &per, FALSE);
+	ell_rev = TwoWayMaxSuffix(p_x, len, &per_rev, TRUE);
+	if (ell_rev > ell)
+	{
+		ell = ell_rev;
+		per = per_rev;
+	}
+	p_pat->Ell = ell;
+	p_pat->IsPeriodic = (g_prims.MemCmp(p_x, p_x + per, ell + 1) == 0);
+	if (!p_pat->IsPeriodic)
+	{
+		per = ((ell + 1 > len - ell - 1) ? ell + 1 : len - ell - 1) + 1;
+	}
+	p_pat->Per = per;
+}
+
+// Linear time, constant space, immune to periodic inputs
+static const char *ScanTwoWay(const MatchPattern *p_pat, const char *p_str, size_t strLen)
+{
+	const u8 *p_x = (const u8 *)p_pat->Sub;
+	const u8 *p_y = (const u8 *)p_str;
+	i32 str_len = (i32)strLen;
+	i32 sub_len = (i32)p_pat->Len;
+	i32 ell = p_pat->Ell;
+	i32 per = p_pat->Per;
+	i32 memory, i, j;
+
+	if (p_pat->IsPeriodic)
+	{
+		// Remember how much of the left part already matched
+		memory = -1;
+		for (j = 0; j <= str_len - sub_len;)
+		{
+			i = ((ell > memory) ? ell : memory) + 1;
+			while (i < sub_len && p_x[i] == p_y[i + j])
+			{
+				i++;
+			}
+			if (i >= sub_len)
+			{
+				i = ell;
+				while (i > memory && p_x[i] == p_y[i + j])
+				{
+					i--;
+				}
+				if (i <= memory)
+				{
+					return p_str + j;
+				}
+				j += per;
+				memory = sub_len - per - 1;
+			}
+			else
+			{
+				j += i - ell;
+				memory = -1;
+			}
+		}
+	}
+	else
+	{
+		for (j = 0; j <= str_len - sub_len;)
+		{
+			i = ell + 1;
+			while (i < sub_len && p_x[i] == p_y[i + j])
+			{
+				i++;
+			}
+			if (i >= sub_len)
+			{
+				i = ell;
+				while (i >= 0 && p_x[i] == p_y[i + j])
+				{
+					i--;
+				}
+				if (i < 0)
+				{
+					return p_str + j;
+				}
+				j += per;
+			}
+			else
+			{
+				j += i - ell;
+			}
+		}
+	}
+	return NULL;
+}
+
+// p_suff[i]: length of the longest suffix of p_sub ending at i
+static void BmGsSuffixes(const u8 *p_sub, i32 len, i32 *p_suff)
+{
+	i32 f = 0;
+	i32 g = len - 1;
+
+	p_suff[len - 1] = len;
+	for (i32 i = len - 2; i >= 0; i--)
+	{
+		if (i > g && p_suff[i + len - 1 - f] < i - g)
+		{
+			p_suff[i] = p_suff[i + len - 1 - f];
+		}
+		else
+		{
+			if (i < g)
+			{
+				g = i;
+			}
+			f = i;
+			while (g >= 0 && p_sub[g] == p_sub[g + len - 1 - f])
+			{
+				g--;
+			}
+			p_suff[i] = f - g;
+		}
+	}
+}
+
+// Bad-character table plus the good-suffix shifts
+static void CompileBmGs(MatchPattern *p_pat)
+{
+	i32 p_suff[MATCHER_GS_MAX];
+	const u8 *p_x = (const u8 *)p_pat->Sub;
+	i32 len = (i32)p_pat->Len;
+	i32 *p_gs = p_pat->Gs;
+	i32 i, j;
+
+	CompileBadChar(p_pat);
+	BmGsSuffixes(p_x, len, p_suff);
+	for (i = 0; i < len; i++)
+	{
+		p_gs[i] = len;
+	}
+	j = 0;
+	for (i = len - 1; i >= 0; i--)
+	{
+		if (p_suff[i] == i + 1)
+		{
+			for (; j < len - 1 - i; j++)
+			{
+				if (p_gs[j] == len)
+				{
+					p_gs[j] = len - 1 - i;
+				}
+			}
+		}
+	}
+	for (i = 0; i <= len - 2; i++)
+	{
+		p_gs[len - 1 - p_suff[i]] = len - 1 - i;
+	}
+}
+
+static const char *ScanBmGs(const MatchPattern *p_pat, const char *p_str, size_t strLen)
+{
+	const u8 *p_x = (const u8 *)p_pat->Sub;
+	const u8 *p_y = (const u8 *)p_str;
+	i32 str_len = (i32)strLen;
+	i32 sub_len = (i32)p_pat->Len;
+	i32 i, j, bc;
+
+	for (j = 0; j <= str_len - sub_len;)
+	{
+		for (i = sub_len - 1; i >= 0 && p_x[i] == p_y[i + j]; i--)
+		{
+			continue;
+		}
+		if (i < 0)
+		{
+			return p_str + j;
+		}
+		bc = p_pat->Shift[p_y[i + j]] - sub_len + 1 + i;
+		j += (p_pat->Gs[i] > bc) ? p_pat->Gs[i] : bc;
+	}
+	return NULL;
+}
+
+void PatternCompile(MatchPattern *p_pat, const char *p_sub, u32 mode)
+{
+	p_pat->Sub = p_sub;
+	p_pat->Len = StrLenA(p_sub);
+	p_pat->Asked = mode;
+	p_pat->Mode = (mode == MATCHER_AUTO) ? MatcherAuto(p_sub) : mode;
+	if (p_pat->Mode == MATCHER_BMGS && p_pat->Len > MATCHER_GS_MAX)
+	{
+		// Good-suffix tables are fixed size, Two-Way is linear as well
+		p_pat->Mode = MATCHER_TWOWAY;
+	}
+	if (p_pat->Len == 0)
+	{
+		return;
+	}
+	TRACE_BEGIN("pat.compile", p_pat->Len);
+	g_matchers[p_pat->Mode].Compile(p_pat);
+	TRACE_END("pat.compile", p_pat->Mode);
+}
+
+const char *PatternFind(const MatchPattern *p_pat, const char *p_str)
+{
+	return PatternFindN(p_pat, p_str, (p_pat->Len != 0) ? StrLenA(p_str) : 0);
+}
+
+// First match within the len bytes at p_str, a caller walking one buffer
+// from match to match passes what is left instead of paying a StrLenA()
+const char *PatternFindN(const MatchPattern *p_pat, const char *p_str, size_t len)
+{
+	if (p_pat->Len == 0)
+	{
+		return p_str;
+	}
+	if (p_pat->Len > len)
+	{
+		return NULL;
+	}
+	return g_matchers[p_pat->Mode].Scan(p_pat, p_str, len);
+}
+
+void MatchStreamInit(MatchStream *p_ms, const MatchPattern *p_pat, const char *p_data, size_t size, MatchHit hit, void *p_ctx)
+{
+	p_ms->Pat = p_pat;
+	p_ms->Data = p_data;
+	p_ms->Size = size;
+	p_ms->ChunkSz = MATCH_CHUNK_SZ;
+	p_ms->Pos = 0;
+	p_ms->Chunks = 0;
+	p_ms->Hits = 0;
+	p_ms->Hit = hit;
+	p_ms->Ctx = p_ctx;
+}
+
+// Scans the next chunk in place and reports all of its matches, overlapping
+// ones included. FALSE once the whole stream is done.
+boolean MatchStreamNext(MatchStream *p_ms)
+{
+	const MatchPattern *p_pat = p_ms->Pat;
+	const char *p_win = p_ms->Data + p_ms->Pos;
+	const char *p_res;
+	size_t own;
+	size_t win;
+
+	if (p_ms->Pos >= p_ms->Size)
+	{
+		return FALSE;
+	}
+	own = p_ms->Size - p_ms->Pos;
+	own = (own < p_ms->ChunkSz) ? own : p_ms->ChunkSz;
+	win = p_ms->Size - p_ms->Pos;
+	win = (win < own + p_pat->Len - 1) ? win : own + p_pat->Len - 1;
+	p_ms->Pos += own;
+	p_ms->Chunks += 1;
+	if (p_pat->Len == 0)
+	{
+		return TRUE;
+	}
+
+	// A window holds only Len - 1 bytes past the chunk, so every match in it starts in the chunk
+	TRACE_BEGIN("pat.chunk", own);
+	while (win >= p_pat->Len)
+	{
+		p_res = g_matchers[p_pat->Mode].Scan(p_pat, p_win, win);
+		if (p_res == NULL)
+		{
+			break;
+		}
+		p_ms->Hits += 1;
+		p_ms->Hit(p_ms->Ctx, (size_t)(p_res - p_ms->Data));
+		win -= (size_t)(p_res + 1 - p_win);
+		p_win = p_res + 1;
+	}
+	TRACE_END("pat.chunk", p_ms->Hits);
+	return TRUE;
+}
+
+errno_t StrToUIntA(const char *p_str, size_t *p_val)
+{
+	size_t val = 0;
+
+	if (p_str == NULL || *p_str == '\0')
+	{
+		return FAIL;
+	}
+	for (; *p_str; p_str++)
+	{
+		if (*p_str < '0' || *p_str > '9' || val > ((size_t)-1 - (*p_str - '0')) / 10)
+		{
+			return FAIL;	// Not a digit, or more than a size_t holds
+		}
+		val = val * 10 + (*p_str - '0');
+	}
+	*p_val = val;
+	return SUCCESS;
+}
+
+// Next argument at or after *pp_cursor, spaces and tabs separate them. An
+// argument opening with a double or single quote runs to the matching
+// quote and keeps its spaces, the quotes are not part of the slice; an
+// unterminated quote runs to the end. Reads only, so any number of
+// callers can walk the same line.
+boolean StrTokNextA(const char **pp_cursor, StrSlice *p_tok)
+{
+	const char *p = *pp_cursor;
+	char quote;
+
+	for (; *p == ' ' || *p == '\t'; p++)
+	{
+		continue;
+	}
+	if (*p == '\0')
+	{
+		*pp_cursor = p;
+		return FALSE;
+	}
+	if (*p == '"' || *p == '\'')
+	{
+		quote = *p++;
+		p_tok->Ptr = p;
+		for (; *p && *p != quote; p++)
+		{
+			continue;
+		}
+	}
+	else
+	{
+		quote = ' ';
+		p_tok->Ptr = p;
+		for (; *p && *p != ' ' && *p != '\t'; p++)
+		{
+			continue;
+		}
+	}
+	p_tok->Len = (size_t)(p - p_tok->Ptr);
+	*pp_cursor = (*p != '\0') ? p + 1 : p;
+	return TRUE;
+}
+
+// Splits p_line in place: the byte after every argument (its separator or
+// closing quote) becomes the terminator, so the arguments are C strings
+// pointing into the line. Arguments past maxArgs are counted, not stored.
+size_t StrSplitArgsA(char *p_line, char **pp_args, size_t *p_lens, size_t maxArgs)
+{
+	const char *p_cursor = p_line;
+	StrSlice tok;
+	size_t count = 0;
+
+	while (StrTokNextA(&p_cursor, &tok))
+	{
+		if (count < maxArgs)
+		{
+			pp_args[count] = (char *)tok.Ptr;
+			p_lens[count] = tok.Len;
+		}
+		((char *)tok.Ptr)[tok.Len] = '\0';
+		count++;
+	}
+	return count;
+}
+
+char *StrTokA(char *p_str, const char *p_delim)
+{
+	static char *buf;
+	char *ret;
+	char *b;
+	const char *d;
+
+	if (p_str != NULL) buf = p_str;
+	if (buf[0] == '\0') return NULL;
+
+	ret = buf;
+
+	for (b = buf; *b != '\0'; b++)
+	{
+		for (d = p_delim; *d != '\0'; d++)
+		{
+			if (*b == *d)
+			{
+				*b = '\0';
+				buf = b + 1;
+
+				if (b == ret)
+				{
+					ret++;
+					continue;
+				}
+				return ret;
+			}
+		}
+	}
+
+	return ret;
+}
+
+errno_t IntToStrA(size_t val, char *p_buf, size_t bufSz)
+{
+	char p_num[FMT_NUM_SZ];
+	char *p_end = p_num + sizeof(p_num) - 1;
+
+	*p_end = '\0';
+	return StrCpyA(p_buf, bufSz, FmtDecA(p_end, (u32)val));
+}
+
+char ToUpper(const char c)
+{
+	if (IsLower(c))
+	{
+		return c - ('a' - 'A');
+	}
+	else
+	{
+		return c;
+	}
+}
+
+char ToLower(const char c)
+{
+	if (IsUpper(c))
+	{
+		return c + ('a' - 'A');
+	}
+	else
+	{
+		return c;
+	}
+}
+
+void ZeroMemory(void *p_buf, size_t bufSz)
+{
+	g_prims.MemSet(p_buf, 0, bufSz);
+}
+
+void CopyMemory(void *p_buf, void *p_data, size_t dataSz)
+{
+	g_prims.MemCopy(p_buf, p_data, dataSz);
+}
+
+//
+// Primitives: byte loops
+//
+
+static size_t StrLenByte(const char *p_str)
+{
+	size_t len = 0;
+	for (; p_str[len]; len++)
+	{
+		continue;
+	}
+	return len;
+}
+
+static const char *StrChrByte(const char *p_str, const char c)
+{
+	if (c == '\0')
+	{
+		return NULL;
+	}
+	for (; *p_str; p_str++)
+	{
+		if (*p_str == c)
+		{
+			return p_str;
+		}
+	}
+	return NULL;
+}
+
+static const void *MemChrByte(const void *p_buf, u8 c, size_t bufSz)
+{
+	const u8 *p = (const u8 *)p_buf;
+	for (; bufSz; bufSz--, p++)
+	{
+		if (*p == c)
+		{
+			return p;
+		}
+	}
+	return NULL;
+}
+
+static i32 MemCmpByte(const void *p_a, const void *p_b, size_t n)
+{
+	const u8 *p_x = (const u8 *)p_a;
+	const u8 *p_y = (const u8 *)p_b;
+	for (; n; n--, p_x++, p_y++)
+	{
+		if (*p_x != *p_y)
+		{
+			return (i32)*p_x - (i32)*p_y;
+		}
+	}
+	return 0;
+}
+
+static void MemSetByte(void *p_buf, u8 c, size_t bufSz)
+{
+	u8 *p = (u8 *)p_buf;
+	for (; bufSz; bufSz--)
+	{
+		*p = c;
+		p++;
+	}
+}
+
+static void MemCopyByte(void *p_dst, const void *p_src, size_t n)
+{
+	u8 *p_to = (u8 *)p_dst;
+	const u8 *p_from = (const u8 *)p_src;
+	for (; n; n--)
+	{
+		*p_to = *p_from;
+		p_to++;
+		p_from++;
+	}
+}
+
+//
+// Primitives: SWAR, four bytes per step with the has-zero-byte trick
+//
+
+STR_OVERREAD static size_t StrLenSwar(const char *p_str)
+{
+	const char *p = p_str;
+	const u32w *p_word;
+
+	for (; (size_t)p & 3; p++)
+	{
+		if (*p == '\0')
+		{
+			return (size_t)(p - p_str);
+		}
+	}
+	for (p_word = (const u32w *)p; !SWAR_HAS_ZERO(*p_word); p_word++)
+	{
+		continue;
+	}
+	for (p = (const char *)p_word; *p; p++)
+	{
+		continue;
+	}
+	return (size_t)(p - p_str);
+}
+
+STR_OVERREAD static const char *StrChrSwar(const char *p_str, const char c)
+{
+	u32 mask = (u8)c * SWAR_ONES;
+	const u32w *p_word;
+	u32 v;
+
+	if (c == '\0')
+	{
+		return NULL;
+	}
+	for (; (size_t)p_str & 3; p_str++)
+	{
+		if (*p_str == c || *p_str == '\0')
+		{
+			return (*p_str == c) ? p_str : NULL;
+		}
+	}
+	for (p_word = (const u32w *)p_str;; p_word++)
+	{
+		v = *p_word;
+		if (SWAR_HAS_ZERO(v) || SWAR_HAS_ZERO(v ^ mask))
+		{
+			break;
+		}
+	}
+	// The word holds the terminator or c, whichever comes first decides
+	return StrChrByte((const char *)p_word, c);
+}
+
+static const void *MemChrSwar(const void *p_buf, u8 c, size_t bufSz)
+{
+	const u8 *p = (const u8 *)p_buf;
+	u32 mask = c * SWAR_ONES;
+
+	for (; bufSz && ((size_t)p & 3); bufSz--, p++)
+	{
+		if (*p == c)
+		{
+			return p;
+		}
+	}
+	for (; bufSz >= 4; bufSz -= 4, p += 4)
+	{
+		if (SWAR_HAS_ZERO(*(const u32w *)p ^ mask))
+		{
+			break;
+		}
+	}
+	return MemChrByte(p, c, bufSz);
+}
+
+static i32 MemCmpSwar(const void *p_a, const void *p_b, size_t n)
+{
+	const u8 *p_x = (const u8 *)p_a;
+	const u8 *p_y = (const u8 *)p_b;
+
+	for (; n >= 4; n -= 4, p_x += 4, p_y += 4)
+	{
+		if (*(const u32u *)p_x != *(const u32u *)p_y)
+		{
+			break;
+		}
+	}
+	return MemCmpByte(p_x, p_y, n);
+}
+
+static void MemSetSwar(void *p_buf, u8 c, size_t bufSz)
+{
+	u8 *p = (u8 *)p_buf;
+	u32 fill = c * SWAR_ONES;
+
+	for (; bufSz && ((size_t)p & 3); bufSz--, p++)
+	{
+		*p = c;
+	}
+	for (; bufSz >= 4; bufSz -= 4, p += 4)
+	{
+		*(u32w *)p = fill;
+	}
+	MemSetByte(p, c, bufSz);
+}
+
+static void MemCopySwar(void *p_dst, const void *p_src, size_t n)
+{
+	u8 *p_to = (u8 *)p_dst;
+	const u8 *p_from = (const u8 *)p_src;
+
+	for (; n >= 4; n -= 4, p_to += 4, p_from += 4)
+	{
+		*(u32u *)p_to = *(const u32u *)p_from;
+	}
+	MemCopyByte(p_to, p_from, n);
+}
+
+//
+// Primitives: SSE2, sixteen bytes per step
+//
+
+__attribute__((target("sse2"), always_inline)) static inline u32 Sse2Mask(v16qi v, v16qi w)
+{
+	return (u32)__builtin_ia32_pmovmskb128((v16qi)(v == w));
+}
+
+__attribute__((target("sse2"), always_inline)) static inline v16qi Sse2Splat(u8 c)
+{
+	v16qi v = { (char)c, (char)c, (char)c, (char)c, (char)c, (char)c, (char)c, (char)c,
+		(char)c, (char)c, (char)c, (char)c, (char)c, (char)c, (char)c, (char)c };
+	return v;
+}
+
+STR_SSE2 STR_OVERREAD static size_t StrLenSse2(const char *p_str)
+{
+	const char *p = (const char *)((size_t)p_str & ~(size_t)15);
+	v16qi zero = Sse2Splat(0);
+	u32 bits = Sse2Mask(*(const v16qi *)p, zero) >> (p_str - p);
+
+	if (bits)
+	{
+		return __builtin_ctz(bits);
+	}
+	for (;;)
+	{
+		p += 16;
+		bits = Sse2Mask(*(const v16qi *)p, zero);
+		if (bits)
+		{
+			return (size_t)(p - p_str) + __builtin_ctz(bits);
+		}
+	}
+}
+
+STR_SSE2 STR_OVERREAD static const char *StrChrSse2(const char *p_str, const char c)
+{
+	const char *p = (const char *)((size_t)p_str & ~(size_t)15);
+	v16qi zero = Sse2Splat(0);
+	v16qi mask = Sse2Splat((u8)c);
+	v16qi v = *(const v16qi *)p;
+	u32 bits = (Sse2Mask(v, zero) | Sse2Mask(v, mask)) >> (p_str - p);
+
+	if (c == '\0')
+	{
+		return NULL;
+	}
+	if (bits)
+	{
+		p = p_str + __builtin_ctz(bits);
+		return (*p == c) ? p : NULL;
+	}
+	for (;;)
+	{
+		p += 16;
+		v = *(const v16qi *)p;
+		bits = Sse2Mask(v, zero) | Sse2Mask(v, mask);
+		if (bits)
+		{
+			p += __builtin_ctz(bits);
+			return (*p == c) ? p : NULL;
+		}
+	}
+}
+
+STR_SSE2 static const void *MemChrSse2(const void *p_buf, u8 c, size_t bufSz)
+{
+	const u8 *p = (const u8 *)p_buf;
+	v16qi mask = Sse2Splat(c);
+	u32 bits;
+
+	for (; bufSz >= 16; bufSz -= 16, p += 16)
+	{
+		bits = Sse2Mask(*(const v16qu *)p, mask);
+		if (bits)
+		{
+			return p + __builtin_ctz(bits);
+		}
+	}
+	return MemChrByte(p, c, bufSz);
+}
+
+STR_SSE2 static i32 MemCmpSse2(const void *p_a, const void *p_b, size_t n)
+{
+	const u8 *p_x = (const u8 *)p_a;
+	const u8 *p_y = (const u8 *)p_b;
+	u32 bits;
+
+	for (; n >= 16; n -= 16, p_x += 16, p_y += 16)
+	{
+		bits = Sse2Mask(*(const v16qu *)p_x, *(const v16qu *)p_y) ^ 0xFFFF;
+		if (bits)
+		{
+			bits = __builtin_ctz(bits);
+			return (i32)p_x[bits] - (i32)p_y[bits];
+		}
+	}
+	return MemCmpByte(p_x, p_y, n);
+}
+
+STR_SSE2 static void MemSetSse2(void *p_buf, u8 c, size_t bufSz)
+{
+	u8 *p = (u8 *)p_buf;
+	v16qi fill = Sse2Splat(c);
+
+	for (; bufSz >= 16; bufSz -= 16, p += 16)
+	{
+		*(v16qu *)p = fill;
+	}
+	MemSetByte(p, c, bufSz);
+}
+
+STR_SSE2 static void MemCopySse2(void *p_dst, const void *p_src, size_t n)
+{
+	u8 *p_to = (u8 *)p_dst;
+	const u8 *p_from = (const u8 *)p_src;
+
+	for (; n >= 16; n -= 16, p_to += 16, p_from += 16)
+	{
+		*(v16qu *)p_to = *(const v16qu *)p_from;
+	}
+	MemCopyByte(p_to, p_from, n);
+}
+
+static const StrPrims g_prims_all[STR_PRIMS_COUNT] = {
+	{ "byte", StrLenByte, StrChrByte, MemChrByte, MemCmpByte, MemSetByte, MemCopyByte },
+	{ "swar", StrLenSwar, StrChrSwar, MemChrSwar, MemCmpSwar, MemSetSwar, MemCopySwar },
+	{ "sse2", StrLenSse2, StrChrSse2, MemChrSse2, MemCmpSse2, MemSetSse2, MemCopySse2 },
+};
+
+// Best level the CPU supports. SSE2 still has to be enabled by the kernel.
+u32 StrPrimsDetect()
+{
+	u32 eax, ebx, ecx, edx;
+
+#if defined(__i386__)
+	u32 flags, orig;
+	// No CPUID unless EFLAGS.ID can be toggled
+	asm volatile (
+		"pushfl\n\t"
+		"popl %0\n\t"
+		"movl %0, %1\n\t"
+		"xorl $0x200000, %0\n\t"
+		"pushl %0\n\t"
+		"popfl\n\t"
+		"pushfl\n\t"
+		"popl %0\n\t"
+		"pushl %1\n\t"
+		"popfl"
+		: "=&r" (flags), "=&r" (orig));
+	if (((flags ^ orig) & 0x200000) == 0)
+	{
+		return STR_PRIMS_SWAR;
+	}
+#endif
+	asm volatile ("cpuid" : "=a" (eax), "=b" (ebx), "=c" (ecx), "=d" (edx) : "a" (0));
+	if (eax < 1)
+	{
+		return STR_PRIMS_SWAR;
+	}
+	asm volatile ("cpuid" : "=a" (eax), "=b" (ebx), "=c" (ecx), "=d" (edx) : "a" (1));
+	return (edx & (1 << 26)) ? STR_PRIMS_SSE2 : STR_PRIMS_SWAR;
+}
+
+boolean StrPrimsSelect(u32 level)
+{
+	if (level >= STR_PRIMS_COUNT)
+	{
+		return FALSE;
+	}
+	g_prims = g_prims_all[level];
+	return TRUE;
+}
+
+void AhoCorasickInit(AhoCorasick *p_ac, const char *p_name)
+{
+	StrCpyA(p_ac->Name, AC_NAME_MAX, p_name);
+	p_ac->WordCount = 0;
+	p_ac->TextLen = 0;
+	p_ac->NodeCount = 1;
+	p_ac->IsDirty = FALSE;
+	g_prims.MemSet(p_ac->Root, 0, sizeof(p_ac->Root));
+	g_prims.MemSet(&p_ac->Nodes[0], 0, sizeof(AcNode));
+}
+
+errno_t AhoCorasickAdd(AhoCorasick *p_ac, const char *p_word)
+{
+	size_t len = StrLenA(p_word);
+
+	if (len == 0 || len > 0xFF || p_ac->WordCount >= AC_WORD_MAX || p_ac->TextLen + len > AC_TEXT_MAX)
+	{
+		return FAIL;
+	}
+	g_prims.MemCopy(p_ac->Text + p_ac->TextLen, p_word, len);
+	p_ac->WordOff[p_ac->WordCount] = p_ac->TextLen;
+	p_ac->WordLen[p_ac->WordCount] = (u8)len;
+	p_ac->TextLen += (u16)len;
+	p_ac->WordCount += 1;
+	p_ac->IsDirty = TRUE;
+	return SUCCESS;
+}
+
+// Child of a non-root node on byte c, 0 if none
+static u16 AcGoto(const AhoCorasick *p_ac, u16 node, u8 c)
+{
+	const AcNode *p_node = &p_ac->Nodes[node];
+	const u8 *p_bytes = p_ac->EdgeByte + p_node->Edges;
+	size_t lo = 0;
+	size_t hi = p_node->Count;
+	size_t mid;
+
+	while (lo < hi)
+	{
+		mid = (lo + hi) / 2;
+		if (p_bytes[mid] < c)
+		{
+			lo = mid + 1;
+		}
+		else
+		{
+			hi = mid;
+		}
+	}
+	return (lo < p_node->Count && p_bytes[lo] == c) ? p_ac->EdgeNext[p_node->Edges + lo] : 0;
+}
+
+errno_t AhoCorasickCompile(AhoCorasick *p_ac)
+{
+	// Build-time trie with sorted sibling lists, rewritten into edge rows below
+	static u16 p_child[AC_NODE_MAX];
+	static u16 p_sibling[AC_NODE_MAX];
+	static u8 p_byte[AC_NODE_MAX];
+	static u16 p_queue[AC_NODE_MAX];
+	static u16 p_ends[AC_WORD_MAX];
+	u16 count = 1;
+	u16 node, next, prev, head, tail, edges, fail;
+	const u8 *p_word;
+	u8 c;
+
+	p_child[0] = 0;
+	for (u16 w = 0; w < p_ac->WordCount; w++)
+	{
+		p_word = (const u8 *)p_ac->Text + p_ac->WordOff[w];
+		node = 0;
+		for (u16 i = 0; i < p_ac->WordLen[w]; i++)
+		{
+			c = p_word[i];
+			prev = 0;
+			for (next = p_child[node]; next != 0 && p_byte[next] < c; next = p_sibling[next])
+			{
+				prev = next;
+			}
+			if (next == 0 || p_byte[next] != c)
+			{
+				if (count >= AC_NODE_MAX)
+				{
+					return FAIL;
+				}
+				p_byte[count] = c;
+				p_child[count] = 0;
+				p_sibling[count] = next;
+				if (prev == 0)
+				{
+					p_child[node] = count;
+				}
+				else
+				{
+					p_sibling[prev] = count;
+				}
+				next = count++;
+			}
+			node = next;
+		}
+		p_ends[w] = node;
+	}
+	for (node = 0; node < count; node++)
+	{
+		g_prims.MemSet(&p_ac->Nodes[node], 0, sizeof(AcNode));
+	}
+	for (u16 w = p_ac->WordCount; w > 0; w--)
+	{
+		// Backwards, so a duplicate word reports the first id
+		p_ac->Nodes[p_ends[w - 1]].Word = w;
+	}
+	p_ac->NodeCount = count;
+
+	// BFS: lay out each node's edges, then fail and output links of its children
+	g_prims.MemSet(p_ac->Root, 0, sizeof(p_ac->Root));
+	for (next = p_child[0]; next != 0; next = p_sibling[next])
+	{
+		p_ac->Root[p_byte[next]] = next;
+	}
+	edges = 0;
+	head = 0;
+	tail = 0;
+	p_queue[tail++] = 0;
+	while (head < tail)
+	{
+		node = p_queue[head++];
+		p_ac->Nodes[node].Edges = edges;
+		for (next = p_child[node]; next != 0; next = p_sibling[next])
+		{
+			p_ac->EdgeByte[edges] = p_byte[next];
+			p_ac->EdgeNext[edges] = next;
+			edges++;
+			p_ac->Nodes[node].Count++;
+			p_queue[tail++] = next;
+
+			if (node == 0)
+			{
+				continue;
+			}
+			c = p_byte[next];
+			for (fail = p_ac->Nodes[node].Fail; fail != 0 && AcGoto(p_ac, fail, c) == 0;)
+			{
+				fail = p_ac->Nodes[fail].Fail;
+			}
+			fail = (fail == 0) ? p_ac->Root[c] : AcGoto(p_ac, fail, c);
+			p_ac->Nodes[next].Fail = fail;
+			p_ac->Nodes[next].Out = p_ac->Nodes[fail].Word ? fail : p_ac->Nodes[fail].Out;
+		}
+	}
+	p_ac->IsDirty = FALSE;
+	return SUCCESS;
+}
+
+// One pass over the text, every occurrence of every word is reported
+size_t AhoCorasickScan(const AhoCorasick *p_ac, const char *p_str, AcHit hit, void *p_ctx)
+{
+	const AcNode *p_nodes = p_ac->Nodes;
+	size_t hits = 0;
+	u16 node = 0;
+	u16 next, out;
+	u8 c;
+
+	for (size_t i = 0; p_str[i]; i++)
+	{
+		c = (u8)p_str[i];
+		while (node != 0 && (next = AcGoto(p_ac, node, c)) == 0)
+		{
+			node = p_nodes[node].Fail;
+		}
+		node = (node == 0) ? p_ac->Root[c] : next;
+
+		out = p_nodes[node].Word ? node : p_nodes[node].Out;
+		for (; out != 0; out = p_nodes[out].Out)
+		{
+			if (hit != NULL)
+			{
+				hit(p_ctx, i + 1 - p_ac->WordLen[p_nodes[out].Word - 1], p_nodes[out].Word - 1);
+			}
+			hits++;
+		}
+	}
+	return hits;
+}
+
+errno_t BitapCompile(BitapPattern *p_bp, const char *p_sub)
+{
+	size_t len = StrLenA(p_sub);
+
+	if (len == 0 || len > BITAP_WORDS * 32)
+	{
+		return FAIL;
+	}
+	p_bp->Len = len;
+	p_bp->Words = (u32)((len + 31) / 32);
+	g_prims.MemSet(p_bp->Mask, 0, sizeof(p_bp->Mask));
+	for (size_t i = 0; i < len; i++)
+	{
+		p_bp->Mask[(u8)p_sub[i]][i / 32] |= 1u << (i % 32);
+	}
+	return SUCCESS;
+}
+
+// Wu-Manber: bit i of p_r[d] is set when the pattern prefix of length i + 1
+// matches a suffix of the text read so far with at most d edits. Level d
+// takes a match step of its own or an insertion, substitution or deletion
+// on top of level d - 1. Single register per level.
+static size_t BitapScan32(const BitapPattern *p_bp, const char *p_str, u32 k, BitapHit hit, void *p_ctx)
+{
+	u32 p_r[BITAP_K_MAX + 1];
+	u32 top = 1u << (p_bp->Len - 1);
+	size_t hits = 0;
+	u32 mask, prev, cur, d;
+
+	for (d = 0; d <= k; d++)
+	{
+		p_r[d] = (1u << d) - 1;			// d pattern bytes deleted before the text starts
+	}
+	for (size_t i = 0; p_str[i]; i++)
+	{
+		mask = p_bp->Mask[(u8)p_str[i]][0];
+		prev = p_r[0];
+		p_r[0] = ((prev << 1) | 1) & mask;
+		for (d = 1; d <= k; d++)
+		{
+			cur = p_r[d];
+			p_r[d] = (((cur << 1) | 1) & mask) | prev | ((prev | p_r[d - 1]) << 1) | 1;
+			prev = cur;
+		}
+		for (d = 0; d <= k; d++)
+		{
+			if (p_r[d] & top)
+			{
+				if (hit != NULL)
+				{
+					hit(p_ctx, i, d);
+				}
+				hits++;
+				break;
+			}
+		}
+	}
+	return hits;
+}
+
+// Same recurrence with the state spread over p_bp->Words registers; the
+// shifts carry the top bit of each word into the next one.
+static size_t BitapScanWide(const BitapPattern *p_bp, const char *p_str, u32 k, BitapHit hit, void *p_ctx)
+{
+	u32 p_r[BITAP_K_MAX + 1][BITAP_WORDS];
+	u32 p_prev[BITAP_WORDS];
+	u32 words = p_bp->Words;
+	u32 last = words - 1;
+	u32 top = 1u << ((p_bp->Len - 1) % 32);
+	size_t hits = 0;
+	const u32 *p_mask;
+	u32 cur, any, carry_m, carry_e, d, w;
+
+	g_prims.MemSet(p_r, 0, sizeof(p_r));
+	for (d = 0; d <= k; d++)
+	{
+		p_r[d][0] = (1u << d) - 1;
+	}
+	for (size_t i = 0; p_str[i]; i++)
+	{
+		p_mask = p_bp->Mask[(u8)p_str[i]];
+		carry_m = 1;
+		for (w = 0; w < words; w++)
+		{
+			cur = p_r[0][w];
+			p_r[0][w] = ((cur << 1) | carry_m) & p_mask[w];
+			carry_m = cur >> 31;
+			p_prev[w] = cur;
+		}
+		for (d = 1; d <= k; d++)
+		{
+			carry_m = 1;
+			carry_e = 1;
+			for (w = 0; w < words; w++)
+			{
+				cur = p_r[d][w];
+				any = p_prev[w] | p_r[d - 1][w];
+				p_r[d][w] = (((cur << 1) | carry_m) & p_mask[w]) | p_prev[w] | (any << 1) | carry_e;
+				carry_m = cur >> 31;
+				carry_e = any >> 31;
+				p_prev[w] = cur;
+			}
+		}
+		for (d = 0; d <= k; d++)
+		{
+			if (p_r[d][last] & top)
+			{
+				if (hit != NULL)
+				{
+					hit(p_ctx, i, d);
+				}
+				hits++;
+				break;
+			}
+		}
+	}
+	return hits;
+}
+
+// Every end position of a match within k edits (Levenshtein), k below the pattern length
+size_t BitapScan(const BitapPattern *p_bp, const char *p_str, u32 k, BitapHit hit, void *p_ctx)
+{
+	if (k > BITAP_K_MAX || k >= p_bp->Len)
+	{
+		return 0;
+	}
+	if (p_bp->Words == 1)
+	{
+		return BitapScan32(p_bp, p_str, k, hit, p_ctx);
+	}
+	return BitapScanWide(p_bp, p_str, k, hit, p_ctx);
+}
+
+// FNV-1a from its usual basis, never 0 so that 0 can mark an empty slot
+u32 StrHashA(const char *p_str)
+{
+	u32 hash = StrHashSeedA(p_str, STR_HASH_BASIS);
+
+	return (hash != 0) ? hash : 1;
+}
+
+void NameTableInit(NameTable *p_tab, NameEntry *p_slots, u32 slotCount)
+{
+	p_tab->Slots = p_slots;
+	p_tab->Mask = slotCount - 1;
+	p_tab->Count = 0;
+	g_prims.MemSet(p_slots, 0, slotCount * sizeof(NameEntry));
+}
+
+// Kept at most three quarters full so probe runs stay short
+boolean NameTableIsFull(const NameTable *p_tab)
+{
+	return (p_tab->Count + 1) * 4 > (p_tab->Mask + 1) * 3;
+}
+
+static u32 NameTableSlot(const NameTable *p_tab, const char *p_name, u32 hash)
+{
+	u32 i = hash & p_tab->Mask;
+
+	while (p_tab->Slots[i].Hash != 0)
+	{
+		if (p_tab->Slots[i].Hash == hash && StrCmpA(p_tab->Slots[i].Name, (char *)p_name) == 0)
+		{
+			break;
+		}
+		i = (i + 1) & p_tab->Mask;
+	}
+	return i;
+}
+
+NameEntry *NameTableFind(const NameTable *p_tab, const char *p_name)
+{
+	NameEntry *p_ent = &p_tab->Slots[NameTableSlot(p_tab, p_name, StrHashA(p_name))];
+	return (p_ent->Hash != 0) ? p_ent : NULL;
+}
+
+// NULL if the name is taken, too long, or the table needs a rehash first
+NameEntry *NameTableInsert(NameTable *p_tab, const char *p_name)
+{
+	u32 hash = StrHashA(p_name);
+	NameEntry *p_ent;
+
+	if (NameTableIsFull(p_tab) || StrLenA(p_name) >= NAMETAB_NAME_MAX)
+	{
+		return NULL;
+	}
+	p_ent = &p_tab->Slots[NameTableSlot(p_tab, p_name, hash)];
+	if (p_ent->Hash != 0)
+	{
+		return NULL;
+	}
+	p_ent->Hash = hash;
+	p_ent->Ptr = NULL;
+	p_ent->Size = 0;
+	StrCpyA(p_ent->Name, NAMETAB_NAME_MAX, p_name);
+	p_tab->Count += 1;
+	return p_ent;
+}
+
+// Every later entry of the run that may sit one slot earlier moves back
+boolean NameTableRemove(NameTable *p_tab, const char *p_name)
+{
+	u32 i = NameTableSlot(p_tab, p_name, StrHashA(p_name));
+	u32 j;
+
+	if (p_tab->Slots[i].Hash == 0)
+	{
+		return FALSE;
+	}
+	for (j = (i + 1) & p_tab->Mask; p_tab->Slots[j].Hash != 0; j = (j + 1) & p_tab->Mask)
+	{
+		// Skip entries whose home lies cyclically in (i, j]
+		if (((j - (p_tab->Slots[j].Hash & p_tab->Mask)) & p_tab->Mask) < ((j - i) & p_tab->Mask))
+		{
+			continue;
+		}
+		p_tab->Slots[i] = p_tab->Slots[j];
+		i = j;
+	}
+	p_tab->Slots[i].Hash = 0;
+	p_tab->Count -= 1;
+	return TRUE;
+}
+
+// Moves every entry into the new slots by its stored hash and returns the old slots
+NameEntry *NameTableRehash(NameTable *p_tab, NameEntry *p_slots, u32 slotCount)
+{
+	NameEntry *p_old = p_tab->Slots;
+	u32 old_count = p_tab->Mask + 1;
+	u32 i;
+
+	p_tab->Slots = p_slots;
+	p_tab->Mask = slotCount - 1;
+	g_prims.MemSet(p_slots, 0, slotCount * sizeof(NameEntry));
+	for (u32 n = 0; n < old_count; n++)
+	{
+		if (p_old[n].Hash == 0)
+		{
+			continue;
+		}
+		for (i = p_old[n].Hash & p_tab->Mask; p_slots[i].Hash != 0; i = (i + 1) & p_tab->Mask)
+		{
+			continue;
+		}
+		p_slots[i] = p_old[n];
+	}
+	return p_old;
+}
+
+// Occupied slots in table order; start with *p_iter = 0
+NameEntry *NameTableNext(const NameTable *p_tab, u32 *p_iter)
+{
+	for (; *p_iter <= p_tab->Mask; (*p_iter)++)
+	{
+		if (p_tab->Slots[*p_iter].Hash != 0)
+		{
+			return &p_tab->Slots[(*p_iter)++];
+		}
+	}
+	return NULL;
+}
+
+u32 MatcherLookup(const char *p_name)
+{
+	for (u32 mode = 0; mode < MATCHER_COUNT; mode++)
+	{
+		if (StrCmpA((char *)p_name, (char *)g_matchers[mode].Name) == 0)
+		{
+			return mode;
+		}
+	}
+	return (StrCmpA((char *)p_name, (char *)"auto") == 0) ? MATCHER_AUTO : MATCHER_NONE;
+}
+
+const char *MatcherName(u32 mode)
+{
+	if (mode < MATCHER_COUNT)
+	{
+		return g_matchers[mode].Name;
+	}
+	return (mode == MATCHER_AUTO) ? "auto" : "?";
+}
+
+boolean MatcherSelect(u32 mode)
+{
+	if (mode > MATCHER_AUTO)
+	{
+		return FALSE;
+	}
+	g_match_mode = mode;
+	return TRUE;
+}
+
+// Tables do not pay off for very short patterns. Patterns of one or two
+// distinct bytes are where bad-character engines go quadratic; the
+// good-suffix rule (Two-Way past MATCHER_GS_MAX) stays linear there.
+// Everything else goes to Sunday, fastest on the bench corpora.
+u32 MatcherAuto(const char *p_sub)
+{
+	u8 p_seen[256 / 8];
+	size_t len = 0;
+	size_t distinct = 0;
+	u8 c;
+
+	g_prims.MemSet(p_seen, 0, sizeof(p_seen));
+	for (; p_sub[len]; len++)
+	{
+		c = (u8)p_sub[len];
+		if ((p_seen[c >> 3] & (1 << (c & 7))) == 0)
+		{
+			p_seen[c >> 3] |= (u8)(1 << (c & 7));
+			distinct++;
+		}
+	}
+
+	if (len < 3)
+	{
+		return MATCHER_STD;
+	}
+	if (distinct <= 2)
+	{
+		return MATCHER_BMGS;
+	}
+	return MATCHER_SUNDAY;
+}
+
+u32 CorpusRandom(u32 *p_state)
+{
+	// xorshift32, same sequence on every run
+	u32 x = *p_state;
+	x ^= x << 13;
+	x ^= x >> 17;
+	x ^= x << 5;
+	*p_state = x;
+	return x;
+}
+
+void CorpusFill(char *p_buf, size_t size, size_t kind, u32 *p_seed)
+{
+	static const char p_dna[] = { 'A', 'C', 'G', 'T' };
+	const size_t word_count = sizeof(g_corpus_words) / sizeof(g_corpus_words[0]);
+	const char *p_word;
+	size_t i = 0;
+	u32 r;
+
+	while (i < size)
+	{
+		r = CorpusRandom(p_seed);
+		switch (kind)
+		{
+		case CORPUS_KIND_ASCII:
+			p_buf[i++] = alphabet[r % ALPHABET_SZ];
+			break;
+		case CORPUS_KIND_DNA:
+			p_buf[i++] = p_dna[r & 3];
+			break;
+		case CORPUS_KIND_WORDS:
+			// Skewed towards the first words, like real text
+			p_word = g_corpus_words[(r >> 8) % ((r & 0xFF) % word_count + 1)];
+			for (; *p_word && i < size; p_word++)
+			{
+				p_buf[i++] = *p_word;
+			}
+			if (i < size)
+			{
+				p_buf[i++] = ((r >> 24) < 16) ? '.' : ' ';
+			}
+			break;
+		default:
+			p_buf[i++] = 'a';
+			break;
+		}
+	}
+	p_buf[size] = '\0';
+}
+
+void CorpusPattern(char *p_sub, size_t len, const char *p_corpus, size_t size, size_t kind, u32 *p_seed)
+{
+	size_t off;
+
+	if (kind == CORPUS_KIND_PERIODIC)
+	{
+		// Never matches and keeps every matcher comparing half the pattern
+		for (off = 0; off < len; off++)
+		{
+			p_sub[off] = (off == len / 2) ? 'b' : 'a';
+		}
+	}
+	else
+	{
+		off = CorpusRandom(p_seed) % (size - len);
+		CopyMemory(p_sub, (void *)(p_corpus + off), len);
+	}
+	p_sub[len] = '\0';
+}
@@ -0,0 +1,323 @@
+#ifndef STRCORE_H
+#define STRCORE_H
+
+//
+// String and search core. Built freestanding into the kernel and as a
+// normal userspace library for the host benchmark and fuzzer.
+//
+
+#if __STDC_HOSTED__
+#include <stddef.h>
+#else
+typedef unsigned long size_t;
+#endif
+
+typedef unsigned char boolean;
+typedef unsigned char u8;
+typedef unsigned short u16;
+typedef unsigned int u32;
+typedef unsigned long long u64;
+typedef signed char i8;
+typedef signed short i16;
+typedef signed int i32;
+typedef signed int errno_t;
+
+#define BUFSIZE ((size_t)0xFF)
+
+#define SUCCESS						0
+#define FAIL						1
+#define ERR_NULL_POINTER			2
+
+#define FALSE 0
+#define TRUE 1
+
+#ifndef NULL
+#define NULL (0UL)
+#endif
+
+#define FMT_NUM_SZ ((size_t)33)	// A u32 in base 2 plus the terminator
+
+#define ALPHABET_SZ ((size_t)95)	// Printable ASCII, 32..126
+
+#define STR_PRIMS_BYTE 0	// Plain byte loops, always available
+#define STR_PRIMS_SWAR 1	// 32-bit word at a time
+#define STR_PRIMS_SSE2 2	// 16 bytes at a time, needs CPUID.1:EDX.SSE2 and CR4.OSFXSR
+#define STR_PRIMS_COUNT 3
+
+// Aligned loads may run past the terminator, never past the aligned block
+#define STR_OVERREAD __attribute__((no_sanitize_address))
+// The kernel stack is not kept 16-byte aligned, realign on entry
+#define STR_SSE2 __attribute__((target("sse2"), force_align_arg_pointer))
+
+#define MATCHER_STD 0			// Ids below MATCHER_COUNT match the boot mode byte
+#define MATCHER_BM 1
+#define MATCHER_HORSPOOL 2
+#define MATCHER_SUNDAY 3
+#define MATCHER_TWOWAY 4
+#define MATCHER_BMGS 5
+#define MATCHER_COUNT 6
+#define MATCHER_AUTO 6			// Pick per pattern, see MatcherAuto()
+#define MATCHER_NONE 7
+#define MATCHER_GS_MAX ((size_t)256)	// Longest pattern with good-suffix tables
+#define MATCH_CHUNK_SZ ((size_t)0x10000)	// Bytes a stream hands to the engine at once
+
+#define AC_NODE_MAX ((size_t)4096)	// Trie nodes per set, root included
+#define AC_WORD_MAX ((size_t)512)
+#define AC_TEXT_MAX ((size_t)4096)	// Bytes of all words of a set together
+#define AC_NAME_MAX ((size_t)16)
+
+#define NAMETAB_NAME_MAX ((size_t)32)	// Name bytes per entry, terminator included
+#define STR_HASH_BASIS ((u32)0x811C9DC5)	// FNV-1a offset basis, see StrHashSeedA()
+
+#define BITAP_WORDS ((size_t)8)		// 256 state bits, enough for any BUFSIZE template
+#define BITAP_K_MAX ((u32)8)		// Most edits fsearch will allow
+
+#define CORPUS_KIND_ASCII 0
+#define CORPUS_KIND_DNA 1
+#define CORPUS_KIND_WORDS 2
+#define CORPUS_KIND_PERIODIC 3
+#define CORPUS_KIND_COUNT 4
+
+#ifndef KTRACE
+#define KTRACE 1	// Build with -DKTRACE=0 to compile all probes out
+#endif
+#define TRACE_KIND_POINT 0
+#define TRACE_KIND_BEGIN 1
+#define TRACE_KIND_END 2
+#define TRACE_CLAMP(CYCLES) (((CYCLES) >> 32) ? (u32)0xFFFFFFFF : (u32)(CYCLES))
+
+#if KTRACE
+#define TRACE_POINT(NAME, PAYLOAD) TraceRecord(NAME, (u32)(PAYLOAD), TRACE_KIND_POINT)
+#define TRACE_BEGIN(NAME, PAYLOAD) TraceRecord(NAME, (u32)(PAYLOAD), TRACE_KIND_BEGIN)
+#define TRACE_END(NAME, PAYLOAD) TraceRecord(NAME, (u32)(PAYLOAD), TRACE_KIND_END)
+#else
+#define TRACE_POINT(NAME, PAYLOAD) ((void)0)
+#define TRACE_BEGIN(NAME, PAYLOAD) ((void)0)
+#define TRACE_END(NAME, PAYLOAD) ((void)0)
+#endif
+
+typedef struct _StrPrims
+{
+	const char *Name;
+	size_t (*Len)(const char *p_str);
+	const char *(*Chr)(const char *p_str, const char c);
+	const void *(*MemChr)(const void *p_buf, u8 c, size_t bufSz);
+	i32 (*MemCmp)(const void *p_a, const void *p_b, size_t n);
+	void (*MemSet)(void *p_buf, u8 c, size_t bufSz);
+	void (*MemCopy)(void *p_dst, const void *p_src, size_t n);
+} StrPrims;
+
+// A view into someone else's buffer, not terminated
+typedef struct _StrSlice
+{
+	const char *Ptr;
+	size_t Len;
+} StrSlice;
+
+// A pattern preprocessed once for one engine, reusable for any number of scans
+typedef struct _MatchPattern
+{
+	const char *Sub;			// Pattern text, owned by the caller
+	size_t Len;
+	u32 Asked;					// Mode passed to PatternCompile(), may be MATCHER_AUTO
+	u32 Mode;					// Engine the tables were built for
+	i32 Ell;					// Two-Way critical position
+	i32 Per;					// Two-Way shift on a full match
+	boolean IsPeriodic;
+	i32 Shift[256];				// Bad-character shifts, indexed by byte
+	i32 Gs[MATCHER_GS_MAX];		// Good-suffix shifts
+} MatchPattern;
+
+// Called for every match of a stream, with its offset from the stream start
+typedef void (*MatchHit)(void *p_ctx, size_t pos);
+
+// One engine walking a device that is mapped in memory, a chunk per call to
+// MatchStreamNext(). Each window reaches Len - 1 bytes into the next chunk,
+// so a match across the boundary is found once, by the chunk it starts in.
+typedef struct _MatchStream
+{
+	const MatchPattern *Pat;
+	const char *Data;			// Nothing past Data[Size - 1] is read
+	size_t Size;
+	size_t ChunkSz;
+	size_t Pos;					// First byte of the next chunk
+	u32 Chunks;
+	u32 Hits;
+	MatchHit Hit;
+	void *Ctx;
+} MatchStream;
+
+typedef struct _Matcher
+{
+	const char *Name;
+	const char *(*Find)(const char *p_str, const char *p_sub);
+	void (*Compile)(MatchPattern *p_pat);
+	const char *(*Scan)(const MatchPattern *p_pat, const char *p_str, size_t strLen);
+} Matcher;
+
+typedef struct _AcNode
+{
+	u16 Edges;					// First edge in EdgeByte/EdgeNext
+	u16 Fail;
+	u16 Out;					// Nearest node on the fail chain that ends a word
+	u16 Word;					// Word id + 1, 0 if no word ends here
+	u8 Count;					// Edges, sorted by byte
+} AcNode;
+
+// A named template set compiled into an Aho-Corasick automaton. The root
+// is a dense table, deeper nodes have sparse edge rows laid out in BFS order.
+typedef struct _AhoCorasick
+{
+	char Name[AC_NAME_MAX];
+	u16 WordCount;
+	u16 NodeCount;
+	u16 TextLen;
+	boolean IsDirty;			// Words added since the last compile
+	u16 WordOff[AC_WORD_MAX];
+	u8 WordLen[AC_WORD_MAX];
+	char Text[AC_TEXT_MAX];
+	u16 Root[256];
+	AcNode Nodes[AC_NODE_MAX];
+	u8 EdgeByte[AC_NODE_MAX];
+	u16 EdgeNext[AC_NODE_MAX];
+} AhoCorasick;
+
+// Called for every hit: start position in the text and the word id
+typedef void (*AcHit)(void *p_ctx, size_t pos, u16 word);
+
+// Shift-And masks: bit i of Mask[c] is set when the pattern has byte c at
+// position i. Patterns up to 32 bytes use only the first word of a row.
+typedef struct _BitapPattern
+{
+	size_t Len;
+	u32 Words;					// State words per error level
+	u32 Mask[256][BITAP_WORDS];
+} BitapPattern;
+
+// Called for every text position where a match ends, with the fewest edits it needs
+typedef void (*BitapHit)(void *p_ctx, size_t end, u32 edits);
+
+typedef struct _NameEntry
+{
+	u32 Hash;					// StrHashA() of the name, 0 marks an empty slot
+	void *Ptr;
+	size_t Size;
+	char Name[NAMETAB_NAME_MAX];
+} NameEntry;
+
+// Open addressing with linear probing over caller-provided slots. Removal
+// shifts the rest of the probe run back, so there are no tombstones.
+typedef struct _NameTable
+{
+	NameEntry *Slots;
+	u32 Mask;					// Slot count - 1, the count is a power of two
+	u32 Count;
+} NameTable;
+
+extern const char alphabet[ALPHABET_SZ];
+extern StrPrims g_prims;
+extern const Matcher g_matchers[MATCHER_COUNT];
+extern u32 g_match_mode;
+extern const char *g_corpus_kinds[CORPUS_KIND_COUNT];
+
+//
+// Prototypes
+//
+
+void TraceRecord(const char *p_name, u32 payload, u8 kind);
+
+i32 idiv(i32 a, i32 b);
+u32 udiv(u32 a, u32 b);
+u32 mod(u32 a, u32 b);
+u64 UDivMod64(u64 num, u32 den, u32 *p_rem);
+u32 MulDivU32(u32 a, u32 b, u32 c);
+char *FmtDecA(char *p_end, u32 num);
+char *FmtHexA(char *p_end, u32 num);
+char *itoa(size_t num, char *p_str, size_t base);
+
+errno_t StrCatA(char *p_dst, size_t dstSz, const char *p_src);
+errno_t StrCpyA(char *p_dst, size_t dstSz, const char *p_src);
+i8 StrCmpA(char *p_str, char *p_cmp);
+i8 StrnCmpA(char *p_str, char *p_cmp, size_t n);
+size_t StrLenA(const char *p_str);
+const char *StrChrA(const char *p_str, const char c);
+char *StrChrA(char *p_str, const char c);
+const char *StrStrA(const char *p_str, const char *p_sub);
+const char *StrStrNaiveA(const char *p_str, const char *p_sub);
+const char *StrStrBoyerMooreA(const char *p_str, const char *p_sub);
+const char *StrStrHorspoolA(const char *p_str, const char *p_sub);
+const char *StrStrSundayA(const char *p_str, const char *p_sub);
+const char *StrStrTwoWayA(const char *p_str, const char *p_sub);
+const char *StrStrBmGsA(const char *p_str, const char *p_sub);
+errno_t StrToUIntA(const char *p_str, size_t *p_val);
+boolean StrTokNextA(const char **pp_cursor, StrSlice *p_tok);
+size_t StrSplitArgsA(char *p_line, char **pp_args, size_t *p_lens, size_t maxArgs);
+char *StrTokA(char *p_str, const char *p_sub);
+errno_t IntToStrA(size_t val, char *p_buf, size_t bufSz);
+char ToUpper(const char c);
+char ToLower(const char c);
+
+u32 StrPrimsDetect();
+boolean StrPrimsSelect(u32 level);
+
+void ZeroMemory(void *p_buf, size_t bufSz);
+void CopyMemory(void *p_buf, void *p_data, size_t dataSz);
+
+size_t BoyerMoore(const char *p_str, const char *p_sub);
+void PatternCompile(MatchPattern *p_pat, const char *p_sub, u32 mode);
+const char *PatternFind(const MatchPattern *p_pat, const char *p_str);
+const char *PatternFindN(const MatchPattern *p_pat, const char *p_str, size_t len);
+void MatchStreamInit(MatchStream *p_ms, const MatchPattern *p_pat, const char *p_data, size_t size, MatchHit hit, void *p_ctx);
+boolean MatchStreamNext(MatchStream *p_ms);
+
+void AhoCorasickInit(AhoCorasick *p_ac, const char *p_name);
+errno_t AhoCorasickAdd(AhoCorasick *p_ac, const char *p_word);
+errno_t AhoCorasickCompile(AhoCorasick *p_ac);
+size_t AhoCorasickScan(const AhoCorasick *p_ac, const char *p_str, AcHit hit, void *p_ctx);
+
+u32 StrHashA(const char *p_str);
+void NameTableInit(NameTable *p_tab, NameEntry *p_slots, u32 slotCount);
+boolean NameTableIsFull(const NameTable *p_tab);
+NameEntry *NameTableFind(const NameTable *p_tab, const char *p_name);
+NameEntry *NameTableInsert(NameTable *p_tab, const char *p_name);
+boolean NameTableRemove(NameTable *p_tab, const char *p_name);
+NameEntry *NameTableRehash(NameTable *p_tab, NameEntry *p_slots, u32 slotCount);
+NameEntry *NameTableNext(const NameTable *p_tab, u32 *p_iter);
+
+errno_t BitapCompile(BitapPattern *p_bp, const char *p_sub);
+size_t BitapScan(const BitapPattern *p_bp, const char *p_str, u32 k, BitapHit hit, void *p_ctx);
+
+u32 MatcherLookup(const char *p_name);
+const char *MatcherName(u32 mode);
+boolean MatcherSelect(u32 mode);
+u32 MatcherAuto(const char *p_sub);
+
+u32 CorpusRandom(u32 *p_state);
+void CorpusFill(char *p_buf, size_t size, size_t kind, u32 *p_seed);
+void CorpusPattern(char *p_sub, size_t len, const char *p_corpus, size_t size, size_t kind, u32 *p_seed);
+
+inline boolean IsUpper(const char c)
+{
+	return (c >= 'A') && (c <= 'Z');
+}
+
+inline boolean IsLower(const char c)
+{
+	return (c >= 'a') && (c <= 'z');
+}
+
+// FNV-1a from the given offset basis. The low bits of FNV only see the low
+// bits of each byte; the top half is folded in, since tables index with
+// the low bits. constexpr for the built-in dispatch table.
+constexpr u32 StrHashSeedA(const char *p_str, u32 seed)
+{
+	u32 hash = seed;
+
+	for (; *p_str; p_str++)
+	{
+		hash = (hash ^ (u8)*p_str) * 0x01000193;
+	}
+	return hash ^ (hash >> 16);
+}
+
+#endif